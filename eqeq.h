@@ -0,0 +1,71 @@
+/* libeqeq: EQeq point charges through a plain C interface.
+ *
+ * A context holds one structure (cell, Cartesian coordinates, atomic numbers) and the
+ * parameters of the run; eqeq_compute writes one charge per atom, in the order the atoms were
+ * given, into a buffer owned by the caller. Functions return EQEQ_OK or an error code, and
+ * eqeq_last_error describes the last failure on that context. Nothing exits the process or
+ * writes to stdout.
+ *
+ * Contexts may be used from any thread, but there is only one engine and one lock in front of
+ * it: every eqeq_compute, whatever its context or thread, waits for the one running (and for
+ * Python eqeq calls in the same process) and never runs in parallel with it. A computation
+ * does not depend on other contexts; within a context, family=1 reuses the factorization of an
+ * earlier computation in the same cell.
+ */
+#ifndef EQEQ_H
+#define EQEQ_H
+
+#include <stddef.h>
+
+#define EQEQ_API __attribute__((visibility("default"))) /* The library hides everything else */
+
+#define EQEQ_ABI_VERSION 1 /* Bumped on any incompatible change below */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct eqeq_context eqeq_context;
+
+enum {
+	EQEQ_OK = 0,
+	EQEQ_INVALID_ARGUMENT = 1, /* Bad pointer, unknown element, method or parameter */
+	EQEQ_FAILED = 2, /* The engine could not finish (e.g. singular matrix or charges that are not
+	                    finite, memory budget too small) */
+	EQEQ_DEADLINE_EXCEEDED = 3 /* The "deadline" parameter ran out */
+};
+
+EQEQ_API int eqeq_abi_version(void);
+
+EQEQ_API eqeq_context *eqeq_create(void); /* NULL when out of memory */
+EQEQ_API void eqeq_destroy(eqeq_context *ctx);
+
+/* Rows are the lattice vectors a, b, c in Angstroms; NULL makes the structure a molecule
+ * (the NonPeriodic method) */
+EQEQ_API int eqeq_set_cell(eqeq_context *ctx, const double *cell /* [9] */);
+
+/* n atoms: xyz[3*i .. 3*i+2] in Angstroms, atomic numbers 1..84. Both arrays are copied. */
+EQEQ_API int eqeq_set_atoms(eqeq_context *ctx, size_t n, const double *xyz, const int *atomic_numbers);
+
+/* "ewald" (default), "direct", "wolf" or "nonperiodic" */
+EQEQ_API int eqeq_set_method(eqeq_context *ctx, const char *method);
+
+/* Same names and defaults as eqeq.run in Python: precision, charge (total), lambda, hI0, mR,
+ * mK, eta, rmax, kmax, tol, symmetry, supercell, spme, rcut, tree, tree_order, theta,
+ * wolf_alpha, max_memory, mixed_precision, hmatrix, aca_tol, screen, family and deadline
+ * (seconds, 0 = none). Flags are nonzero for true. */
+EQEQ_API int eqeq_set_parameter(eqeq_context *ctx, const char *name, double value);
+
+/* charges must hold as many doubles as there are atoms */
+EQEQ_API int eqeq_compute(eqeq_context *ctx, double *charges);
+
+/* Message of the last failed call on ctx. After a successful eqeq_compute it holds the run's
+ * warnings, one per line (e.g. a lattice sum or CG that did not converge), and "" after any
+ * other success. Valid until the next call. */
+EQEQ_API const char *eqeq_last_error(const eqeq_context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EQEQ_H */
@@ -73,19 +73,68 @@
 // 		- Various code optimizations                                                      //////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#if defined(EQEQ_CLI) || defined(EQEQ_BENCH) || defined(EQEQ_LIBRARY)
+#define EQEQ_STANDALONE	// Built as a program (eqeq_cli, eqeq_bench) or libeqeq rather than the Python module
+#endif
+#ifndef EQEQ_STANDALONE
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
+#include <optional>		// Context.set_cell(None)
+#include <array>
+#endif
 #include <iostream>		// To read files
 #include <fstream>		// To output files
 #include <sstream>
 #include <string>
 #include <vector>
 #include <map>			// For string enumeration (C++ specific)
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <numeric>
 #include <cmath>		// For basic math functions
+#include <complex>		// For the block-circulant (supercell) solver
 #include <cstdlib>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>	// For the on-disk result cache
+#include <unistd.h>		// getpid() for unique cache temp files, pread/pwrite for tile scratch files
+#include <fcntl.h>
+#include <sys/mman.h>	// read_store maps result files into NumPy without copying
+#include <sys/stat.h>
+#include <charconv>		// std::to_chars for the output writers
+#include <glob.h>		// Wildcard CIF arguments of the command-line program
+#include <sys/wait.h>	// The command-line program runs its workers as child processes
+#include <sys/resource.h>	// Peak memory for run(stats=True)
+#include <malloc.h>		// Heap usage (mallinfo2) for run(stats=True)
+#include <chrono>
+#include <ctime>
+#include <atomic>		// Cancellation flag of run_async
+#include <stdexcept>
+#include <mutex>		// run_async: one run at a time on a worker thread
+#include <thread>
+#include <condition_variable>
+#include <random>		// Synthetic structures of eqeq_bench
+#include "eqeq.h"		// The C API (libeqeq)
+#ifdef __linux__
+#include <linux/perf_event.h>	// Hardware counters of trace spans (EQEQ_TRACE_COUNTERS)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef EQEQ_HAVE_FFTW
+#include <fftw3.h>		// Optional, used by FFT3D when found at configure time
+#endif
+#ifdef EQEQ_HAVE_MPI
+#include <mpi.h>		// Optional, distributes the dense solve across ranks (EQEQ_USE_MPI)
+#endif
 using namespace std;
 
+#ifndef EQEQ_STANDALONE
 namespace py = pybind11;
+#endif
 
 #define TABLE_OF_ELEMENTS_SIZE 84
 #define PI 3.1415926535897932384626433832795	// 32 digits of PI
@@ -299,23 +348,283 @@ class IonizationDatum {
 		int chargeCenter;
 };
 
+class SymmetryOperator {
+	public:
+		SymmetryOperator();
+
+		double R[3][3]; // Rotation part, acting on fractional coordinates
+		double t[3]; // Translation part, in fractional coordinates
+};
+
+// Finds atoms by fractional position (periodic, within symprec) in O(1) per lookup
+class SiteLocator {
+	public:
+		SiteLocator(); // Uses the current unit cell
+
+		void Add(int index, double fx, double fy, double fz, const string &symbol);
+		int Find(double fx, double fy, double fz, const string &symbol); // -1 if there is no such site
+
+	private:
+		int nA; int nB; int nC; // Bins per axis (about 1 Angstrom wide)
+		unordered_map<long long, vector<int> > bins; // Bin -> entries
+		vector<Coordinates> siteFrac; vector<string> siteSymbol; vector<int> siteIndex;
+		long long BinKey(int u, int v, int w);
+};
+
+// Octree cell for the NonPeriodic tree code
+class TreeNode {
+	public:
+		TreeNode();
+
+		Coordinates center; // Expansion center (middle of the box)
+		double halfSize; // Half the box edge
+		double radius; // Largest distance from the center to an atom of the node
+		int first; int count; // Atoms TreeAtom[first .. first+count-1]
+		vector<int> children; // Empty for leaves
+};
+
+// Wall and CPU time of one phase of a run (parse, setup, assemble, solve, round), for run(stats=True)
+class PhaseStats {
+	public:
+		PhaseStats();
+
+		string name;
+		double wall; double cpu; // Seconds; CPU time is summed over threads
+		long long heapBytes; // Net growth of the heap during the phase
+};
+
+// One complete event of the Chrome trace: a span of time on this process
+class TraceEvent {
+	public:
+		TraceEvent();
+
+		const char *name;
+		long long index; // Tile, panel or structure number; negative when there is none
+		string file; // CIF the span worked on, if any
+		double start; double duration; // Microseconds
+		long long cycles; long long cacheMisses; // Negative without hardware counters
+};
+
+// Thrown by Checkpoint when the run is cancelled or runs past its deadline. Everything the
+// solvers allocate is owned by locals, so unwinding leaves nothing behind but the (discarded)
+// structure.
+class QeqInterrupted : public runtime_error {
+	public:
+		QeqInterrupted(bool deadline);
+
+		bool deadline; // false when cancelled
+};
+
+// Thrown where the engine cannot go on (unreadable input, failed I/O, a singular matrix). The
+// programs print the message and exit; Python sees a RuntimeError and the C API an error code.
+class EqeqError : public runtime_error {
+	public:
+		EqeqError(const string &message);
+};
+
+// Records a TraceEvent from construction to destruction while tracing is on; otherwise it
+// costs one test of traceEnabled
+class TraceSpan {
+	public:
+		TraceSpan(const char *name, long long index = -1, const string *file = nullptr);
+		~TraceSpan();
+		void End(); // Records the span now instead of at destruction
+
+	private:
+		bool active;
+		TraceEvent event;
+};
+
+// Block of the hierarchical (H-) matrix: atoms row..row+rowCount-1 against col..col+colCount-1
+class HBlock {
+	public:
+		HBlock();
+
+		int row; int rowCount; int col; int colCount;
+		int rank; // -1 for a dense block
+		vector<double> U; vector<double> V; // Low rank: sum_l U[l*rowCount + i] V[l*colCount + j]
+		vector<double> D; // Dense: row-major rowCount x colCount
+		vector<double> F; vector<double> Fd; // Diagonal blocks: L (unit lower) and D of LDL^T
+};
+
+// What family mode (useFamily) keeps from a parent, the first structure solved in a cell, for
+// its siblings: structures on the same framework and cell that differ in a few atoms
+class Family {
+	public:
+		Family();
+
+		bool Matches(); // The current cell and parameters are the parent's
+
+		double key[10]; // Cell lengths and angles, lambda, hI0, rcut, eta
+		int numAtoms; // Parent atoms, in Morton order; 0 when there is no parent
+		SiteLocator sites; // Parent atoms by fractional position and symbol
+		vector<int> blockStart; // Preconditioner blocks: parent atoms blockStart[b] .. blockStart[b+1]-1
+		vector<vector<double> > factor; // LDL^T of each block's near-field matrix; empty if it is not positive definite
+		vector<double> q; double mu; // Parent charges (unrounded) and electronegativity, the siblings' warm start
+};
+
+// Lower triangle of a symmetric n x n matrix as b x b row-major tiles (I >= J), held in
+// memory or in an unlinked scratch file, for the memory-bounded solver
+class TileMatrix {
+	public:
+		TileMatrix(int n, int b, bool inMemory, const string &scratchDir);
+		~TileMatrix();
+
+		void Read(int I, int J, double *tile);
+		void Write(int I, int J, const double *tile);
+
+		int n; int b; int numTiles;
+
+	private:
+		double *memory; // In the workspace
+		int fd; // -1 when in memory
+		size_t Offset(int I, int J) { return ((size_t)I*(I+1)/2 + J) * b * b; }
+};
+
+// Append-only columnar file of batch results. Structures are buffered column by column and
+// each Flush appends them as one chunk, in a single write on an O_APPEND descriptor, so the
+// worker processes of eqeq_cli can share one file. The layout is described in the README.
+class ResultStore {
+	public:
+		ResultStore(const string &path, const string &parameters); // parameters (JSON) become a META chunk unless empty
+		~ResultStore(); // Flushes
+
+		void Add(long long id, const string &path, double elapsed); // Label, Symbol and Q of the current structure
+		void Flush();
+
+		long long written; // Structures added so far
+
+	private:
+		int fd;
+		vector<long long> ids; vector<long long> atomOffsets; vector<double> seconds; vector<long long> pathOffsets;
+		vector<double> charges; vector<uint8_t> species; vector<long long> labelOffsets;
+		string paths; string labels;
+		void AppendChunk(const char *kind, const string &body, long long count0, long long count1, long long count2, long long count3);
+};
+const long long storeChunkAtoms = 1 << 16; // Buffered atoms that trigger a Flush
+
+// Buffers that outlive a run. Each slot grows to the largest size asked of it and is handed
+// to the next structure as is, so a worker charging many structures stops going back to the
+// allocator for its matrices. The memory is mapped directly and left untouched until the
+// solver writes it: the pages are first touched, and so placed on the NUMA node, by the
+// thread that assembles the matrix.
+enum WorkspaceSlot { ws_Matrix, ws_MatrixLow, ws_Count };
+class Workspace {
+	public:
+		Workspace();
+		~Workspace();
+
+		void *Buffer(WorkspaceSlot slot, size_t bytes); // Contents undefined
+		void Release(); // Unmaps everything
+		void *Detach(WorkspaceSlot slot, size_t &bytes); // Hands the slot's mapping (bytes long) to the caller
+		size_t Bytes(); // Mapped in all slots
+
+	private:
+		void *data[ws_Count];
+		size_t capacity[ws_Count];
+};
+
 // EQeq function headers (alphabetical order)
+bool AdaptiveCrossApproximation(HBlock &B); // Low-rank U V^T of a GetJ block; false if it is not worth it
+void AddAtom(const string &label, const string &symbol, Coordinates frac); // Appends an atom of the current cell, X and J from its symbol
+void AssembleHardness(double *A); // The full symmetric J, row-major, atoms in CIF order
+vector<double> BlockCirculantSolve(const vector<vector<complex<double> > > &Chat, const vector<double> &rhs);
+void BuildHMatrix(); // Cluster tree over the (Morton ordered) atoms and the blocks of the H-matrix
+void BuildOctree(); // Spatial tree over the atoms for the NonPeriodic tree code
+void BuildOverlapPairs(double cutoff); // NonPeriodic orbital overlap terms within cutoff
+void BuildRealSpacePairs(double cutoff, double splitting, bool shifted); // Cutoff-based real-space + overlap terms
+string CacheKey(int digits); // Canonical hash of the parsed structure and all run parameters
+void Checkpoint(const char *stage, double fraction); // Reports progress; throws QeqInterrupted on cancel or deadline
+void ConvergeDirectShells(); // Grows the Direct-sum image box shell by shell until it converges to directTol
+void DetectSupercell(); // Finds exact n1 x n2 x n3 translational replication of a smaller cell
 void DetermineReciprocalLatticeVectors();
+void ExpandSymmetryOperators(); // Generates the P1 cell from the asymmetric unit and records atom orbits
+void FinishStructure(); // After the last AddAtom: symmetry expansion, supercell detection
+void FFT3D(vector<complex<double> > &data, int n1, int n2, int n3, int sign); // Unnormalized
 double GetJ(int i, int j);
+void HashBytes(uint64_t &h, const void *data, size_t n);
+void HMatrixMultiply(const vector<double> &x, vector<double> &y); // y = J x from the H-matrix
 void InitializeStringAtomLabelsEnumeration();
 void LoadIonizationDataFromString(const std::string &data);
 void LoadChargeCentersFromString(const std::string &text);
 void LoadCIFFile(string filename); // Reads in CIF files, periodicity can be switched off
+void LoadSymmetryOperators(const string &data, size_t &blockStart, size_t &blockEnd);
+int MPIWorldRank(); // 0 in serial builds; initializes MPI on first use otherwise
+int MPIWorldSize(); // 1 in serial builds; initializes MPI on first use otherwise
+void OutputCIFFormatFile(const string &filename);
+void OutputMOLFormatFile(const string &filename);
+void OutputPDBFormatFile(const string &filename);
+SymmetryOperator ParseSymmetryOperator(const string &text); // e.g. "-x+1/2,y,-z"
+void PermuteAtoms(const vector<int> &order); // Atom n becomes the old atom order[n] in every per-atom array
 void Qeq();
+void QeqBatch(const vector<string> &paths, int digits, const function<void(size_t, double)> &emit,
+	const function<void(size_t, const EqeqError &)> &fail = nullptr); // Many small structures, solved BatchLanes at a time
+void QeqBlockCirculant(); // Solves a detected supercell one wavevector block at a time
+void QeqDense(); // The original formulation: dense A x = b from GetJ, solved by Gaussian elimination
+void QeqDistributed(); // MPI: J tiles spread block-cyclically over the ranks, CG on replicated vectors
+void QeqFamily(); // Framework families: SPME Ewald, CG warm-started and block-preconditioned from the parent
+void QeqHMatrix(); // H-matrix of J (ACA far field, dense near field), block-preconditioned CG
+void QeqMixedPrecision(); // Dense J in float, float LDL^T, double iterative refinement to chargePrecision
+void QeqScreen(); // Approximate charges (Wolf in float, a few CG sweeps) with an error estimate, refined if it is too large
+void QeqSPME(); // Matrix-free Ewald: real-space pair list + SPME reciprocal space, solved by CG
+void QeqTiled(); // Dense J as a tiled LDL^T within maxMemory, on disk if the matrix does not fit
+void QeqTree(); // Matrix-free NonPeriodic: tree code for 1/R, pair list for the overlap term, solved by CG
+void QeqWolf(); // Periodic, real space only: damped shifted force pair sums within rcut, solved by CG
+void QeqSymmetryAdapted(); // Solves for one charge per orbit of symmetry-equivalent atoms
+void ResetStats();
+bool ReadCachedCharges(const string &dir, const string &key); // Fills Q on a cache hit
+void RestoreAtomOrder(); // Undoes SortAtomsSpatially
 void RoundCharges(int digits); // Make *slight* adjustments to the charges for nice round numbers
+double Seconds(); // Steady clock, for deadlines
+void SetChargesFromResponses(const vector<double> &y1, const vector<double> &y2); // y1 = J^-1 1, y2 = J^-1 X
+void SetUnitCell(double a, double b, double c, double alpha, double beta, double gamma); // Lengths, angles in degrees
+void SetImageCounts(); // Per-axis real and reciprocal image extents from the cell widths (or mR/mK)
+void SetupLatticeSums(); // Image counts, and the Direct-sum shells when directTol is set
+void SetupSPME(double splitting); // Grid and influence function (kept while the cell is the same), spline weights
+void SortAtomsSpatially(); // Morton order of the (fractional) positions, for locality in the solvers
+function<void(const vector<double> &, vector<double> &)> SPMEOperator(vector<double> &diag); // Ewald J q of QeqSPME, and its diagonal
+void SPMEPotential(const vector<double> &q, vector<double> &phi); // Reciprocal-space part of J q
+void StatsPhase(const char *name); // Ends the running phase and starts name (nullptr only ends it)
+void TraceBegin(const string &path); // Starts recording trace spans for path
+double TraceClock(); // Microseconds
+void TraceCounters(long long &cycles, long long &cacheMisses); // Hardware counters of this process, or -1
+void TraceEnd(const string &extraEvents = ""); // Writes the trace file and stops recording
+string TraceEventsJSON(); // The recorded events, comma separated
+void TraceFlush(); // Appends the recorded events to the trace file and forgets them
+void TraceFromEnvironment(); // EQEQ_TRACE=file.json traces the whole process
+void TreePotential(const vector<double> &q, vector<double> &phi); // phi_i ~ sum_{j != i} q_j / R_ij
+void Warn(const string &message); // Printed, or kept in runWarnings for eqeq_last_error in libeqeq
+void WolfVersusEwald(double &maxDeviation, double &meanDeviation); // Wolf against converged (SPME) Ewald charges
+void WriteCachedCharges(const string &dir, const string &key);
+void WriteFile(const string &filename, const string &contents); // One write of the whole buffer
 
 // Algebra helper functions (alphaAnglebetical order)
+void AppendFixed(string &out, double value, int decimals, int width = 0, bool signSpace = false); // printf("% W.Df")
+void AppendInt(string &out, long long value, int width = 0); // printf("%Wd")
+void AppendJSONString(string &out, const string &text); // Quoted and escaped
+void BatchedLDLTSolve(double *A, double *B, int n, int numRHS, bool *singular); // BatchLanes systems interleaved lane-innermost
+void BSplineWeights(double w, int order, double *M); // M[s] = M_order(w + s), s = 0..order-1
+vector<double> ConjugateGradient(const function<void(const vector<double> &, vector<double> &)> &apply,
+	const vector<double> &diag, const vector<double> &b, double tol, int maxIterations, int &iterations);
+vector<double> ConjugateGradient(const function<void(const vector<double> &, vector<double> &)> &apply,
+	const function<void(const vector<double> &, vector<double> &)> &precondition, // z = M^-1 r
+	const vector<double> &b, double tol, int maxIterations, int &iterations);
+vector<double> ConjugateGradient(const function<void(const vector<double> &, vector<double> &)> &apply,
+	const function<void(const vector<double> &, vector<double> &)> &precondition,
+	const vector<double> &b, const vector<double> &x0, double tol, int maxIterations, int &iterations); // Starting from x0
 vector<double> Cross(vector<double> a, vector<double> b);
 double Dot(vector<double> a, vector<double> b);
+double LanczosConditionNumber(const vector<double> &alpha, const vector<double> &beta); // From the CG step lengths
+void LDLTFactor(double *A, int n); // In place, no pivoting: L strictly below the diagonal, D on it
+void LDLTSolve(const double *A, int n, double *x, int numRHS); // x (n x numRHS, row-major) = (L D L^T)^-1 x
 double Mag(vector<double> a);
+double RelativeResidual(const double *A, const vector<double> &x, const vector<double> &b); // |A x - b| / |b|, A row-major
 double Round(double num);
 vector<double> Scalar(double a, vector<double> b);
+void TaylorCoefficients(double x, double y, double z, int order, double *b); // 1/|x - y| expansion about y = 0
+vector<complex<double> > SolveComplexMatrix(vector<vector<complex<double> > > A, vector<complex<double> > b);
 vector<double> SolveMatrix(vector<vector<double> > A, vector<double> b);
+void SolveMatrixInPlace(double *A, int N, vector<double> &x); // SolveMatrix on a row-major A (overwritten); x = b on entry
 
 // Global variables
 bool isPeriodic = true;
@@ -328,12 +637,41 @@ vector<double> hV(3); vector<double> jV(3); vector<double> kV(3); // Reciprocal-
 int numAtoms; // To be read from input file
 double Qtot; // To be read in from file
 vector<Coordinates> Pos; // Array of atom positions
+vector<Coordinates> Frac; // Fractional atom positions, as read from the CIF
 vector<double> J; // Atom "hardness"
 vector<double> X; // Atom electronegativity
 vector<double> Q; // Partial atomic charge
+vector<int> AtomOrder; // While the atoms are in Morton order: CIF index of each atom (empty otherwise)
 vector<string> Label; // Atom labels (e.g., "C1" "C2" "ZnCation" "dummyAtom")
 vector<string> Symbol; // Atom symbols (e.g., "C" "O" "Zn")
 vector<IonizationDatum> IonizationData(TABLE_OF_ELEMENTS_SIZE);
+vector<SymmetryOperator> SymOps; // Symmetry operators read from the CIF (empty or identity => P1)
+vector<int> Orbit; // Index of the symmetry orbit each atom belongs to
+int numOrbits; // Number of symmetry-unique atoms (equals numAtoms when no symmetry is used)
+bool useSymmetry = true; // Solve in the reduced space of symmetry-unique atoms
+int nRep[3] = {1, 1, 1}; // Supercell replication along a, b, c (1 x 1 x 1 => not a supercell)
+vector<int> ReplicaAtom; // Atom index of primitive site s in replica cell c, stored at [s*numReplicas + c]
+bool useSupercell = false; // Use the block-circulant solver when the cell is an exact supercell (changes the charges at finite mR, mK)
+bool useSPME = false; // Matrix-free Ewald with smooth particle mesh reciprocal space
+vector<int> PairRowStart; vector<int> PairCol; vector<double> PairVal; // Real-space pairs (j > i), summed over images
+vector<double> PairDiag; // Real-space interaction of each atom with its own images
+int spmeK[3]; // SPME grid points along a, b, c
+vector<double> SPMEInfluence; // 4pi/V exp(-k^2 eta^2/4)/k^2 |b(k)|^2 on the grid
+double SPMERecipDiag; // Reciprocal-space diagonal of J on that grid
+double SPMEGridKey[9]; // Cell, splitting, spacing and order the grid was made for
+vector<int> SplineIndex; vector<double> SplineWeight; // Per atom and axis: spmeOrder grid points and weights
+bool useTree = false; // Fast multipole tree code for the NonPeriodic method
+vector<TreeNode> Tree; // Tree[0] is the root
+vector<int> TreeAtom; // Atom indices in tree order
+vector<int> MultiIndex; // (kx, ky, kz) of every Taylor term up to |k| = 2*treeOrder, by increasing |k|
+vector<int> TaylorPrev; // Per term: positions of k - e_x, k - e_y, k - e_z, k - 2e_x, k - 2e_y, k - 2e_z
+int numTreeTerms; // Terms with |k| <= treeOrder (multipole and local expansions)
+vector<int> M2LIndex; vector<double> M2LCoef; // (m, k, k+m) triples and (-1)^|m| C(k+m, m)
+vector<int> L2LIndex; vector<double> L2LCoef; // (m, n, n-m) triples and C(n, m)
+vector<int> TreeM2L; vector<double> TreeM2LKernel; // Well-separated (target, source) node pairs and their Taylor coefficients
+vector<int> TreeP2P; // (target, source) leaf pairs summed directly
+bool useWolf = false; // Damped shifted force real-space sums in place of Ewald
+bool useSpatialOrder = true; // Solve with the atoms sorted along a Morton curve
 
 // Parameters and constants
 double k = 14.4; // Physical constant: the vacuum permittivity 1/(4pi*epsi) [units of Angstroms * electron volts]
@@ -342,56 +680,86 @@ double lambda = 1.2; // Coulomb scaling parameter
 float hI0 = -2.0; // Default value used in paper
 float hI1 = 13.598; // This is the empirically mesaured 1st ionization energy of hydrogen
 int chargePrecision = 3; // Number of digits to use for point charges
-int mR = 2;  int mK = 2;
+int mR = 2;  int mK = 2; // Uniform image counts; -1 derives them per axis from realRadius/kCutoff
+double realRadius = 20.0; // Real-space image radius (Angstroms)
+double kCutoff = 1.25; // Reciprocal-space cutoff |h| (1/Angstroms)
+double directTol = 0; // Direct sums: stop adding image shells once a shell changes J by less than this (eV); 0 = fixed box
+int directMaxShells = 50;
+int directShells = 0; // Shells used by the last adaptive Direct run
+double directRadius = 0; // Direct sums only include translations shorter than this (0 = the whole box)
 int aVnum = mR; int bVnum = mR; int cVnum = mR; // Number of unit cells to consider in per. calc. ("real space")
 int hVnum = mK; int jVnum = mK; int kVnum = mK; // Number of unit cells to consider in per. calc. ("frequency space")
+double symprec = 0.05; // Two sites closer than this (Angstroms) are the same site when expanding symmetry
+double rcut = 12.0; // Real-space cutoff for the SPME and Wolf methods (Angstroms)
+double wolfAlpha = 0.2; // Damping parameter of the Wolf method (1/Angstroms)
+double maxMemory = 0; // Memory budget of the dense solve (MB); 0 = unbounded (the original solver)
+string scratchDir; // Where tiles go when the matrix exceeds maxMemory (empty = system temp directory)
+bool useMixedPrecision = false; // Factorize in float and refine in double
+bool useHugePages = false; // Ask for transparent huge pages behind the workspace matrices
+Workspace workspace; // Matrices of the dense, tiled, mixed-precision and symmetry-adapted solvers
+bool useHMatrix = false; // Hierarchical-matrix compression of J
+vector<TreeNode> HCluster; // Cluster tree over atom ranges; HCluster[0] is the root
+vector<double> HClusterBox; // Bounding box of each cluster: lo x, y, z, hi x, y, z
+vector<HBlock> HBlocks; // Blocks with row cluster before column cluster; the others follow by symmetry
+int maxRefinements = 20;
+double acaTol = 1e-8; // Relative accuracy of each low-rank block
+int hLeafSize = 64; // Atoms per cluster tree leaf
+int mpiTileSize = 128; // Tile edge of the distributed hardness matrix
+const int BatchLanes = 8; // Structures factorized side by side by QeqBatch
+int batchMaxAtoms = 64; // Larger structures in a batch go through Qeq one at a time
+int spmeOrder = 6; // B-spline interpolation order (even)
+double spmeSpacing = 1.0; // Target SPME grid spacing (Angstroms)
+int treeOrder = 4; // Multipole expansion order of the tree code
+const int maxTreeOrder = 12; // Beyond this the M2L tables are large and the Taylor recurrences lose digits
+double theta = 0.5; // Tree opening criterion: nodes interact through expansions when (rT + rS) < theta * distance
+int treeLeafSize = 16;
+double solverTol = 1e-8; // Relative residual for the iterative solver
+int solverMaxIterations = 1000;
+double screenTol = 0; // Screening: keep cheap tier-one charges whose estimated error is below this (0 = off)
+double screenCutoff = 8.0; // Wolf cutoff of the screening tier (Angstroms)
+int screenSweeps = 8; // CG iterations per right-hand side in the screening tier
+int screenEstimateSweeps = 3; // CG iterations of the Ewald correction behind the error estimate
+bool screenSkip = false; // Solve the next structure in full even when screening (structures the caller flags)
+unordered_set<string> screenRefine; // Paths QeqBatch solves in full when screening (run_batch refine=, eqeq_cli --refine)
+double screenEstimate = -1; // Estimated (not bounded) max charge error of the last screened structure; negative when not screened
+double screenSafety = 3; // Factor on the measured change behind screenEstimate; an empirical scale, see QeqScreen
+bool useFamily = false; // Solve sibling structures of a framework with what their parent left behind
+Family family; // Parent of the current family
+int familyBlockSize = 32; // Atoms per preconditioner block (consecutive in Morton order)
+int familyMatched = -1; // Atoms of the last structure found in its parent; negative for a parent or outside family mode
+double familyMinMatched = 0.5; // A structure with a smaller fraction of its atoms in the parent becomes the new parent
+
+// Run statistics (run(stats=True))
+bool collectStats = false;
+vector<PhaseStats> Phases; // In the order they first ran; a phase that runs again accumulates
+long long kernelCalls = 0; // GetJ evaluations
+string solverName;
+int solverIterations = 0; // CG iterations (both right-hand sides) or refinement steps
+double solverResidual = -1; // Relative residual of the final solution; negative when not measured
+double conditionEstimate = -1; // Lanczos estimate (CG) or pivot ratio (direct solvers); negative when not measured
+const int numThreads = 1; // The solvers are single-threaded
+
+// Tracing (EQEQ_TRACE=file.json, or trace= in Python)
+bool traceEnabled = false;
+string tracePath;
+vector<TraceEvent> TraceEvents; // Recorded since the last TraceFlush
+const size_t traceFlushEvents = 1 << 14; // Events held before they go to the file
+FILE *traceFile = nullptr; // Open from TraceBegin to TraceEnd
+bool traceFileEmpty = true; // No event has been written yet
+int traceOwner = 0; // Process that opened traceFile; forked workers keep their events
+int perfCycles = -1; int perfCacheMisses = -1; // perf_event_open descriptors (EQEQ_TRACE_COUNTERS=1)
+
+// Interruption of a running solve (run_async, run(deadline=...), eqeq_cli --deadline)
+const atomic<bool> *cancelFlag = nullptr; // Set from another thread to stop the run
+double deadlineTime = 0; // Seconds() after which the run gives up; 0 = no deadline
+function<void(const char *, double)> progressCallback; // stage, fraction of it done
+string runWarnings; // Warnings of the current eqeq_compute (libeqeq does not write to stdout)
+
+// Result cache
+const char cacheMagic[8] = {'E','Q','E','Q','C','H','G','1'}; // Bump the digit when the stored layout changes
+const int cacheVersion = 1; // Bump when a code change alters the charges for the same inputs
 /*****************************************************************************/
 /*****************************************************************************/
-// int main (int argc, char *argv[]) {
-// 	string inputFilename,method;
-//
-// 	// The only mandatory parameter is the input file parameter
-// 	if (argc <= 1) { cout << "Error, invalid input!" << endl; exit(1); }
-// 	if (argc > 1) inputFilename = argv[1];
-// 	if (argc > 2) lambda = atof(argv[2]); // The dielectric screening parameter (optional, default value above)
-// 	if (argc > 3) hI0 = atof(argv[3]); // The electron affinity of hydrogen (optional, default value above)
-// 	if (argc > 4) chargePrecision = atoi(argv[4]); // Num of digits to use for charges (optional, default value above)
-// 	if (argc > 5) {
-// 		method = argv[5];
-// 		if ((method == "NonPeriodic")||(method == "Nonperiodic")||(method == "nonperiodic")) isPeriodic = false;
-// 		else
-// 		if ((method == "Ewald")||(method == "ewald")) useEwardSums = true;
-// 		else
-// 		useEwardSums = false; // Direct sums are used if the 5th argument is misspelled
-// 	}
-// 	if (argc > 6) mR = atoi(argv[6]);
-// 	if (argc > 7) mK = atoi(argv[7]);
-// 	if (argc > 8) eta = atof(argv[8]);
-//
-// 	InitializeStringAtomLabelsEnumeration();  // Part of the clumsy way to enable string-based switch statements
-// 	LoadCIFFile(inputFilename);
-//
-// 	cout << "==================================================" << endl;
-// 	cout << "===== Calculating charges... please wait. ========" << endl;
-// 	Qtot = 0; // Can be non-zero for non-periodic structures
-// 	Qeq();
-// 	RoundCharges(chargePrecision);
-// 	cout << "===== ... done!                           ========" << endl;
-// 	cout << "==================================================" << endl;
-//
-// 	char buffer[50];
-// 	if (useEwardSums) method = "Ewald"; else method = "Direct";
-// 	if (!isPeriodic) method = "NonPeriodic";
-// 	sprintf(buffer,"_EQeq_%s_%4.2f_%4.2f",method.c_str(),lambda,hI0);
-//
-// 	OutputCIFFormatFile(inputFilename+buffer+".cif");
-// 	OutputMOLFormatFile(inputFilename+buffer+".mol");
-// 	OutputPDBFormatFile(inputFilename+buffer+".pdb");
-//
-// 	return 0;
-//
-// }
-/*****************************************************************************/
 /*****************************************************************************/
 Coordinates::Coordinates() {
   x = 0; y = 0; z = 0; // default coordinates
@@ -402,180 +770,1306 @@ IonizationDatum::IonizationDatum() {
 	ionizationPotential.resize(9,0);
 }
 /*****************************************************************************/
-void DetermineReciprocalLatticeVectors() {
-	vector<double> crs;
-	double pf; // pf => PreFactor
-
-	crs = Cross(bV, cV);
-	pf = 2*PI / Dot(aV, crs);
-	hV[0] = pf * crs[0];
-	hV[1] = pf * crs[1];
-	hV[2] = pf * crs[2];
-
-	crs = Cross(cV, aV);
-	pf = 2*PI / Dot(bV, crs);
-	jV[0] = pf * crs[0];
-	jV[1] = pf * crs[1];
-	jV[2] = pf * crs[2];
-
-	crs = Cross(aV, bV);
-	pf = 2*PI / Dot(cV, crs);
-	kV[0] = pf * crs[0];
-	kV[1] = pf * crs[1];
-	kV[2] = pf * crs[2];
+SymmetryOperator::SymmetryOperator() {
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++) R[r][c] = 0;
+		t[r] = 0;
+	}
 }
 /*****************************************************************************/
-void InitializeStringAtomLabelsEnumeration() {
-	s_mapStringAtomLabels["H "] = ev_H;	// 1
-	s_mapStringAtomLabels["He"] = ev_He;// 2
-	s_mapStringAtomLabels["Li"] = ev_Li;// 3
-	s_mapStringAtomLabels["Be"] = ev_Be;// 4
-	s_mapStringAtomLabels["B "] = ev_B;	// 5
-	s_mapStringAtomLabels["C "] = ev_C;	// 6
-	s_mapStringAtomLabels["N "] = ev_N;	// 7
-	s_mapStringAtomLabels["O "] = ev_O;	// 8
-	s_mapStringAtomLabels["F "] = ev_F;	// 9
-	s_mapStringAtomLabels["Ne"] = ev_Ne;//10
-	s_mapStringAtomLabels["Na"] = ev_Na;//11
-	s_mapStringAtomLabels["Mg"] = ev_Mg;//12
-	s_mapStringAtomLabels["Al"] = ev_Al;//13
-	s_mapStringAtomLabels["Si"] = ev_Si;//14
-	s_mapStringAtomLabels["P "] = ev_P;	//15
-	s_mapStringAtomLabels["S "] = ev_S;	//16
-	s_mapStringAtomLabels["Cl"] = ev_Cl;//17
-	s_mapStringAtomLabels["Ar"] = ev_Ar;//18
-	s_mapStringAtomLabels["K "] = ev_K ;//19
-	s_mapStringAtomLabels["Ca"] = ev_Ca;//20
-	s_mapStringAtomLabels["Sc"] = ev_Sc;//21
-	s_mapStringAtomLabels["Ti"] = ev_Ti;//22
-	s_mapStringAtomLabels["V "] = ev_V ;//23
-	s_mapStringAtomLabels["Cr"] = ev_Cr;//24
-	s_mapStringAtomLabels["Mn"] = ev_Mn;//25
-	s_mapStringAtomLabels["Fe"] = ev_Fe;//26
-	s_mapStringAtomLabels["Co"] = ev_Co;//27
-	s_mapStringAtomLabels["Ni"] = ev_Ni;//28
-	s_mapStringAtomLabels["Cu"] = ev_Cu;//29
-	s_mapStringAtomLabels["Zn"] = ev_Zn;//30
-	s_mapStringAtomLabels["Ga"] = ev_Ga;//31
-	s_mapStringAtomLabels["Ge"] = ev_Ge;//32
-	s_mapStringAtomLabels["As"] = ev_As;//33
-	s_mapStringAtomLabels["Se"] = ev_Se;//34
-	s_mapStringAtomLabels["Br"] = ev_Br;//35
-	s_mapStringAtomLabels["Kr"] = ev_Kr;//36
-	s_mapStringAtomLabels["Rb"] = ev_Rb;//37
-	s_mapStringAtomLabels["Sr"] = ev_Sr;//38
-	s_mapStringAtomLabels["Y "] = ev_Y ;//39
-	s_mapStringAtomLabels["Zr"] = ev_Zr;//40
-	s_mapStringAtomLabels["Nb"] = ev_Nb;//41
-	s_mapStringAtomLabels["Mo"] = ev_Mo;//42
-	s_mapStringAtomLabels["Tc"] = ev_Tc;//43
-	s_mapStringAtomLabels["Ru"] = ev_Ru;//44
-	s_mapStringAtomLabels["Rh"] = ev_Rh;//45
-	s_mapStringAtomLabels["Pd"] = ev_Pd;//46
-	s_mapStringAtomLabels["Ag"] = ev_Ag;//47
-	s_mapStringAtomLabels["Cd"] = ev_Cd;//48
-	s_mapStringAtomLabels["In"] = ev_In;//49
-	s_mapStringAtomLabels["Sn"] = ev_Sn;//50
-	s_mapStringAtomLabels["Sb"] = ev_Sb;//51
-	s_mapStringAtomLabels["Te"] = ev_Te;//52
-	s_mapStringAtomLabels["I "] = ev_I ;//53
-	s_mapStringAtomLabels["Xe"] = ev_Xe;//54
-	s_mapStringAtomLabels["Cs"] = ev_Cs;//55
-	s_mapStringAtomLabels["Ba"] = ev_Ba;//56
-	s_mapStringAtomLabels["La"] = ev_La;//57
-	s_mapStringAtomLabels["Ce"] = ev_Ce;//58
-	s_mapStringAtomLabels["Pr"] = ev_Pr;//59
-	s_mapStringAtomLabels["Nd"] = ev_Nd;//60
-	s_mapStringAtomLabels["Pm"] = ev_Pm;//61
-	s_mapStringAtomLabels["Sm"] = ev_Sm;//62
-	s_mapStringAtomLabels["Eu"] = ev_Eu;//63
-	s_mapStringAtomLabels["Gd"] = ev_Gd;//64
-	s_mapStringAtomLabels["Tb"] = ev_Tb;//65
-	s_mapStringAtomLabels["Dy"] = ev_Dy;//66
-	s_mapStringAtomLabels["Ho"] = ev_Ho;//67
-	s_mapStringAtomLabels["Er"] = ev_Er;//68
-	s_mapStringAtomLabels["Tm"] = ev_Tm;//69
-	s_mapStringAtomLabels["Yb"] = ev_Yb;//70
-	s_mapStringAtomLabels["Lu"] = ev_Lu;//71
-	s_mapStringAtomLabels["Hf"] = ev_Hf;//72
-	s_mapStringAtomLabels["Ta"] = ev_Ta;//73
-	s_mapStringAtomLabels["W "] = ev_W ;//74
-	s_mapStringAtomLabels["Re"] = ev_Re;//75
-	s_mapStringAtomLabels["Os"] = ev_Os;//76
-	s_mapStringAtomLabels["Ir"] = ev_Ir;//77
-	s_mapStringAtomLabels["Pt"] = ev_Pt;//78
-	s_mapStringAtomLabels["Au"] = ev_Au;//79
-	s_mapStringAtomLabels["Hg"] = ev_Hg;//80
-	s_mapStringAtomLabels["Tl"] = ev_Tl;//81
-	s_mapStringAtomLabels["Pb"] = ev_Pb;//82
-	s_mapStringAtomLabels["Bi"] = ev_Bi;//83
-	s_mapStringAtomLabels["Po"] = ev_Po;//84
+HBlock::HBlock() {
+	row = 0; rowCount = 0; col = 0; colCount = 0;
+	rank = -1;
 }
 /*****************************************************************************/
-double GetJ(int i, int j) {
-	// Note to reader - significant consolidation of code may be possible in this function
-	if (isPeriodic == false) {
-		//////////////////////////////////////////////////////////////////////
-		//  NonPeriodic                                                     //
-		//////////////////////////////////////////////////////////////////////
-		if (i == j) {
-			return J[i]; // Return the hardness/idempotential
-		} else {
-			double dx = Pos[i].x - Pos[j].x;
-			double dy = Pos[i].y - Pos[j].y;
-			double dz = Pos[i].z - Pos[j].z;
-			double RabSq = dx*dx + dy*dy + dz*dz;
-			double Rab = sqrt(RabSq);
-
-			double Jij = sqrt(J[i] * J[j]);
-			double a = Jij / k;
-			double orbitalOverlapTerm = exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab); // Other functional forms are OK too
-
-			double Jab = lambda * (k/2) * ((1/Rab) + orbitalOverlapTerm);
-
-			return Jab;
-		}
-		//////////////////////////////////////////////////////////////////////
-		//////////////////////////////////////////////////////////////////////
-	} else
-	if (isPeriodic == true) {
-		aVnum = mR; bVnum = mR; cVnum = mR; // Number of unit cells to consider in per. calc. (in "real space")
-		hVnum = mK; jVnum = mK; kVnum = mK; // Number of unit cells to consider in per. calc. (in "frequency space")
-		if (useEwardSums == false) {
-			//////////////////////////////////////////////////////////////////////
-			// Direct sums                                                      //
-			//////////////////////////////////////////////////////////////////////
-			if (i == j) {
-
-				double sigmaStar = 0;
-				for (int u = -aVnum; u <= aVnum; u++) {
-					for (int v = -bVnum; v <= bVnum; v++) {
-						for (int w = -cVnum; w <= cVnum; w++) {
-							if (!((u==0)&&(v==0)&&(w==0))) {
-								double dx = u*aV[0] + v*bV[0] + w*cV[0];
-								double dy = u*aV[1] + v*bV[1] + w*cV[1];
-								double dz = u*aV[2] + v*bV[2] + w*cV[2];
-								double Rab = sqrt(dx*dx + dy*dy + dz*dz);
-								double RabSq = dx*dx + dy*dy + dz*dz;
-
-								double Jij = sqrt(J[i] * J[j]);
-								double a = Jij / k;
-								double orbitalOverlapTerm = exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab);
-								// Other functional forms (for orbital overlap) are OK too
-
-								sigmaStar += (1/Rab) + orbitalOverlapTerm;
-							}
-						}
+Family::Family() {
+	for (int n = 0; n < 10; n++) key[n] = 0;
+	numAtoms = 0;
+	mu = 0;
+}
+/*****************************************************************************/
+bool Family::Matches() {
+	double current[10] = {aLength, bLength, cLength, alphaAngle, betaAngle, gammaAngle, lambda, hI0, rcut, eta};
+	return (numAtoms > 0) && equal(current, current + 10, key);
+}
+/*****************************************************************************/
+PhaseStats::PhaseStats() {
+	wall = 0; cpu = 0;
+	heapBytes = 0;
+}
+/*****************************************************************************/
+TraceEvent::TraceEvent() {
+	name = ""; index = -1;
+	start = 0; duration = 0;
+	cycles = -1; cacheMisses = -1;
+}
+/*****************************************************************************/
+EqeqError::EqeqError(const string &message) : runtime_error(message) {
+}
+/*****************************************************************************/
+QeqInterrupted::QeqInterrupted(bool deadline) : runtime_error(deadline ? "deadline exceeded" : "cancelled") {
+	this->deadline = deadline;
+}
+/*****************************************************************************/
+TraceSpan::TraceSpan(const char *name, long long index, const string *file) {
+	active = traceEnabled;
+	if (!active) return;
+	event.name = name; event.index = index;
+	if (file) event.file = *file;
+	TraceCounters(event.cycles, event.cacheMisses);
+	event.start = TraceClock();
+}
+/*****************************************************************************/
+TraceSpan::~TraceSpan() {
+	End();
+}
+/*****************************************************************************/
+void TraceSpan::End() {
+	if (!active || !traceEnabled) return;
+	active = false;
+	event.duration = TraceClock() - event.start;
+	long long cycles, cacheMisses;
+	TraceCounters(cycles, cacheMisses);
+	if (event.cycles >= 0) { event.cycles = cycles - event.cycles; event.cacheMisses = cacheMisses - event.cacheMisses; }
+	TraceEvents.push_back(event);
+	if (TraceEvents.size() >= traceFlushEvents) TraceFlush();
+}
+/*****************************************************************************/
+TreeNode::TreeNode() {
+	halfSize = 0; radius = 0;
+	first = 0; count = 0;
+}
+/*****************************************************************************/
+SiteLocator::SiteLocator() {
+	nA = max(1, (int)aLength); nB = max(1, (int)bLength); nC = max(1, (int)cLength);
+}
+/*****************************************************************************/
+long long SiteLocator::BinKey(int u, int v, int w) {
+	u = ((u % nA) + nA) % nA; v = ((v % nB) + nB) % nB; w = ((w % nC) + nC) % nC;
+	return ((long long)u*nB + v)*nC + w;
+}
+/*****************************************************************************/
+void SiteLocator::Add(int index, double fx, double fy, double fz, const string &symbol) {
+	Coordinates f;
+	f.x = fx - floor(fx); f.y = fy - floor(fy); f.z = fz - floor(fz);
+	bins[BinKey((int)(f.x*nA), (int)(f.y*nB), (int)(f.z*nC))].push_back(siteFrac.size());
+	siteFrac.push_back(f);
+	siteSymbol.push_back(symbol);
+	siteIndex.push_back(index);
+}
+/*****************************************************************************/
+int SiteLocator::Find(double fx, double fy, double fz, const string &symbol) {
+	fx -= floor(fx); fy -= floor(fy); fz -= floor(fz);
+	int u = (int)(fx*nA); int v = (int)(fy*nB); int w = (int)(fz*nC);
+
+	for (int du = -1; du <= 1; du++) {
+		for (int dv = -1; dv <= 1; dv++) {
+			for (int dw = -1; dw <= 1; dw++) {
+				auto bin = bins.find(BinKey(u+du, v+dv, w+dw));
+				if (bin == bins.end()) continue;
+				for (int m : bin->second) {
+					double d0 = fx - siteFrac[m].x; d0 -= Round(d0);
+					double d1 = fy - siteFrac[m].y; d1 -= Round(d1);
+					double d2 = fz - siteFrac[m].z; d2 -= Round(d2);
+					double dx = d0*aV[0] + d1*bV[0] + d2*cV[0];
+					double dy = d0*aV[1] + d1*bV[1] + d2*cV[1];
+					double dz = d0*aV[2] + d1*bV[2] + d2*cV[2];
+					if ((dx*dx + dy*dy + dz*dz < symprec*symprec) && (siteSymbol[m] == symbol)) {
+						return siteIndex[m];
 					}
 				}
-				return J[i] + lambda * (k/2)*sigmaStar;
-
-			} else {
-
-				double sigma = 0;
-				for (int u = -aVnum; u <= aVnum; u++) {
+			}
+		}
+	}
+	return -1;
+}
+/*****************************************************************************/
+ResultStore::ResultStore(const string &path, const string &parameters) {
+	written = 0;
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		throw EqeqError("Unable to open result store " + path);
+	}
+	struct stat info;
+	fstat(fd, &info);
+	if (info.st_size == 0) {
+		if (write(fd, "EQEQRES1", 8) != 8) {
+			throw EqeqError("Error writing result store " + path);
+		}
+	}
+	if (!parameters.empty()) AppendChunk("META", parameters, parameters.size(), 0, 0, 0);
+	atomOffsets.assign(1, 0); pathOffsets.assign(1, 0); labelOffsets.assign(1, 0);
+}
+/*****************************************************************************/
+ResultStore::~ResultStore() {
+	Flush();
+	close(fd);
+}
+/*****************************************************************************/
+void ResultStore::Add(long long id, const string &path, double elapsed) {
+	ids.push_back(id);
+	seconds.push_back(elapsed);
+	paths += path;
+	pathOffsets.push_back(paths.size());
+	for (int i = 0; i < numAtoms; i++) {
+		charges.push_back(Q[i]);
+		auto element = s_mapStringAtomLabels.find(Symbol[i]);
+		species.push_back((element == s_mapStringAtomLabels.end()) ? 0 : element->second + 1); // Atomic number
+		labels += Label[i];
+		labelOffsets.push_back(labels.size());
+	}
+	atomOffsets.push_back(charges.size());
+	written++;
+	if ((long long)charges.size() >= storeChunkAtoms) Flush();
+}
+/*****************************************************************************/
+void ResultStore::Flush() {
+	// Columns, each padded to 8 bytes: id[S], atom_offsets[S+1], seconds[S], path_offsets[S+1],
+	// charges[A], label_offsets[A+1], species[A], paths, labels
+	if (ids.empty()) return;
+	string body;
+	auto column = [&body](const void *data, size_t bytes) {
+		body.append((const char *)data, bytes);
+		body.append((8 - body.size() % 8) % 8, 0);
+	};
+	column(ids.data(), ids.size() * sizeof(long long));
+	column(atomOffsets.data(), atomOffsets.size() * sizeof(long long));
+	column(seconds.data(), seconds.size() * sizeof(double));
+	column(pathOffsets.data(), pathOffsets.size() * sizeof(long long));
+	column(charges.data(), charges.size() * sizeof(double));
+	column(labelOffsets.data(), labelOffsets.size() * sizeof(long long));
+	column(species.data(), species.size());
+	column(paths.data(), paths.size());
+	column(labels.data(), labels.size());
+	AppendChunk("RSLT", body, ids.size(), charges.size(), paths.size(), labels.size());
+
+	ids.clear(); seconds.clear(); charges.clear(); species.clear(); paths.clear(); labels.clear();
+	atomOffsets.assign(1, 0); pathOffsets.assign(1, 0); labelOffsets.assign(1, 0);
+}
+/*****************************************************************************/
+void ResultStore::AppendChunk(const char *kind, const string &body, long long count0, long long count1, long long count2, long long count3) {
+	// Header: kind[4], uint32 0, int64 chunk bytes (header included), int64 counts[4]
+	string chunk(48, 0);
+	memcpy(&chunk[0], kind, 4);
+	long long header[5] = {(long long)(48 + body.size() + (8 - body.size() % 8) % 8), count0, count1, count2, count3};
+	memcpy(&chunk[8], header, sizeof(header));
+	chunk += body;
+	chunk.append((8 - chunk.size() % 8) % 8, 0);
+	if (write(fd, chunk.data(), chunk.size()) != (ssize_t)chunk.size()) {
+		throw EqeqError("Error writing result store");
+	}
+}
+/*****************************************************************************/
+Workspace::Workspace() {
+	for (int s = 0; s < ws_Count; s++) { data[s] = nullptr; capacity[s] = 0; }
+}
+/*****************************************************************************/
+Workspace::~Workspace() {
+	Release();
+}
+/*****************************************************************************/
+void *Workspace::Buffer(WorkspaceSlot slot, size_t bytes) {
+	if (bytes <= capacity[slot]) return data[slot];
+	if (data[slot]) munmap(data[slot], capacity[slot]);
+	size_t page = 2 << 20; // Huge page size, so the mapping can be backed by them
+	size_t size = (bytes + page - 1) / page * page;
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		throw EqeqError("Unable to allocate " + to_string(size) + " bytes for the hardness matrix");
+	}
+#ifdef MADV_HUGEPAGE
+	if (useHugePages) madvise(p, size, MADV_HUGEPAGE); // Advisory: falls back to 4K pages silently
+#endif
+	data[slot] = p; capacity[slot] = size;
+	return p;
+}
+/*****************************************************************************/
+void Workspace::Release() {
+	for (int s = 0; s < ws_Count; s++) {
+		if (data[s]) munmap(data[s], capacity[s]);
+		data[s] = nullptr; capacity[s] = 0;
+	}
+}
+/*****************************************************************************/
+void *Workspace::Detach(WorkspaceSlot slot, size_t &bytes) {
+	// The next Buffer call maps a fresh block; the caller munmaps this one
+	void *p = data[slot];
+	bytes = capacity[slot];
+	data[slot] = nullptr; capacity[slot] = 0;
+	return p;
+}
+/*****************************************************************************/
+size_t Workspace::Bytes() {
+	size_t total = 0;
+	for (int s = 0; s < ws_Count; s++) total += capacity[s];
+	return total;
+}
+/*****************************************************************************/
+TileMatrix::TileMatrix(int n_, int b_, bool inMemory, const string &scratchDir) {
+	n = n_; b = b_; numTiles = (n + b - 1) / b;
+	size_t size = Offset(numTiles, 0);
+	fd = -1;
+	memory = nullptr;
+	if (inMemory) { // Every tile is written by the assembly before it is read
+		memory = (double *)workspace.Buffer(ws_Matrix, size * sizeof(double));
+		return;
+	}
+	string dir = scratchDir.empty() ? std::filesystem::temp_directory_path().string() : scratchDir;
+	string path = dir + "/eqeq_tiles_" + to_string(getpid()) + "_XXXXXX";
+	vector<char> name(path.begin(), path.end()); name.push_back(0);
+	fd = mkstemp(name.data());
+	if ((fd < 0) || (ftruncate(fd, size * sizeof(double)) != 0)) {
+		throw EqeqError("Unable to create scratch file in " + dir);
+	}
+	unlink(name.data()); // The space is released when fd is closed, even after a crash
+}
+/*****************************************************************************/
+TileMatrix::~TileMatrix() {
+	if (fd >= 0) close(fd);
+}
+/*****************************************************************************/
+void TileMatrix::Read(int I, int J, double *tile) {
+	size_t count = (size_t)b * b;
+	if (fd < 0) {
+		memcpy(tile, &memory[Offset(I, J)], count * sizeof(double));
+		return;
+	}
+	if (pread(fd, tile, count * sizeof(double), Offset(I, J) * sizeof(double)) != (ssize_t)(count * sizeof(double))) {
+		throw EqeqError("Error reading scratch file");
+	}
+}
+/*****************************************************************************/
+void TileMatrix::Write(int I, int J, const double *tile) {
+	size_t count = (size_t)b * b;
+	if (fd < 0) {
+		memcpy(&memory[Offset(I, J)], tile, count * sizeof(double));
+		return;
+	}
+	if (pwrite(fd, tile, count * sizeof(double), Offset(I, J) * sizeof(double)) != (ssize_t)(count * sizeof(double))) {
+		throw EqeqError("Error writing scratch file");
+	}
+}
+/*****************************************************************************/
+bool AdaptiveCrossApproximation(HBlock &B) {
+	// Partially pivoted ACA: each step takes the residual row at the pivot row, its largest
+	// entry as the pivot column, and the residual column there, so a rank-k block costs
+	// k (m + n) kernel calls. It stops when the new term is below acaTol times the running
+	// Frobenius estimate, and gives up once the rank passes half the smaller dimension,
+	// where dense storage is cheaper.
+	TraceSpan span("ACA block");
+	int m = B.rowCount; int n = B.colCount;
+	int maxRank = min(m, n) / 2;
+	B.U.clear(); B.V.clear(); B.rank = 0;
+	if (maxRank < 1) return false;
+
+	vector<bool> rowUsed(m, false); vector<bool> colUsed(n, false);
+	vector<double> u(m), v(n);
+	double normSq = 0;
+	int i = 0;
+	while (true) {
+		rowUsed[i] = true;
+		for (int j = 0; j < n; j++) {
+			v[j] = GetJ(B.row + i, B.col + j);
+			for (int l = 0; l < B.rank; l++) v[j] -= B.U[l*m + i] * B.V[l*n + j];
+		}
+		int jp = -1;
+		for (int j = 0; j < n; j++) if (!colUsed[j] && ((jp < 0) || (fabs(v[j]) > fabs(v[jp])))) jp = j;
+		if ((jp < 0) || (fabs(v[jp]) == 0)) {
+			// This row is already reproduced exactly; try the next unused one
+			i = -1;
+			for (int r = 0; r < m; r++) if (!rowUsed[r]) { i = r; break; }
+			if (i < 0) break;
+			continue;
+		}
+		colUsed[jp] = true;
+		double pivot = v[jp];
+		for (int j = 0; j < n; j++) v[j] /= pivot;
+		for (int r = 0; r < m; r++) {
+			u[r] = GetJ(B.row + r, B.col + jp);
+			for (int l = 0; l < B.rank; l++) u[r] -= B.V[l*n + jp] * B.U[l*m + r];
+		}
+
+		double uu = 0; double vv = 0; double cross = 0;
+		for (int r = 0; r < m; r++) uu += u[r]*u[r];
+		for (int j = 0; j < n; j++) vv += v[j]*v[j];
+		for (int l = 0; l < B.rank; l++) {
+			double uUl = 0; double vVl = 0;
+			for (int r = 0; r < m; r++) uUl += u[r] * B.U[l*m + r];
+			for (int j = 0; j < n; j++) vVl += v[j] * B.V[l*n + j];
+			cross += uUl * vVl;
+		}
+		normSq += uu*vv + 2*cross;
+		B.U.insert(B.U.end(), u.begin(), u.end());
+		B.V.insert(B.V.end(), v.begin(), v.end());
+		B.rank++;
+
+		if (sqrt(uu*vv) <= acaTol * sqrt(fabs(normSq))) break;
+		if (B.rank >= maxRank) return false;
+		i = -1;
+		for (int r = 0; r < m; r++) if (!rowUsed[r] && ((i < 0) || (fabs(u[r]) > fabs(u[i])))) i = r;
+		if (i < 0) break;
+	}
+	return true;
+}
+/*****************************************************************************/
+vector<double> BlockCirculantSolve(const vector<vector<complex<double> > > &Chat, const vector<double> &rhs) {
+	// Solves J y = rhs for the block-circulant J whose first block row has the DFT Chat
+	// (see QeqBlockCirculant). With y_a(R) and rhs_a(R) transformed over R, each wavevector k
+	// decouples into sum_b Chat_ab(k) yhat_b(k) = rhshat_a(k). Wavevectors where the
+	// right-hand side vanishes have yhat = 0 and are skipped.
+	int numReplicas = nRep[0]*nRep[1]*nRep[2];
+	int numSites = rhs.size() / numReplicas;
+
+	vector<vector<complex<double> > > rhat(numSites, vector<complex<double> >(numReplicas));
+	double maxMag = 0;
+	for (int a = 0; a < numSites; a++) {
+		for (int c = 0; c < numReplicas; c++) rhat[a][c] = rhs[ReplicaAtom[a*numReplicas + c]];
+		FFT3D(rhat[a], nRep[0], nRep[1], nRep[2], -1);
+		for (int c = 0; c < numReplicas; c++) maxMag = max(maxMag, abs(rhat[a][c]));
+	}
+
+	vector<vector<complex<double> > > yhat(numSites, vector<complex<double> >(numReplicas, 0));
+	for (int c = 0; c < numReplicas; c++) {
+		bool isZero = true;
+		for (int a = 0; a < numSites; a++) if (abs(rhat[a][c]) > 1e-12*maxMag) isZero = false;
+		if (isZero) continue;
+
+		vector<vector<complex<double> > > block(numSites, vector<complex<double> >(numSites));
+		vector<complex<double> > rk(numSites);
+		for (int a = 0; a < numSites; a++) {
+			for (int b = 0; b < numSites; b++) block[a][b] = Chat[a*numSites + b][c];
+			rk[a] = rhat[a][c];
+		}
+		vector<complex<double> > yk = SolveComplexMatrix(block, rk);
+		for (int a = 0; a < numSites; a++) yhat[a][c] = yk[a];
+	}
+
+	vector<double> y(rhs.size());
+	for (int a = 0; a < numSites; a++) {
+		FFT3D(yhat[a], nRep[0], nRep[1], nRep[2], +1);
+		for (int c = 0; c < numReplicas; c++) y[ReplicaAtom[a*numReplicas + c]] = yhat[a][c].real() / numReplicas;
+	}
+	return y;
+}
+/*****************************************************************************/
+void BuildHMatrix() {
+	// Clusters are halves of contiguous index ranges, which after SortAtomsSpatially are
+	// compact in space. A cluster pair is admissible (far field) when the smaller bounding box
+	// diagonal is at most twice the distance between the boxes; such blocks are compressed
+	// with ACA, everything else down to leaf pairs is stored dense. J is symmetric, so only
+	// pairs with the row cluster first are kept.
+	HCluster.assign(1, TreeNode());
+	HClusterBox.clear();
+	HCluster[0].first = 0; HCluster[0].count = numAtoms;
+	for (size_t c = 0; c < HCluster.size(); c++) {
+		TreeNode node = HCluster[c];
+		double lo[3] = {Pos[node.first].x, Pos[node.first].y, Pos[node.first].z};
+		double hi[3] = {lo[0], lo[1], lo[2]};
+		for (int i = node.first; i < node.first + node.count; i++) {
+			lo[0] = min(lo[0], Pos[i].x); lo[1] = min(lo[1], Pos[i].y); lo[2] = min(lo[2], Pos[i].z);
+			hi[0] = max(hi[0], Pos[i].x); hi[1] = max(hi[1], Pos[i].y); hi[2] = max(hi[2], Pos[i].z);
+		}
+		node.center.x = 0.5*(lo[0] + hi[0]); node.center.y = 0.5*(lo[1] + hi[1]); node.center.z = 0.5*(lo[2] + hi[2]);
+		node.radius = 0.5 * sqrt((hi[0]-lo[0])*(hi[0]-lo[0]) + (hi[1]-lo[1])*(hi[1]-lo[1]) + (hi[2]-lo[2])*(hi[2]-lo[2]));
+		HClusterBox.insert(HClusterBox.end(), lo, lo + 3);
+		HClusterBox.insert(HClusterBox.end(), hi, hi + 3);
+		if (node.count > hLeafSize) {
+			int half = node.count / 2;
+			TreeNode left; left.first = node.first; left.count = half;
+			TreeNode right; right.first = node.first + half; right.count = node.count - half;
+			node.children.push_back(HCluster.size()); HCluster.push_back(left);
+			node.children.push_back(HCluster.size()); HCluster.push_back(right);
+		}
+		HCluster[c] = node;
+	}
+
+	HBlocks.clear();
+	vector<pair<int, int> > stack(1, make_pair(0, 0));
+	double covered = 0; // Entries of the lower triangle in the blocks so far
+	while (!stack.empty()) {
+		Checkpoint("assemble", covered / ((double)numAtoms * (numAtoms + 1) / 2));
+		int t = stack.back().first; int s = stack.back().second;
+		stack.pop_back();
+		const TreeNode &T = HCluster[t]; const TreeNode &S = HCluster[s];
+
+		HBlock B;
+		B.row = T.first; B.rowCount = T.count; B.col = S.first; B.colCount = S.count;
+		if (t == s) {
+			if (!T.children.empty()) {
+				stack.push_back(make_pair(T.children[0], T.children[0]));
+				stack.push_back(make_pair(T.children[0], T.children[1]));
+				stack.push_back(make_pair(T.children[1], T.children[1]));
+				continue;
+			}
+		} else {
+			double gapSq = 0;
+			for (int d = 0; d < 3; d++) {
+				double g = max(HClusterBox[6*s + d] - HClusterBox[6*t + 3 + d], HClusterBox[6*t + d] - HClusterBox[6*s + 3 + d]);
+				if (g > 0) gapSq += g*g;
+			}
+			double diameter = 2 * min(T.radius, S.radius);
+			if ((gapSq > 0) && (diameter <= 2*sqrt(gapSq)) && AdaptiveCrossApproximation(B)) {
+				covered += (double)B.rowCount * B.colCount;
+				HBlocks.push_back(B);
+				continue;
+			}
+			if (!T.children.empty() || !S.children.empty()) {
+				if (S.children.empty() || (!T.children.empty() && (T.count >= S.count))) {
+					for (int c : T.children) stack.push_back(make_pair(c, s));
+				} else {
+					for (int c : S.children) stack.push_back(make_pair(t, c));
+				}
+				continue;
+			}
+		}
+
+		// Dense leaf pair
+		B.rank = -1; B.U.clear(); B.V.clear();
+		B.D.resize((size_t)B.rowCount * B.colCount);
+		for (int r = 0; r < B.rowCount; r++) {
+			for (int c = 0; c < B.colCount; c++) B.D[(size_t)r*B.colCount + c] = GetJ(B.row + r, B.col + c);
+		}
+		if (t == s) { // LDL^T of the diagonal block for the preconditioner
+			int n = B.rowCount;
+			B.F = B.D; B.Fd.assign(n, 0);
+			for (int j = 0; j < n; j++) {
+				double djj = B.F[j*n + j];
+				for (int p = 0; p < j; p++) djj -= B.F[j*n + p] * B.F[j*n + p] * B.Fd[p];
+				B.Fd[j] = djj;
+				for (int i = j + 1; i < n; i++) {
+					double sum = B.F[i*n + j];
+					for (int p = 0; p < j; p++) sum -= B.F[i*n + p] * B.F[j*n + p] * B.Fd[p];
+					B.F[i*n + j] = sum / djj;
+				}
+			}
+		}
+		covered += (t == s) ? (double)B.rowCount * (B.rowCount + 1) / 2 : (double)B.rowCount * B.colCount;
+		HBlocks.push_back(B);
+	}
+}
+/*****************************************************************************/
+void BuildOctree() {
+	TreeAtom.resize(numAtoms);
+	for (int i = 0; i < numAtoms; i++) TreeAtom[i] = i;
+
+	double lo[3] = {Pos[0].x, Pos[0].y, Pos[0].z};
+	double hi[3] = {Pos[0].x, Pos[0].y, Pos[0].z};
+	for (int i = 1; i < numAtoms; i++) {
+		lo[0] = min(lo[0], Pos[i].x); hi[0] = max(hi[0], Pos[i].x);
+		lo[1] = min(lo[1], Pos[i].y); hi[1] = max(hi[1], Pos[i].y);
+		lo[2] = min(lo[2], Pos[i].z); hi[2] = max(hi[2], Pos[i].z);
+	}
+
+	Tree.assign(1, TreeNode());
+	Tree[0].center.x = 0.5*(lo[0] + hi[0]);
+	Tree[0].center.y = 0.5*(lo[1] + hi[1]);
+	Tree[0].center.z = 0.5*(lo[2] + hi[2]);
+	Tree[0].halfSize = 0.5*max(hi[0] - lo[0], max(hi[1] - lo[1], hi[2] - lo[2])) + 1e-6;
+	Tree[0].count = numAtoms;
+
+	// Nodes are split breadth-first; Tree grows while we walk it, so index rather than iterate
+	vector<int> octant(numAtoms);
+	for (size_t n = 0; n < Tree.size(); n++) {
+		Coordinates c = Tree[n].center;
+		int first = Tree[n].first; int count = Tree[n].count;
+
+		for (int m = first; m < first + count; m++) {
+			int i = TreeAtom[m];
+			double dx = Pos[i].x - c.x; double dy = Pos[i].y - c.y; double dz = Pos[i].z - c.z;
+			Tree[n].radius = max(Tree[n].radius, sqrt(dx*dx + dy*dy + dz*dz));
+		}
+		if ((count <= treeLeafSize) || (Tree[n].halfSize < 1e-3)) continue;
+
+		// Stable partition into octants
+		vector<int> members(TreeAtom.begin() + first, TreeAtom.begin() + first + count);
+		int offset = first;
+		for (int o = 0; o < 8; o++) {
+			int start = offset;
+			for (int i : members) {
+				int oi = ((Pos[i].x >= c.x) ? 1 : 0) + ((Pos[i].y >= c.y) ? 2 : 0) + ((Pos[i].z >= c.z) ? 4 : 0);
+				if (oi == o) TreeAtom[offset++] = i;
+			}
+			if (offset == start) continue;
+
+			TreeNode child;
+			child.halfSize = 0.5*Tree[n].halfSize;
+			child.center.x = c.x + ((o & 1) ? child.halfSize : -child.halfSize);
+			child.center.y = c.y + ((o & 2) ? child.halfSize : -child.halfSize);
+			child.center.z = c.z + ((o & 4) ? child.halfSize : -child.halfSize);
+			child.first = start; child.count = offset - start;
+			Tree[n].children.push_back(Tree.size());
+			Tree.push_back(child);
+		}
+	}
+
+	// Expansion terms, ordered by total degree as TaylorCoefficients needs. Moments and local
+	// expansions go to treeOrder; translating a multipole into a local expansion needs 2*treeOrder.
+	MultiIndex.clear();
+	for (int n = 0; n <= 2*treeOrder; n++) {
+		if (n == treeOrder + 1) numTreeTerms = MultiIndex.size() / 3;
+		for (int kx = n; kx >= 0; kx--) {
+			for (int ky = n - kx; ky >= 0; ky--) {
+				MultiIndex.push_back(kx); MultiIndex.push_back(ky); MultiIndex.push_back(n - kx - ky);
+			}
+		}
+	}
+	int numTerms = MultiIndex.size() / 3;
+	map<vector<int>, int> termOf;
+	for (int t = 0; t < numTerms; t++) termOf[{MultiIndex[3*t], MultiIndex[3*t+1], MultiIndex[3*t+2]}] = t;
+	TaylorPrev.assign(6*numTerms, -1);
+	for (int t = 0; t < numTerms; t++) {
+		for (int d = 0; d < 3; d++) {
+			for (int step = 1; step <= 2; step++) {
+				vector<int> kk = {MultiIndex[3*t], MultiIndex[3*t+1], MultiIndex[3*t+2]};
+				kk[d] -= step;
+				if (kk[d] >= 0) TaylorPrev[6*t + 3*(step-1) + d] = termOf[kk];
+			}
+		}
+	}
+	if (treeOrder == 0) numTreeTerms = 1;
+
+	auto binomial = [](int n, int r) { double c = 1; for (int i = 1; i <= r; i++) c = c * (n - r + i) / i; return c; };
+	M2LIndex.clear(); M2LCoef.clear(); L2LIndex.clear(); L2LCoef.clear();
+	for (int m = 0; m < numTreeTerms; m++) {
+		for (int t = 0; t < numTreeTerms; t++) {
+			int mx = MultiIndex[3*m]; int my = MultiIndex[3*m+1]; int mz = MultiIndex[3*m+2];
+			int tx = MultiIndex[3*t]; int ty = MultiIndex[3*t+1]; int tz = MultiIndex[3*t+2];
+
+			// Multipole to local: t is the multipole index k
+			M2LIndex.push_back(m); M2LIndex.push_back(t); M2LIndex.push_back(termOf[{tx+mx, ty+my, tz+mz}]);
+			M2LCoef.push_back((((mx + my + mz) % 2) ? -1 : 1) * binomial(tx+mx, mx) * binomial(ty+my, my) * binomial(tz+mz, mz));
+
+			// Local to local: t is the parent index n >= m
+			if ((tx >= mx) && (ty >= my) && (tz >= mz)) {
+				L2LIndex.push_back(m); L2LIndex.push_back(t); L2LIndex.push_back(termOf[{tx-mx, ty-my, tz-mz}]);
+				L2LCoef.push_back(binomial(tx, mx) * binomial(ty, my) * binomial(tz, mz));
+			}
+		}
+	}
+
+	// Dual tree traversal. The interaction lists depend only on the geometry, so they (and the
+	// Taylor coefficients of every well-separated pair) are built once and reused by each CG step.
+	int numKernelTerms = MultiIndex.size() / 3;
+	TreeM2L.clear(); TreeM2LKernel.clear(); TreeP2P.clear();
+	vector<pair<int, int> > stack(1, make_pair(0, 0));
+	while (!stack.empty()) {
+		int t = stack.back().first; int s = stack.back().second;
+		stack.pop_back();
+		const TreeNode &T = Tree[t]; const TreeNode &S = Tree[s];
+
+		double dx = T.center.x - S.center.x;
+		double dy = T.center.y - S.center.y;
+		double dz = T.center.z - S.center.z;
+		double dSq = dx*dx + dy*dy + dz*dz;
+
+		if ((t != s) && ((T.radius + S.radius)*(T.radius + S.radius) < theta*theta*dSq)) {
+			TreeM2L.push_back(t); TreeM2L.push_back(s);
+			TreeM2LKernel.resize(TreeM2LKernel.size() + numKernelTerms);
+			TaylorCoefficients(dx, dy, dz, 2*treeOrder, &TreeM2LKernel[TreeM2LKernel.size() - numKernelTerms]);
+		} else
+		if (T.children.empty() && S.children.empty()) {
+			TreeP2P.push_back(t); TreeP2P.push_back(s);
+		} else
+		if (t == s) {
+			for (int c1 : T.children) for (int c2 : T.children) stack.push_back(make_pair(c1, c2));
+		} else
+		if (S.children.empty() || (!T.children.empty() && (T.radius >= S.radius))) {
+			for (int c : T.children) stack.push_back(make_pair(c, s));
+		} else {
+			for (int c : S.children) stack.push_back(make_pair(t, c));
+		}
+	}
+}
+/*****************************************************************************/
+void BuildOverlapPairs(double cutoff) {
+	// Same pair storage as BuildRealSpacePairs (j > i), for the NonPeriodic overlap term only;
+	// the 1/R part is left to the tree code
+	double lo[3] = {Pos[0].x, Pos[0].y, Pos[0].z};
+	for (int i = 1; i < numAtoms; i++) {
+		lo[0] = min(lo[0], Pos[i].x); lo[1] = min(lo[1], Pos[i].y); lo[2] = min(lo[2], Pos[i].z);
+	}
+
+	// Hash grid with cutoff-sized cells
+	unordered_map<long long, vector<int> > cells;
+	vector<long long> cellOf(numAtoms);
+	auto key = [](long long u, long long v, long long w) { return (u*1000003LL + v)*1000003LL + w; };
+	for (int i = 0; i < numAtoms; i++) {
+		long long u = (long long)((Pos[i].x - lo[0]) / cutoff);
+		long long v = (long long)((Pos[i].y - lo[1]) / cutoff);
+		long long w = (long long)((Pos[i].z - lo[2]) / cutoff);
+		cellOf[i] = key(u, v, w);
+		cells[cellOf[i]].push_back(i);
+	}
+
+	PairRowStart.assign(1, 0); PairCol.clear(); PairVal.clear();
+	PairDiag.assign(numAtoms, 0);
+	vector<int> neighbours;
+
+	for (int i = 0; i < numAtoms; i++) {
+		long long u = (long long)((Pos[i].x - lo[0]) / cutoff);
+		long long v = (long long)((Pos[i].y - lo[1]) / cutoff);
+		long long w = (long long)((Pos[i].z - lo[2]) / cutoff);
+		neighbours.clear();
+		for (int du = -1; du <= 1; du++) {
+			for (int dv = -1; dv <= 1; dv++) {
+				for (int dw = -1; dw <= 1; dw++) {
+					auto cell = cells.find(key(u + du, v + dv, w + dw));
+					if (cell == cells.end()) continue;
+					for (int j : cell->second) if (j > i) neighbours.push_back(j);
+				}
+			}
+		}
+		sort(neighbours.begin(), neighbours.end());
+
+		for (int j : neighbours) {
+			double dx = Pos[i].x - Pos[j].x;
+			double dy = Pos[i].y - Pos[j].y;
+			double dz = Pos[i].z - Pos[j].z;
+			double RabSq = dx*dx + dy*dy + dz*dz;
+			if (RabSq >= cutoff*cutoff) continue;
+			double Rab = sqrt(RabSq);
+
+			double Jij = sqrt(J[i] * J[j]);
+			double a = Jij / k;
+			double orbitalOverlapTerm = exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab);
+
+			PairCol.push_back(j);
+			PairVal.push_back(orbitalOverlapTerm);
+		}
+		PairRowStart.push_back(PairCol.size());
+	}
+}
+/*****************************************************************************/
+void BuildRealSpacePairs(double cutoff, double splitting, bool shifted) {
+	// All pairs (and periodic images) closer than cutoff, found with a cell list over the wrapped
+	// fractional coordinates. For each pair the erfc(R/eta)/R Coulomb term and the orbital overlap
+	// term are summed over images, so applying the real-space part is one pass over the list.
+	// With shifted set the Coulomb term is the damped shifted force form of the Wolf method,
+	// which brings both the potential and its derivative to zero at the cutoff.
+	double Vc = erfc(cutoff / splitting) / cutoff;
+	double Fc = Vc / cutoff + 2/(splitting*sqrt(PI)) * exp(-cutoff*cutoff/(splitting*splitting)) / cutoff;
+	vector<double> width(3); // Perpendicular widths of the cell
+	width[0] = unitCellVolume / Mag(Cross(bV, cV));
+	width[1] = unitCellVolume / Mag(Cross(cV, aV));
+	width[2] = unitCellVolume / Mag(Cross(aV, bV));
+
+	int nb[3]; int reach[3];
+	for (int d = 0; d < 3; d++) {
+		nb[d] = max(1, (int)(width[d] / cutoff));
+		reach[d] = (int)ceil(cutoff * nb[d] / width[d]);
+	}
+
+	vector<Coordinates> wrapped(numAtoms);
+	vector<vector<int> > cells(nb[0]*nb[1]*nb[2]);
+	vector<int> cellOf(numAtoms);
+	for (int i = 0; i < numAtoms; i++) {
+		double f[3];
+		f[0] = (Pos[i].x*hV[0] + Pos[i].y*hV[1] + Pos[i].z*hV[2]) / (2*PI);
+		f[1] = (Pos[i].x*jV[0] + Pos[i].y*jV[1] + Pos[i].z*jV[2]) / (2*PI);
+		f[2] = (Pos[i].x*kV[0] + Pos[i].y*kV[1] + Pos[i].z*kV[2]) / (2*PI);
+		int c[3];
+		for (int d = 0; d < 3; d++) {
+			f[d] -= floor(f[d]);
+			c[d] = min(nb[d] - 1, (int)(f[d]*nb[d]));
+		}
+		wrapped[i].x = f[0]*aV[0] + f[1]*bV[0] + f[2]*cV[0];
+		wrapped[i].y = f[0]*aV[1] + f[1]*bV[1] + f[2]*cV[1];
+		wrapped[i].z = f[0]*aV[2] + f[1]*bV[2] + f[2]*cV[2];
+		cellOf[i] = (c[0]*nb[1] + c[1])*nb[2] + c[2];
+		cells[cellOf[i]].push_back(i);
+	}
+
+	PairRowStart.assign(1, 0); PairCol.clear(); PairVal.clear();
+	PairDiag.assign(numAtoms, 0);
+	vector<double> acc(numAtoms, 0); // Scratch row, reset after use
+	vector<int> touched;
+
+	for (int i = 0; i < numAtoms; i++) {
+		int c0 = cellOf[i] / (nb[1]*nb[2]); int c1 = (cellOf[i] / nb[2]) % nb[1]; int c2 = cellOf[i] % nb[2];
+		for (int du = -reach[0]; du <= reach[0]; du++) {
+			for (int dv = -reach[1]; dv <= reach[1]; dv++) {
+				for (int dw = -reach[2]; dw <= reach[2]; dw++) {
+					int u = c0 + du; int v = c1 + dv; int w = c2 + dw;
+					// Neighbouring cell index and the lattice shift that brings it next to cell i
+					int Lu = (int)floor((double)u / nb[0]); int Lv = (int)floor((double)v / nb[1]); int Lw = (int)floor((double)w / nb[2]);
+					int cell = ((u - Lu*nb[0])*nb[1] + (v - Lv*nb[1]))*nb[2] + (w - Lw*nb[2]);
+					double sx = Lu*aV[0] + Lv*bV[0] + Lw*cV[0];
+					double sy = Lu*aV[1] + Lv*bV[1] + Lw*cV[1];
+					double sz = Lu*aV[2] + Lv*bV[2] + Lw*cV[2];
+
+					for (int j : cells[cell]) {
+						if (j < i) continue; // Each pair is stored once
+						if ((j == i) && (Lu == 0) && (Lv == 0) && (Lw == 0)) continue;
+						double dx = wrapped[j].x + sx - wrapped[i].x;
+						double dy = wrapped[j].y + sy - wrapped[i].y;
+						double dz = wrapped[j].z + sz - wrapped[i].z;
+						double RabSq = dx*dx + dy*dy + dz*dz;
+						if (RabSq >= cutoff*cutoff) continue;
+						double Rab = sqrt(RabSq);
+
+						double Jij = sqrt(J[i] * J[j]);
+						double a = Jij / k;
+						double orbitalOverlapTerm = exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab);
+
+						double coulomb = erfc(Rab / splitting) / Rab;
+						if (shifted) coulomb += -Vc + Fc*(Rab - cutoff);
+						double value = coulomb + orbitalOverlapTerm;
+						if (j == i) {
+							PairDiag[i] += value;
+						} else {
+							if (acc[j] == 0) touched.push_back(j);
+							acc[j] += value;
+						}
+					}
+				}
+			}
+		}
+
+		sort(touched.begin(), touched.end());
+		for (int j : touched) {
+			PairCol.push_back(j);
+			PairVal.push_back(acc[j]);
+			acc[j] = 0;
+		}
+		touched.clear();
+		PairRowStart.push_back(PairCol.size());
+	}
+}
+/*****************************************************************************/
+string CacheKey(int digits) {
+	// Two FNV-1a streams with different offsets give a 128-bit key. Doubles are hashed
+	// bitwise (with -0.0 folded into 0.0) so byte-identical CIFs always map to the same key.
+	uint64_t h1 = 14695981039346656037ULL;
+	uint64_t h2 = 9650029242287828579ULL;
+	auto addInt = [&](int64_t v) { HashBytes(h1, &v, sizeof(v)); HashBytes(h2, &v, sizeof(v)); };
+	auto addDouble = [&](double v) {
+		if (v == 0) v = 0; // -0.0 and 0.0 must hash alike
+		HashBytes(h1, &v, sizeof(v)); HashBytes(h2, &v, sizeof(v));
+	};
+	auto addString = [&](const string &v) {
+		addInt(v.size());
+		HashBytes(h1, v.data(), v.size()); HashBytes(h2, v.data(), v.size());
+	};
+
+	addInt(cacheVersion);
+
+	// Parameters
+	addInt(digits);
+	addInt(isPeriodic); addInt(useEwardSums);
+	addDouble(lambda); addDouble(hI0); addDouble(hI1); addDouble(k);
+	addInt(mR); addInt(mK); addDouble(eta);
+	addInt(useSupercell);
+	if (mR < 0) addDouble(realRadius);
+	if (mK < 0) addDouble(kCutoff);
+	if (directTol > 0) addDouble(directTol);
+	addInt(useSPME); if (useSPME) addDouble(rcut);
+	addInt(useTree); if (useTree) { addInt(treeOrder); addDouble(theta); }
+	addInt(useWolf); if (useWolf) { addDouble(rcut); addDouble(wolfAlpha); }
+	addInt(useHMatrix); if (useHMatrix) addDouble(acaTol);
+	if (screenTol > 0) { addDouble(screenTol); addDouble(screenCutoff); addInt(screenSkip); }
+	if (useFamily) { addInt(useFamily); addDouble(rcut); }
+	addDouble(Qtot);
+
+	// Cell
+	addDouble(aLength); addDouble(bLength); addDouble(cLength);
+	addDouble(alphaAngle); addDouble(betaAngle); addDouble(gammaAngle);
+
+	// Atoms (X and J cover the embedded ionization and charge center tables)
+	addInt(numAtoms);
+	addInt(nRep[0]); addInt(nRep[1]); addInt(nRep[2]);
+	for (int i = 0; i < numAtoms; i++) {
+		addString(Symbol[i]);
+		addDouble(Pos[i].x); addDouble(Pos[i].y); addDouble(Pos[i].z);
+		addDouble(X[i]); addDouble(J[i]);
+		addInt(Orbit[i]);
+	}
+
+	char buffer[33];
+	snprintf(buffer, sizeof(buffer), "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+	return string(buffer);
+}
+/*****************************************************************************/
+void Checkpoint(const char *stage, double fraction) {
+	// Called by the solvers between units of work (rows, tiles, panels, blocks, iterations),
+	// so a cancel or deadline takes effect within one of them
+	if (progressCallback) progressCallback(stage, min(max(fraction, 0.0), 1.0));
+	if (cancelFlag && cancelFlag->load(memory_order_relaxed)) throw QeqInterrupted(false);
+	if ((deadlineTime > 0) && (Seconds() > deadlineTime)) throw QeqInterrupted(true);
+}
+/*****************************************************************************/
+void ConvergeDirectShells() {
+	// Shell n holds the translations t = u*a + v*b + w*c with |t| in ((n-1) w, n w], w being
+	// the smallest perpendicular width of the cell. Spherical shells keep the sum free of the
+	// shape-dependent terms a growing box of images picks up in a non-cubic cell.
+	// The lattice sum of 1/R itself diverges, but adding the same constant to every J entry
+	// leaves the charges unchanged (it is absorbed into mu), so a shell has converged when its
+	// contribution is the same, to within directTol, for the diagonal and a sample of
+	// off-diagonal entries.
+	double width[3] = {2*PI / Mag(hV), 2*PI / Mag(jV), 2*PI / Mag(kV)};
+	double wmin = min(width[0], min(width[1], width[2]));
+
+	int numSamples = min(numAtoms, 8);
+	vector<pair<int, int> > samples;
+	for (int s = 0; s < numSamples; s++) {
+		int i = s * numAtoms / numSamples;
+		int j = ((s + 1) % numSamples) * numAtoms / numSamples;
+		samples.push_back(make_pair(i, i));
+		if (i != j) samples.push_back(make_pair(i, j));
+	}
+
+	double R = 0; int n;
+	int num[3] = {0, 0, 0}; int quiet = 0; // No images at all if directMaxShells < 1
+	for (n = 1; n <= directMaxShells; n++) {
+		double Rprev = R;
+		R = n * wmin;
+		for (int d = 0; d < 3; d++) num[d] = (int)ceil(R / width[d]);
+
+		double lo = 0; double hi = 0;
+		for (size_t p = 0; p < samples.size(); p++) {
+			int i = samples[p].first; int j = samples[p].second;
+			double Jij = sqrt(J[i] * J[j]);
+			double a = Jij / k;
+			double sigma = 0;
+			for (int u = -num[0]; u <= num[0]; u++) {
+				for (int v = -num[1]; v <= num[1]; v++) {
+					for (int w = -num[2]; w <= num[2]; w++) {
+						double tx = u*aV[0] + v*bV[0] + w*cV[0];
+						double ty = u*aV[1] + v*bV[1] + w*cV[1];
+						double tz = u*aV[2] + v*bV[2] + w*cV[2];
+						double tSq = tx*tx + ty*ty + tz*tz;
+						if ((tSq <= Rprev*Rprev) || (tSq > R*R)) continue;
+						double dx = Pos[i].x - Pos[j].x + tx;
+						double dy = Pos[i].y - Pos[j].y + ty;
+						double dz = Pos[i].z - Pos[j].z + tz;
+						double RabSq = dx*dx + dy*dy + dz*dz;
+						double Rab = sqrt(RabSq);
+						sigma += (1/Rab) + exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab);
+					}
+				}
+			}
+			sigma *= lambda * (k/2);
+			if (p == 0) { lo = sigma; hi = sigma; }
+			lo = min(lo, sigma); hi = max(hi, sigma);
+		}
+		// Lattice sums fluctuate from shell to shell, so ask for two quiet shells in a row
+		quiet = (hi - lo < directTol) ? quiet + 1 : 0;
+		if (quiet == 2) break;
+	}
+
+	directShells = min(n, directMaxShells);
+	if (quiet < 2) {
+		ostringstream message;
+		message << "Direct sum not converged to " << directTol << " eV after " << directMaxShells << " shells";
+		Warn(message.str());
+	}
+	aVnum = num[0]; bVnum = num[1]; cVnum = num[2];
+	directRadius = R;
+}
+/*****************************************************************************/
+void DetectSupercell() {
+	// A supercell is invariant under the fractional translations (1/n1,0,0), (0,1/n2,0) and
+	// (0,0,1/n3). For each axis find the largest such n; every n must divide the number of
+	// atoms of every species, so only divisors of their gcd are tried.
+	nRep[0] = 1; nRep[1] = 1; nRep[2] = 1;
+	ReplicaAtom.clear();
+	if ((isPeriodic == false) || (useSupercell == false) || (numOrbits < numAtoms)) return;
+
+	map<string, int> speciesCount;
+	for (int i = 0; i < numAtoms; i++) speciesCount[Symbol[i]]++;
+	int g = 0;
+	for (auto &sc : speciesCount) g = gcd(g, sc.second);
+	if (g < 2) return;
+
+	SiteLocator sites;
+	for (int i = 0; i < numAtoms; i++) sites.Add(i, Frac[i].x, Frac[i].y, Frac[i].z, Symbol[i]);
+
+	for (int axis = 0; axis < 3; axis++) {
+		for (int n = g; n >= 2; n--) {
+			if ((g % n != 0) || ((g / nRep[0] / nRep[1]) % n != 0)) continue;
+			double t[3] = {0, 0, 0};
+			t[axis] = 1.0 / n;
+			bool isTranslation = true;
+			for (int i = 0; (i < numAtoms) && isTranslation; i++) {
+				if (sites.Find(Frac[i].x + t[0], Frac[i].y + t[1], Frac[i].z + t[2], Symbol[i]) < 0) isTranslation = false;
+			}
+			if (isTranslation) { nRep[axis] = n; break; }
+		}
+	}
+
+	int numReplicas = nRep[0]*nRep[1]*nRep[2];
+	if (numReplicas == 1) return;
+
+	// Assign every atom to (primitive site, replica cell)
+	ReplicaAtom.assign(numAtoms, -1);
+	vector<bool> assigned(numAtoms, false);
+	int site = 0;
+	for (int i = 0; i < numAtoms; i++) {
+		if (assigned[i]) continue;
+		for (int c = 0; c < numReplicas; c++) {
+			int r1 = c / (nRep[1]*nRep[2]); int r2 = (c / nRep[2]) % nRep[1]; int r3 = c % nRep[2];
+			int m = sites.Find(Frac[i].x + (double)r1/nRep[0], Frac[i].y + (double)r2/nRep[1],
+				Frac[i].z + (double)r3/nRep[2], Symbol[i]);
+			if ((m < 0) || assigned[m]) { // Should not happen once the translations check out
+				nRep[0] = 1; nRep[1] = 1; nRep[2] = 1;
+				ReplicaAtom.clear();
+				return;
+			}
+			ReplicaAtom[site*numReplicas + c] = m;
+			assigned[m] = true;
+		}
+		site++;
+	}
+}
+/*****************************************************************************/
+void DetermineReciprocalLatticeVectors() {
+	vector<double> crs;
+	double pf; // pf => PreFactor
+
+	crs = Cross(bV, cV);
+	pf = 2*PI / Dot(aV, crs);
+	hV[0] = pf * crs[0];
+	hV[1] = pf * crs[1];
+	hV[2] = pf * crs[2];
+
+	crs = Cross(cV, aV);
+	pf = 2*PI / Dot(bV, crs);
+	jV[0] = pf * crs[0];
+	jV[1] = pf * crs[1];
+	jV[2] = pf * crs[2];
+
+	crs = Cross(aV, bV);
+	pf = 2*PI / Dot(cV, crs);
+	kV[0] = pf * crs[0];
+	kV[1] = pf * crs[1];
+	kV[2] = pf * crs[2];
+}
+/*****************************************************************************/
+void HashBytes(uint64_t &h, const void *data, size_t n) {
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL; // FNV-1a 64-bit prime
+	}
+}
+/*****************************************************************************/
+void HMatrixMultiply(const vector<double> &x, vector<double> &y) {
+	y.assign(numAtoms, 0);
+	vector<double> t;
+	for (const HBlock &B : HBlocks) {
+		int m = B.rowCount; int n = B.colCount;
+		bool mirror = (B.row != B.col); // Off-diagonal blocks also stand for their transpose
+		if (B.rank < 0) {
+			for (int r = 0; r < m; r++) {
+				const double *Dr = &B.D[(size_t)r*n];
+				double sum = 0;
+				for (int c = 0; c < n; c++) sum += Dr[c] * x[B.col + c];
+				y[B.row + r] += sum;
+				if (mirror) for (int c = 0; c < n; c++) y[B.col + c] += Dr[c] * x[B.row + r];
+			}
+		} else {
+			t.assign(B.rank, 0);
+			for (int l = 0; l < B.rank; l++) for (int c = 0; c < n; c++) t[l] += B.V[l*n + c] * x[B.col + c];
+			for (int l = 0; l < B.rank; l++) for (int r = 0; r < m; r++) y[B.row + r] += B.U[l*m + r] * t[l];
+			t.assign(B.rank, 0);
+			for (int l = 0; l < B.rank; l++) for (int r = 0; r < m; r++) t[l] += B.U[l*m + r] * x[B.row + r];
+			for (int l = 0; l < B.rank; l++) for (int c = 0; c < n; c++) y[B.col + c] += B.V[l*n + c] * t[l];
+		}
+	}
+}
+/*****************************************************************************/
+void InitializeStringAtomLabelsEnumeration() {
+	s_mapStringAtomLabels["H "] = ev_H;	// 1
+	s_mapStringAtomLabels["He"] = ev_He;// 2
+	s_mapStringAtomLabels["Li"] = ev_Li;// 3
+	s_mapStringAtomLabels["Be"] = ev_Be;// 4
+	s_mapStringAtomLabels["B "] = ev_B;	// 5
+	s_mapStringAtomLabels["C "] = ev_C;	// 6
+	s_mapStringAtomLabels["N "] = ev_N;	// 7
+	s_mapStringAtomLabels["O "] = ev_O;	// 8
+	s_mapStringAtomLabels["F "] = ev_F;	// 9
+	s_mapStringAtomLabels["Ne"] = ev_Ne;//10
+	s_mapStringAtomLabels["Na"] = ev_Na;//11
+	s_mapStringAtomLabels["Mg"] = ev_Mg;//12
+	s_mapStringAtomLabels["Al"] = ev_Al;//13
+	s_mapStringAtomLabels["Si"] = ev_Si;//14
+	s_mapStringAtomLabels["P "] = ev_P;	//15
+	s_mapStringAtomLabels["S "] = ev_S;	//16
+	s_mapStringAtomLabels["Cl"] = ev_Cl;//17
+	s_mapStringAtomLabels["Ar"] = ev_Ar;//18
+	s_mapStringAtomLabels["K "] = ev_K ;//19
+	s_mapStringAtomLabels["Ca"] = ev_Ca;//20
+	s_mapStringAtomLabels["Sc"] = ev_Sc;//21
+	s_mapStringAtomLabels["Ti"] = ev_Ti;//22
+	s_mapStringAtomLabels["V "] = ev_V ;//23
+	s_mapStringAtomLabels["Cr"] = ev_Cr;//24
+	s_mapStringAtomLabels["Mn"] = ev_Mn;//25
+	s_mapStringAtomLabels["Fe"] = ev_Fe;//26
+	s_mapStringAtomLabels["Co"] = ev_Co;//27
+	s_mapStringAtomLabels["Ni"] = ev_Ni;//28
+	s_mapStringAtomLabels["Cu"] = ev_Cu;//29
+	s_mapStringAtomLabels["Zn"] = ev_Zn;//30
+	s_mapStringAtomLabels["Ga"] = ev_Ga;//31
+	s_mapStringAtomLabels["Ge"] = ev_Ge;//32
+	s_mapStringAtomLabels["As"] = ev_As;//33
+	s_mapStringAtomLabels["Se"] = ev_Se;//34
+	s_mapStringAtomLabels["Br"] = ev_Br;//35
+	s_mapStringAtomLabels["Kr"] = ev_Kr;//36
+	s_mapStringAtomLabels["Rb"] = ev_Rb;//37
+	s_mapStringAtomLabels["Sr"] = ev_Sr;//38
+	s_mapStringAtomLabels["Y "] = ev_Y ;//39
+	s_mapStringAtomLabels["Zr"] = ev_Zr;//40
+	s_mapStringAtomLabels["Nb"] = ev_Nb;//41
+	s_mapStringAtomLabels["Mo"] = ev_Mo;//42
+	s_mapStringAtomLabels["Tc"] = ev_Tc;//43
+	s_mapStringAtomLabels["Ru"] = ev_Ru;//44
+	s_mapStringAtomLabels["Rh"] = ev_Rh;//45
+	s_mapStringAtomLabels["Pd"] = ev_Pd;//46
+	s_mapStringAtomLabels["Ag"] = ev_Ag;//47
+	s_mapStringAtomLabels["Cd"] = ev_Cd;//48
+	s_mapStringAtomLabels["In"] = ev_In;//49
+	s_mapStringAtomLabels["Sn"] = ev_Sn;//50
+	s_mapStringAtomLabels["Sb"] = ev_Sb;//51
+	s_mapStringAtomLabels["Te"] = ev_Te;//52
+	s_mapStringAtomLabels["I "] = ev_I ;//53
+	s_mapStringAtomLabels["Xe"] = ev_Xe;//54
+	s_mapStringAtomLabels["Cs"] = ev_Cs;//55
+	s_mapStringAtomLabels["Ba"] = ev_Ba;//56
+	s_mapStringAtomLabels["La"] = ev_La;//57
+	s_mapStringAtomLabels["Ce"] = ev_Ce;//58
+	s_mapStringAtomLabels["Pr"] = ev_Pr;//59
+	s_mapStringAtomLabels["Nd"] = ev_Nd;//60
+	s_mapStringAtomLabels["Pm"] = ev_Pm;//61
+	s_mapStringAtomLabels["Sm"] = ev_Sm;//62
+	s_mapStringAtomLabels["Eu"] = ev_Eu;//63
+	s_mapStringAtomLabels["Gd"] = ev_Gd;//64
+	s_mapStringAtomLabels["Tb"] = ev_Tb;//65
+	s_mapStringAtomLabels["Dy"] = ev_Dy;//66
+	s_mapStringAtomLabels["Ho"] = ev_Ho;//67
+	s_mapStringAtomLabels["Er"] = ev_Er;//68
+	s_mapStringAtomLabels["Tm"] = ev_Tm;//69
+	s_mapStringAtomLabels["Yb"] = ev_Yb;//70
+	s_mapStringAtomLabels["Lu"] = ev_Lu;//71
+	s_mapStringAtomLabels["Hf"] = ev_Hf;//72
+	s_mapStringAtomLabels["Ta"] = ev_Ta;//73
+	s_mapStringAtomLabels["W "] = ev_W ;//74
+	s_mapStringAtomLabels["Re"] = ev_Re;//75
+	s_mapStringAtomLabels["Os"] = ev_Os;//76
+	s_mapStringAtomLabels["Ir"] = ev_Ir;//77
+	s_mapStringAtomLabels["Pt"] = ev_Pt;//78
+	s_mapStringAtomLabels["Au"] = ev_Au;//79
+	s_mapStringAtomLabels["Hg"] = ev_Hg;//80
+	s_mapStringAtomLabels["Tl"] = ev_Tl;//81
+	s_mapStringAtomLabels["Pb"] = ev_Pb;//82
+	s_mapStringAtomLabels["Bi"] = ev_Bi;//83
+	s_mapStringAtomLabels["Po"] = ev_Po;//84
+}
+/*****************************************************************************/
+void ExpandSymmetryOperators() {
+	int numAsym = Pos.size();
+
+	Orbit.resize(numAsym);
+	for (int i = 0; i < numAsym; i++) Orbit[i] = i;
+	numOrbits = numAsym;
+
+	// Nothing to do for P1 (no operators, or just x,y,z)
+	bool onlyIdentity = true;
+	for (size_t o = 0; o < SymOps.size(); o++) {
+		for (int r = 0; r < 3; r++) {
+			if (SymOps[o].t[r] != 0) onlyIdentity = false;
+			for (int c = 0; c < 3; c++) if (SymOps[o].R[r][c] != (r == c ? 1 : 0)) onlyIdentity = false;
+		}
+	}
+	if (onlyIdentity) return;
+
+	vector<Coordinates> newPos, newFrac;
+	vector<string> newLabel, newSymbol;
+	vector<double> newX, newJ;
+	vector<int> parent(numAsym); // Union-find over the orbits of the asymmetric atoms
+	for (int i = 0; i < numAsym; i++) parent[i] = i;
+	auto findRoot = [&](int a) { while (parent[a] != a) a = parent[a] = parent[parent[a]]; return a; };
+	vector<int> newOrbit;
+
+	SiteLocator sites;
+
+	for (int i = 0; i < numAsym; i++) {
+		for (size_t o = 0; o < SymOps.size(); o++) {
+			const SymmetryOperator &op = SymOps[o];
+			double f[3];
+			double f0[3] = {Frac[i].x, Frac[i].y, Frac[i].z};
+			for (int r = 0; r < 3; r++) {
+				f[r] = op.R[r][0]*f0[0] + op.R[r][1]*f0[1] + op.R[r][2]*f0[2] + op.t[r];
+				f[r] -= floor(f[r]);
+			}
+
+			// Is this image already a site of the cell?
+			int match = sites.Find(f[0], f[1], f[2], Symbol[i]);
+			if (match >= 0) {
+				// Either a special position or the CIF already lists this image: merge the orbits
+				parent[findRoot(newOrbit[match])] = findRoot(i);
+				continue;
+			}
+
+			Coordinates tempAtom;
+			tempAtom.x = f[0]; tempAtom.y = f[1]; tempAtom.z = f[2];
+			newFrac.push_back(tempAtom);
+			tempAtom.x = f[0] * aV[0] + f[1] * bV[0] + f[2] * cV[0];
+			tempAtom.y = f[0] * aV[1] + f[1] * bV[1] + f[2] * cV[1];
+			tempAtom.z = f[0] * aV[2] + f[1] * bV[2] + f[2] * cV[2];
+			newPos.push_back(tempAtom);
+			newLabel.push_back(Label[i]);
+			newSymbol.push_back(Symbol[i]);
+			newX.push_back(X[i]);
+			newJ.push_back(J[i]);
+			newOrbit.push_back(i);
+			sites.Add(newPos.size() - 1, f[0], f[1], f[2], Symbol[i]);
+		}
+	}
+
+	Pos = newPos; Frac = newFrac;
+	Label = newLabel; Symbol = newSymbol;
+	X = newX; J = newJ;
+
+	// Number the orbits in order of first appearance
+	vector<int> orbitIndex(numAsym, -1);
+	numOrbits = 0;
+	Orbit.resize(newOrbit.size());
+	for (size_t i = 0; i < newOrbit.size(); i++) {
+		int root = findRoot(newOrbit[i]);
+		if (orbitIndex[root] < 0) orbitIndex[root] = numOrbits++;
+		Orbit[i] = orbitIndex[root];
+	}
+}
+/*****************************************************************************/
+void FFT3D(vector<complex<double> > &data, int n1, int n2, int n3, int sign) {
+	// In-place transform of an n1 x n2 x n3 array (last index fastest) with kernel exp(sign*2*pi*i*k*n/N).
+	// Power-of-two lengths use radix-2 Cooley-Tukey; other lengths fall back to a direct DFT,
+	// which is fine for the short axes this is used on.
+#ifdef EQEQ_HAVE_FFTW
+	fftw_complex *p = reinterpret_cast<fftw_complex *>(data.data());
+	fftw_plan plan = fftw_plan_dft_3d(n1, n2, n3, p, p, (sign < 0) ? FFTW_FORWARD : FFTW_BACKWARD, FFTW_ESTIMATE);
+	fftw_execute(plan);
+	fftw_destroy_plan(plan);
+	return;
+#endif
+	int dims[3] = {n1, n2, n3};
+	int strides[3] = {n2*n3, n3, 1};
+	vector<complex<double> > line, out;
+
+	for (int axis = 0; axis < 3; axis++) {
+		int n = dims[axis];
+		if (n == 1) continue;
+		int stride = strides[axis];
+		line.resize(n); out.resize(n);
+
+		for (int start = 0; start < n1*n2*n3; start++) {
+			if ((start / stride) % n != 0) continue; // Visit each line once, from its first element
+
+			for (int m = 0; m < n; m++) line[m] = data[start + m*stride];
+
+			if ((n & (n - 1)) == 0) {
+				// Bit-reversal permutation, then butterflies
+				for (int m = 1, r = 0; m < n; m++) {
+					int bit = n >> 1;
+					for (; r & bit; bit >>= 1) r ^= bit;
+					r ^= bit;
+					if (m < r) swap(line[m], line[r]);
+				}
+				for (int len = 2; len <= n; len <<= 1) {
+					complex<double> wLen = polar(1.0, sign*2*PI/len);
+					for (int m = 0; m < n; m += len) {
+						complex<double> w = 1;
+						for (int o = 0; o < len/2; o++) {
+							complex<double> u = line[m+o];
+							complex<double> v = line[m+o+len/2] * w;
+							line[m+o] = u + v;
+							line[m+o+len/2] = u - v;
+							w *= wLen;
+						}
+					}
+				}
+			} else {
+				for (int kk = 0; kk < n; kk++) {
+					out[kk] = 0;
+					for (int m = 0; m < n; m++) out[kk] += line[m] * polar(1.0, sign*2*PI*((long long)kk*m % n)/n);
+				}
+				line = out;
+			}
+
+			for (int m = 0; m < n; m++) data[start + m*stride] = line[m];
+		}
+	}
+}
+/*****************************************************************************/
+double GetJ(int i, int j) {
+	// Note to reader - significant consolidation of code may be possible in this function
+	kernelCalls++;
+	if (isPeriodic == false) {
+		//////////////////////////////////////////////////////////////////////
+		//  NonPeriodic                                                     //
+		//////////////////////////////////////////////////////////////////////
+		if (i == j) {
+			return J[i]; // Return the hardness/idempotential
+		} else {
+			double dx = Pos[i].x - Pos[j].x;
+			double dy = Pos[i].y - Pos[j].y;
+			double dz = Pos[i].z - Pos[j].z;
+			double RabSq = dx*dx + dy*dy + dz*dz;
+			double Rab = sqrt(RabSq);
+
+			double Jij = sqrt(J[i] * J[j]);
+			double a = Jij / k;
+			double orbitalOverlapTerm = exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab); // Other functional forms are OK too
+
+			double Jab = lambda * (k/2) * ((1/Rab) + orbitalOverlapTerm);
+
+			return Jab;
+		}
+		//////////////////////////////////////////////////////////////////////
+		//////////////////////////////////////////////////////////////////////
+	} else
+	if (isPeriodic == true) {
+		if (useEwardSums == false) {
+			//////////////////////////////////////////////////////////////////////
+			// Direct sums                                                      //
+			//////////////////////////////////////////////////////////////////////
+			if (i == j) {
+
+				double sigmaStar = 0;
+				for (int u = -aVnum; u <= aVnum; u++) {
+					for (int v = -bVnum; v <= bVnum; v++) {
+						for (int w = -cVnum; w <= cVnum; w++) {
+							if (!((u==0)&&(v==0)&&(w==0))) {
+								double dx = u*aV[0] + v*bV[0] + w*cV[0];
+								double dy = u*aV[1] + v*bV[1] + w*cV[1];
+								double dz = u*aV[2] + v*bV[2] + w*cV[2];
+								double Rab = sqrt(dx*dx + dy*dy + dz*dz);
+								double RabSq = dx*dx + dy*dy + dz*dz;
+								if ((directRadius > 0) && (Rab > directRadius)) continue;
+
+								double Jij = sqrt(J[i] * J[j]);
+								double a = Jij / k;
+								double orbitalOverlapTerm = exp(-(a*a*RabSq))*(2*a - a*a*Rab - 1/Rab);
+								// Other functional forms (for orbital overlap) are OK too
+
+								sigmaStar += (1/Rab) + orbitalOverlapTerm;
+							}
+						}
+					}
+				}
+				return J[i] + lambda * (k/2)*sigmaStar;
+
+			} else {
+
+				double sigma = 0;
+				for (int u = -aVnum; u <= aVnum; u++) {
 					for (int v = -bVnum; v <= bVnum; v++) {
 						for (int w = -cVnum; w <= cVnum; w++) {
+							if (directRadius > 0) {
+								double tx = u*aV[0] + v*bV[0] + w*cV[0];
+								double ty = u*aV[1] + v*bV[1] + w*cV[1];
+								double tz = u*aV[2] + v*bV[2] + w*cV[2];
+								if (tx*tx + ty*ty + tz*tz > directRadius*directRadius) continue;
+							}
 							double dx = Pos[i].x - Pos[j].x + u*aV[0] + v*bV[0] + w*cV[0];
 							double dy = Pos[i].y - Pos[j].y + u*aV[1] + v*bV[1] + w*cV[1];
 							double dz = Pos[i].z - Pos[j].z + u*aV[2] + v*bV[2] + w*cV[2];
@@ -739,8 +2233,7 @@ double GetJ(int i, int j) {
 			}
 		}
 	} else {
-		cout << "Serious error specifying periodic boundary conditions. Exiting" << endl;
-		exit(1);
+		throw EqeqError("Serious error specifying periodic boundary conditions");
 	}
 }
 /*****************************************************************************/
@@ -818,14 +2311,14 @@ void LoadIonizationDataFromString(const std::string &data) {
 }
 /*****************************************************************************/
 void LoadCIFFile(string filename) {
+	TraceSpan span("LoadCIFFile", -1, &filename);
 	// Two string index variables used for generating substrings from larger strings
 
 	ifstream fileInput(filename.c_str(),ios::in);
 	string data, tmp;
 
 	if(!fileInput) { // Error checking
-		printf("%s is not a valid filename\n\n", filename.c_str());
-		exit(1);
+		throw EqeqError(filename + " is not a valid filename");
 	}
 
 	while(!fileInput.eof()) { // Read file into a gigantic string
@@ -871,25 +2364,14 @@ void LoadCIFFile(string filename) {
 	cStr = data.substr(sInd, eInd - sInd); // Read in the number of atoms in the file
 	gammaAngle = atof( cStr.c_str() );
 
-	// Convert to radians
-	alphaAngle *= (PI / 180.0);
-	betaAngle *= (PI / 180.0);
-	gammaAngle *= (PI / 180.0);
-
-	// Initialize unit cell vectors from |a|,|b|,|c| and alphaAngle, betaAngle, gammaAngle information
-	// Here we are applying the A along x-axis, B in xy plane convention
-	aV[0] = aLength; aV[1] = 0; aV[2] = 0;
-	bV[0] = bLength*cos(gammaAngle); bV[1] = bLength*sin(gammaAngle); bV[2] = 0;
-	cV[0] = cLength*cos(betaAngle);
-	cV[1] = (cLength*bLength*cos(alphaAngle) - bV[0]*cV[0])/bV[1];
-	cV[2] = sqrt(cLength*cLength - cV[0]*cV[0] - cV[1]*cV[1]);
-
-	if (useEwardSums == true) DetermineReciprocalLatticeVectors();
+	SetUnitCell(aLength, bLength, cLength, alphaAngle, betaAngle, gammaAngle);
 
-	// Unitcell Volume
-	vector<double> crs;
-	crs = Cross(bV,cV);
-	unitCellVolume = fabs( aV[0]*crs[0] + aV[1]*crs[1] + aV[2]*crs[2] ); // Volume of a parallelipiped
+	// Symmetry operators; skip their block if it sits between the cell and the atom loop
+	size_t symStart, symEnd;
+	LoadSymmetryOperators(data, symStart, symEnd);
+	if ((symStart != string::npos) && ((int)symStart > eInd) && (symStart < data.find("_atom_site_fract_x"))) {
+		eInd = symEnd;
+	}
 
 	// Find first line that does not contain underscore
 	bool underscoreFound = true;
@@ -921,15 +2403,12 @@ void LoadCIFFile(string filename) {
 
 			//Read atom label
 			sInd = cStr.find_first_of(" \t", 1);
-			tStr = cStr.substr(1, sInd-1);
-			//tempAtom.label = tStr;
-			Label.push_back(tStr);
+			string label = cStr.substr(1, sInd-1);
 
 			// Read atom symbol
 			sInd = cStr.find_first_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ", sInd);
 			eInd = sInd + 1;
-			tStr = cStr.substr(sInd, eInd - sInd + 1);
-			Symbol.push_back(tStr);
+			string symbol = cStr.substr(sInd, eInd - sInd + 1);
 
 			// Find first "x" coordinate
 			sInd = cStr.find(".",sInd) - 2;
@@ -943,195 +2422,1430 @@ void LoadCIFFile(string filename) {
 			tStr = cStr.substr(sInd, eInd - sInd);
 			tempAtom.y = atof( tStr.c_str() );	// Y Position
 
-			// Find first "z" coordinate
-			sInd = cStr.find(".",eInd) - 2;
-			eInd = cStr.find_first_of(" \t\n",sInd + 2);
-			tStr = cStr.substr(sInd, eInd - sInd);
-			tempAtom.z = atof( tStr.c_str() );	// Z Position
+			// Find first "z" coordinate
+			sInd = cStr.find(".",eInd) - 2;
+			eInd = cStr.find_first_of(" \t\n",sInd + 2);
+			tStr = cStr.substr(sInd, eInd - sInd);
+			tempAtom.z = atof( tStr.c_str() );	// Z Position
+
+			AddAtom(label, symbol, tempAtom);
+		}
+		sInd = eInd2; // End of the previous line
+		eInd2 = data.find("\n", eInd2 + 1); // End of the next line
+		cStr = data.substr(sInd, eInd2 - sInd); // The line
+	}
+
+	FinishStructure();
+}
+/*****************************************************************************/
+void AddAtom(const string &label, const string &symbol, Coordinates frac) {
+	Label.push_back(label);
+	Symbol.push_back(symbol);
+	Frac.push_back(frac);
+
+	// Change from fractional to cartesian:
+	Coordinates tempAtom = frac;
+	tempAtom.x = tempAtom.x * aV[0] + tempAtom.y * bV[0] + tempAtom.z * cV[0];
+	tempAtom.y = tempAtom.x * aV[1] + tempAtom.y * bV[1] + tempAtom.z * cV[1];
+	tempAtom.z = tempAtom.x * aV[2] + tempAtom.y * bV[2] + tempAtom.z * cV[2];
+
+	Pos.push_back(tempAtom);
+
+	int i = Symbol.size() - 1;
+	int Z = s_mapStringAtomLabels[Symbol[i]]; // Get Z number from label
+
+	if (Symbol[i] == "H ") {
+		X.push_back(0.5*(hI1 + hI0));
+		J.push_back(hI1 - hI0);
+	} else {
+		int cC = IonizationData[Z].chargeCenter;
+		X.push_back(0.5*(IonizationData[Z].ionizationPotential[cC+1] +
+			IonizationData[Z].ionizationPotential[cC]));
+		J.push_back(IonizationData[Z].ionizationPotential[cC+1] -
+			IonizationData[Z].ionizationPotential[cC]);
+		X[i] -= cC*(J[i]);
+	}
+}
+/*****************************************************************************/
+void FinishStructure() {
+	ExpandSymmetryOperators();
+	if (useSymmetry == false) {
+		// Keep the expanded cell but solve for every atom independently
+		for (size_t i = 0; i < Orbit.size(); i++) Orbit[i] = i;
+		numOrbits = Orbit.size();
+	}
+
+	numAtoms = Pos.size();
+
+	DetectSupercell();
+
+	Q.resize(numAtoms, 0); // initialize charges to zero
+}
+/*****************************************************************************/
+void SetUnitCell(double a, double b, double c, double alpha, double beta, double gamma) {
+	aLength = a; bLength = b; cLength = c;
+
+	// Convert to radians
+	alphaAngle = alpha * (PI / 180.0);
+	betaAngle = beta * (PI / 180.0);
+	gammaAngle = gamma * (PI / 180.0);
+
+	// Initialize unit cell vectors from |a|,|b|,|c| and alphaAngle, betaAngle, gammaAngle information
+	// Here we are applying the A along x-axis, B in xy plane convention
+	aV[0] = aLength; aV[1] = 0; aV[2] = 0;
+	bV[0] = bLength*cos(gammaAngle); bV[1] = bLength*sin(gammaAngle); bV[2] = 0;
+	cV[0] = cLength*cos(betaAngle);
+	cV[1] = (cLength*bLength*cos(alphaAngle) - bV[0]*cV[0])/bV[1];
+	cV[2] = sqrt(cLength*cLength - cV[0]*cV[0] - cV[1]*cV[1]);
+
+	DetermineReciprocalLatticeVectors(); // Also needed for per-axis image counts and fractional coordinates
+
+	// Unitcell Volume
+	vector<double> crs;
+	crs = Cross(bV,cV);
+	unitCellVolume = fabs( aV[0]*crs[0] + aV[1]*crs[1] + aV[2]*crs[2] ); // Volume of a parallelipiped
+}
+/*****************************************************************************/
+void LoadSymmetryOperators(const string &data, size_t &blockStart, size_t &blockEnd) {
+	// Reads the _symmetry_equiv_pos_as_xyz (or newer _space_group_symop_operation_xyz) loop.
+	// blockStart/blockEnd bracket the loop so the atom reader can step over it.
+	SymOps.clear();
+	blockStart = data.find("_symmetry_equiv_pos_as_xyz");
+	if (blockStart == string::npos) blockStart = data.find("_space_group_symop_operation_xyz");
+	if (blockStart == string::npos) {
+		blockEnd = string::npos;
+		return;
+	}
+
+	size_t eInd = data.find("\n", blockStart);
+	bool dataSeen = false;
+	while (eInd != string::npos) {
+		size_t sInd = eInd + 1;
+		size_t next = data.find("\n", sInd);
+		string line = data.substr(sInd, (next == string::npos ? data.size() : next) - sInd);
+		size_t first = line.find_first_not_of(" \t\r");
+
+		if (first == string::npos) { // Blank line
+			if (dataSeen) break;
+		} else
+		if ((line[first] == '_') || (line.compare(first, 5, "loop_") == 0) || (line.compare(first, 5, "data_") == 0)) {
+			if (dataSeen) break; // The next tag or loop ends the block
+			// Otherwise another tag of the same loop, e.g. _symmetry_equiv_pos_site_id
+		} else {
+			dataSeen = true;
+			string opStr;
+			size_t q1 = line.find_first_of("'\"");
+			if (q1 != string::npos) {
+				size_t q2 = line.find(line[q1], q1 + 1);
+				opStr = line.substr(q1 + 1, q2 - q1 - 1);
+			} else {
+				// Unquoted, possibly preceded by a numeric site id
+				opStr = line.substr(first);
+				size_t sp = opStr.find_first_of(" \t");
+				if ((sp != string::npos) && (opStr.find_first_not_of("0123456789") == sp)) opStr = opStr.substr(sp);
+			}
+			SymOps.push_back(ParseSymmetryOperator(opStr));
+		}
+		eInd = next;
+	}
+	blockEnd = (eInd == string::npos) ? data.size() : eInd;
+}
+/*****************************************************************************/
+void OutputCIFFormatFile(const string &filename) {
+	string out;
+	out.reserve(512 + 64*numAtoms);
+
+	out += "data_functionalizedCrystal\n";
+	out += "_audit_creation_method\t'EQeq! by Chris Wilmer'\n";
+	out += "_symmetry_space_group_name_H-M\t'P1'\n";
+	out += "_symmetry_Int_Tables_number\t1\n";
+	out += "_symmetry_cell_setting\ttriclinic\n";
+	out += "loop_\n";
+	out += "_symmetry_equiv_pos_as_xyz\n";
+	out += "  x,y,z\n";
+	out += "_cell_length_a\t"; AppendFixed(out, aLength, 6); out += "\n";
+	out += "_cell_length_b\t"; AppendFixed(out, bLength, 6); out += "\n";
+	out += "_cell_length_c\t"; AppendFixed(out, cLength, 6); out += "\n";
+	out += "_cell_angle_alpha\t"; AppendFixed(out, alphaAngle*(180 / PI), 6); out += "\n";
+	out += "_cell_angle_beta\t"; AppendFixed(out, betaAngle*(180 / PI), 6); out += "\n";
+	out += "_cell_angle_gamma\t"; AppendFixed(out, gammaAngle*(180 / PI), 6); out += "\n";
+	out += "loop_\n";
+	out += "_atom_site_label\n";
+	out += "_atom_site_type_symbol\n";
+	out += "_atom_site_fract_x\n";
+	out += "_atom_site_fract_y\n";
+	out += "_atom_site_fract_z\n";
+	out += "_atom_site_charge\n";
+
+	// Inverse of the cell matrix, for the fractional coordinates
+	double det = aV[2]*bV[1]*cV[0] - aV[1]*bV[2]*cV[0] - aV[2]*bV[0]*cV[1] +
+	             aV[0]*bV[2]*cV[1] + aV[1]*bV[0]*cV[2] - aV[0]*bV[1]*cV[2];
+	for (int i = 0; i < numAtoms; i++) {
+		double dx = Pos[i].x;
+		double dy = Pos[i].y;
+		double dz = Pos[i].z;
+
+		double a = (bV[2]*cV[1]*dx - bV[1]*cV[2]*dx - bV[2]*cV[0]*dy + bV[0]*cV[2]*dy + bV[1]*cV[0]*dz - bV[0]*cV[1]*dz)/det;
+		double b = -(aV[2]*cV[1]*dx - aV[1]*cV[2]*dx - aV[2]*cV[0]*dy + aV[0]*cV[2]*dy + aV[1]*cV[0]*dz - aV[0]*cV[1]*dz)/det;
+		double c = (aV[2]*bV[1]*dx - aV[1]*bV[2]*dx - aV[2]*bV[0]*dy + aV[0]*bV[2]*dy + aV[1]*bV[0]*dz - aV[0]*bV[1]*dz)/det;
+
+		out += "cg"; out += Symbol[i]; out += "\t"; out += Symbol[i];
+		out += "\t"; AppendFixed(out, a, 6);
+		out += "\t"; AppendFixed(out, b, 6);
+		out += "\t"; AppendFixed(out, c, 6);
+		out += "\t"; AppendFixed(out, Q[i], 6);
+		out += "\n";
+	}
+
+	out += "_end\n";
+	WriteFile(filename, out);
+}
+/*****************************************************************************/
+void OutputPDBFormatFile(const string &filename) {
+	string out;
+	out.reserve(256 + 96*numAtoms);
+
+	out += "TITLE       YourMoleculeNameHere            \n";
+	out += "REMARK   4\n";
+	out += "REMARK   4      COMPLIES WITH FORMAT V. 2.2, 16-DEC-1996\n";
+	if (isPeriodic == true) {
+		out += "CRYST1    "; AppendFixed(out, aLength, 2, 5);
+		out += "    "; AppendFixed(out, bLength, 2, 5);
+		out += "    "; AppendFixed(out, cLength, 2, 5);
+		out += "  "; AppendFixed(out, alphaAngle*180/PI, 2, 3);
+		out += "  "; AppendFixed(out, betaAngle*180/PI, 2, 3);
+		out += "  "; AppendFixed(out, gammaAngle*180/PI, 2, 3);
+		out += " P1\n";
+	}
+	for (int i = 0; i < numAtoms; i++) {
+		out += "ATOM    "; AppendInt(out, i+1, 3);
+		out += " "; out += Symbol[i]; out += "   MOL A   0     ";
+		AppendFixed(out, Pos[i].x, 3, 7, true); out += " ";
+		AppendFixed(out, Pos[i].y, 3, 7, true); out += " ";
+		AppendFixed(out, Pos[i].z, 3, 7, true); out += " ";
+		AppendFixed(out, Q[i], 2, 5, true);
+		out += "                "; out += Symbol[i]; out += "\n";
+	}
+
+	WriteFile(filename, out);
+}
+/*****************************************************************************/
+void OutputMOLFormatFile(const string &filename) {
+	string out;
+	out.reserve(512 + 64*numAtoms);
+
+	out += " Molecule_name: hypotheticalMOF\n"; // This should be updated
+	out += "\n";
+	out += "  Coord_Info: Listed Cartesian None\n";
+	out += "        "; AppendInt(out, numAtoms); out += "\n";
+
+	for (int i = 0; i < numAtoms; i++) {
+		out += "  "; AppendInt(out, i+1, 4);
+		out += "  "; AppendFixed(out, Pos[i].x, 4, 8, true);
+		out += " "; AppendFixed(out, Pos[i].y, 4, 8, true);
+		out += " "; AppendFixed(out, Pos[i].z, 4, 8, true);
+		out += "  Mof_"; out += Symbol[i];
+		out += "   "; AppendFixed(out, Q[i], 3, 6, true);
+		out += "  0  0\n";
+	}
+
+	out += "\n";
+	out += "\n";
+	out += "\n";
+	out += "  Fundcell_Info: Listed\n";
+	auto appendRow = [&](double x, double y, double z) {
+		out += "        "; AppendFixed(out, x, 4, 8);
+		out += "      "; AppendFixed(out, y, 4, 8);
+		out += "      "; AppendFixed(out, z, 4, 8);
+		out += "\n";
+	};
+	appendRow(aLength, bLength, cLength);
+	appendRow(alphaAngle*180/PI, betaAngle*180/PI, gammaAngle*180/PI);
+	out += "        0.00000        0.00000       0.00000\n";
+	appendRow(aLength, bLength, cLength);
+
+	WriteFile(filename, out);
+}
+/*****************************************************************************/
+void WriteFile(const string &filename, const string &contents) {
+	FILE *out = fopen(filename.c_str(), "wb");
+	if (!out) throw EqeqError("Cannot write " + filename);
+	fwrite(contents.data(), 1, contents.size(), out);
+	fclose(out);
+}
+/*****************************************************************************/
+int MPIWorldRank() {
+#ifdef EQEQ_HAVE_MPI
+	MPIWorldSize();
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	return rank;
+#else
+	return 0;
+#endif
+}
+/*****************************************************************************/
+int MPIWorldSize() {
+#ifdef EQEQ_HAVE_MPI
+	int initialized;
+	MPI_Initialized(&initialized);
+	if (!initialized) {
+		MPI_Init(nullptr, nullptr);
+		atexit([]() { int finalized; MPI_Finalized(&finalized); if (!finalized) MPI_Finalize(); });
+	}
+	int size;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	return size;
+#else
+	return 1;
+#endif
+}
+/*****************************************************************************/
+SymmetryOperator ParseSymmetryOperator(const string &text) {
+	SymmetryOperator op;
+	int row = 0;
+	double sign = 1;
+	size_t i = 0;
+
+	while ((i < text.size()) && (row < 3)) {
+		char c = text[i];
+		if (c == ',') { row++; sign = 1; i++; }
+		else if (c == '+') { sign = 1; i++; }
+		else if (c == '-') { sign = -1; i++; }
+		else if ((c == 'x') || (c == 'X')) { op.R[row][0] += sign; sign = 1; i++; }
+		else if ((c == 'y') || (c == 'Y')) { op.R[row][1] += sign; sign = 1; i++; }
+		else if ((c == 'z') || (c == 'Z')) { op.R[row][2] += sign; sign = 1; i++; }
+		else if (isdigit(c) || (c == '.')) {
+			// Translation, either decimal ("0.5") or a fraction ("1/2")
+			char *end;
+			double value = strtod(text.c_str() + i, &end);
+			i = end - text.c_str();
+			if ((i < text.size()) && (text[i] == '/')) {
+				double denominator = strtod(text.c_str() + i + 1, &end);
+				i = end - text.c_str();
+				if (denominator != 0) value /= denominator;
+			}
+			op.t[row] += sign * value;
+			sign = 1;
+		}
+		else i++; // Whitespace and anything else we do not understand
+	}
+
+	return op;
+}
+/*****************************************************************************/
+void PermuteAtoms(const vector<int> &order) {
+	vector<int> inverse(numAtoms);
+	for (int n = 0; n < numAtoms; n++) inverse[order[n]] = n;
+
+	auto permute = [&](auto &v) {
+		if ((int)v.size() != numAtoms) return;
+		auto old = std::move(v);
+		v.clear();
+		for (int n = 0; n < numAtoms; n++) v.push_back(std::move(old[order[n]]));
+	};
+	permute(Pos); permute(Frac); permute(J); permute(X);
+	permute(Label); permute(Symbol); permute(Orbit); permute(Q);
+	for (size_t r = 0; r < ReplicaAtom.size(); r++) ReplicaAtom[r] = inverse[ReplicaAtom[r]];
+}
+/*****************************************************************************/
+void AssembleHardness(double *A) {
+	// The matrix QeqDense solves against, without its charge-difference rows, for callers
+	// that need J itself (hardness_matrix and factorize in Python). The atoms stay in CIF order.
+	TraceSpan span("AssembleHardness", numAtoms);
+	SetImageCounts();
+	if (isPeriodic && !useEwardSums && (directTol > 0)) ConvergeDirectShells();
+	size_t n = numAtoms;
+	for (size_t i = 0; i < n; i++) {
+		Checkpoint("assemble", (double)i * (2*n - i) / ((double)n * n));
+		for (size_t j = i; j < n; j++) A[i*n + j] = A[j*n + i] = GetJ(i, j);
+	}
+}
+/*****************************************************************************/
+void Qeq() {
+	StatsPhase("setup");
+	// Solvers see the atoms in Morton order; callers always get them back in CIF order
+	if (useSpatialOrder) SortAtomsSpatially();
+
+	try {
+		SetupLatticeSums();
+
+		screenEstimate = -1; familyMatched = -1;
+		solverIterations = 0; solverResidual = -1; conditionEstimate = -1; // Counters of this structure's solve
+		if ((screenTol > 0) && !screenSkip && isPeriodic && useEwardSums) {
+			QeqScreen();
+		} else
+		if (useFamily && isPeriodic && useEwardSums) {
+			QeqFamily();
+		} else
+		if (((screenTol > 0) || useSPME) && isPeriodic && useEwardSums) { // Structures flagged to skip screening get its reference solve
+			QeqSPME();
+		} else
+		if (useTree && !isPeriodic) {
+			QeqTree();
+		} else
+		if (useWolf && isPeriodic) {
+			QeqWolf();
+		} else
+		if (numOrbits < numAtoms) {
+			QeqSymmetryAdapted();
+		} else
+		if (ReplicaAtom.size() > 0) {
+			QeqBlockCirculant();
+		} else
+		if (useHMatrix) {
+			QeqHMatrix();
+		} else
+#ifdef EQEQ_HAVE_MPI
+		if (MPIWorldSize() > 1) {
+			QeqDistributed();
+		} else
+#endif
+		if (maxMemory > 0) {
+			QeqTiled();
+		} else
+		if (useMixedPrecision) {
+			QeqMixedPrecision();
+		} else {
+			QeqDense();
+		}
+		// The iterative solvers (distributed CG among them) do not see a singular matrix
+		for (int i = 0; i < numAtoms; i++) {
+			if (!std::isfinite(Q[i])) throw EqeqError("The charge of atom " + to_string(AtomOrder.empty() ? i : AtomOrder[i]) + " is not finite (singular hardness matrix?)");
+		}
+	} catch (...) { // Interrupted or singular: the atoms go back to CIF order all the same
+		RestoreAtomOrder();
+		throw;
+	}
+
+	// Options of the dense solve that one of the solvers above took precedence over
+	string ignored;
+	auto ignore = [&](bool requested, const char *option, const char *solver) {
+		if (requested && (solverName != solver)) ignored += (ignored.empty() ? "" : ", ") + string(option);
+	};
+	ignore(useHMatrix, "hmatrix", "H-matrix");
+	ignore(MPIWorldSize() > 1, "MPI distribution", "distributed");
+	ignore(maxMemory > 0, "max_memory", "tiled");
+	ignore(useMixedPrecision, "mixed_precision", "mixed-precision");
+	if (!ignored.empty()) Warn(ignored + " not used: the " + solverName + " solver took precedence (see README).");
+
+	RestoreAtomOrder();
+}
+/*****************************************************************************/
+void QeqDense() {
+	int i, j; // generic counter;
+	solverName = "dense";
+	StatsPhase("assemble");
+
+	// Formulate problem in the form of A x = b, with A row-major in the workspace
+	size_t N = numAtoms;
+	double *A = (double *)workspace.Buffer(ws_Matrix, N * N * sizeof(double));
+	vector<double> b(numAtoms,0);
+
+	// First row of A is all ones
+	for (int i = 0; i < numAtoms; i++) {
+		A[i] = 1;
+	}
+
+	// First element in b is the total charge
+	b[0] = Qtot;
+
+	// Rest of elements in b are the differences in electronegativity
+	for (int i = 1; i < numAtoms; i++) {
+		b[i] = X[i] - X[i-1];
+	}
+
+	// Fill in 2nd to Nth rows of A
+	for (int i = 1; i < numAtoms; i++) {
+		Checkpoint("assemble", (double)i / numAtoms);
+		for (int j = 0; j < numAtoms; j++) {
+			A[i*N + j] = GetJ(i-1, j) - GetJ(i, j);
+		}
+	}
+
+	StatsPhase("solve");
+	vector<double> original;
+	if (collectStats) original.assign(A, A + N*N); // Keep A for the residual
+	Q = b;
+	SolveMatrixInPlace(A, numAtoms, Q);
+	if (collectStats) solverResidual = RelativeResidual(original.data(), Q, b);
+}
+/*****************************************************************************/
+void QeqBatch(const vector<string> &paths, int digits, const function<void(size_t, double)> &emit,
+	const function<void(size_t, const EqeqError &)> &fail) {
+	// For molecules and small cells the solve is a few hundred flops, so running them one by
+	// one is all loop and call overhead. Structures with the same atom count are collected
+	// into a group of BatchLanes, whose matrices are stored interleaved (element (i, j) of
+	// every structure is contiguous), and one LDL^T sweep factorizes the whole group with
+	// the lane loop innermost. Anything that needs one of the other solvers goes through Qeq.
+	// Each structure is handed to emit(p, seconds), with Label, Symbol and Q set, as soon as
+	// its group is solved, so only the pending lanes are ever held. When screening, periodic
+	// structures go through Qeq one at a time, and screenEstimate is set for each; paths in
+	// screenRefine skip straight to the full solve.
+	// Lanes are the dense system of QeqDense with the atoms in CIF order: at batchMaxAtoms the
+	// whole matrix is in cache, so the Morton sort of Qeq would buy nothing. Supercells and
+	// structures with symmetry go through Qeq, so they get the same solvers as there.
+	// Without fail, an EqeqError ends the batch; with it, the structure is handed to
+	// fail(p, error) instead of emit and the batch goes on.
+	struct BatchGroup {
+		int count = 0;
+		vector<int> index; // Position in paths of each lane
+		vector<double> A; // n x n x BatchLanes, lower triangle
+		vector<double> B; // 2 x n x BatchLanes: 1 and X, then J^-1 1 and J^-1 X
+		vector<double> charge; // Qtot of each lane
+		vector<vector<int> > orbit; vector<int> orbitCount; // For RoundCharges
+		vector<vector<string> > label; vector<vector<string> > symbol;
+		vector<double> seconds; // Loading and assembly of each lane
+	};
+	vector<BatchGroup> groups(batchMaxAtoms + 1);
+
+	auto attempt = [&](size_t p, const function<void()> &step) -> bool { // False if p failed
+		try {
+			step();
+			return true;
+		} catch (const EqeqError &e) {
+			if (!fail) throw;
+			screenSkip = false;
+			fail(p, e);
+			return false;
+		}
+	};
+
+	auto solveGroup = [&](int n) {
+		BatchGroup &g = groups[n];
+		TraceSpan span("batch solve", n);
+		double start = Seconds();
+		for (int l = g.count; l < BatchLanes; l++) { // Unused lanes solve the identity
+			for (int i = 0; i < n; i++) g.A[((size_t)i*n + i)*BatchLanes + l] = 1;
+		}
+		bool singular[BatchLanes];
+		BatchedLDLTSolve(g.A.data(), g.B.data(), n, 2, singular);
+		double share = (Seconds() - start) / g.count;
+
+		for (int l = 0; l < g.count; l++) {
+			if (singular[l]) { // Solved alone, so it raises (or is solved) exactly as in run()
+				double restart = Seconds();
+				bool solved = attempt(g.index[l], [&]() {
+					Pos.clear(); Frac.clear(); J.clear(); X.clear(); Label.clear(); Symbol.clear();
+					LoadCIFFile(paths[g.index[l]]);
+					Qeq();
+					RoundCharges(digits);
+				});
+				screenEstimate = -1;
+				if (solved) emit(g.index[l], g.seconds[l] + share + Seconds() - restart);
+				continue;
+			}
+			vector<double> y1(n), y2(n);
+			for (int i = 0; i < n; i++) {
+				y1[i] = g.B[(size_t)i*BatchLanes + l];
+				y2[i] = g.B[((size_t)n + i)*BatchLanes + l];
+			}
+			numAtoms = n; Qtot = g.charge[l];
+			Orbit = g.orbit[l]; numOrbits = g.orbitCount[l];
+			SetChargesFromResponses(y1, y2);
+			RoundCharges(digits);
+			Label.swap(g.label[l]); Symbol.swap(g.symbol[l]);
+			screenEstimate = -1;
+			emit(g.index[l], g.seconds[l] + share);
+		}
+		g.count = 0;
+		g.index.clear();
+		std::fill(g.A.begin(), g.A.end(), 0);
+		std::fill(g.B.begin(), g.B.end(), 0);
+	};
+
+	for (size_t p = 0; p < paths.size(); p++) {
+		TraceSpan span("structure", p, &paths[p]);
+		Checkpoint("structure", (double)p / paths.size());
+		double start = Seconds();
+		Pos.clear(); Frac.clear(); J.clear(); X.clear(); Label.clear(); Symbol.clear();
+		if (!attempt(p, [&]() { LoadCIFFile(paths[p]); })) continue;
+
+		bool screening = (screenTol > 0) && isPeriodic && useEwardSums;
+		bool batched = (numAtoms <= batchMaxAtoms) && (ReplicaAtom.size() == 0) && (numOrbits == numAtoms) && !screening
+			&& !((useSPME || useFamily) && isPeriodic && useEwardSums) && !(useTree && !isPeriodic) && !(useWolf && isPeriodic);
+		if (!batched) {
+			screenSkip = screening && (screenRefine.count(paths[p]) > 0);
+			bool solved = attempt(p, [&]() {
+				Qeq();
+				StatsPhase("round");
+				RoundCharges(digits);
+			});
+			StatsPhase(nullptr);
+			if (solved) emit(p, Seconds() - start);
+			screenSkip = false;
+			continue;
+		}
+
+		SetupLatticeSums();
+
+		int n = numAtoms;
+		BatchGroup &g = groups[n];
+		if (g.A.empty()) {
+			g.A.assign((size_t)n*n*BatchLanes, 0);
+			g.B.assign((size_t)2*n*BatchLanes, 0);
+			g.charge.resize(BatchLanes); g.orbit.resize(BatchLanes); g.orbitCount.resize(BatchLanes);
+			g.label.resize(BatchLanes); g.symbol.resize(BatchLanes); g.seconds.resize(BatchLanes);
+		}
+		int l = g.count++;
+		g.index.push_back((int)p);
+		g.charge[l] = Qtot; g.orbit[l] = Orbit; g.orbitCount[l] = numOrbits;
+		g.label[l] = Label; g.symbol[l] = Symbol;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j <= i; j++) g.A[((size_t)i*n + j)*BatchLanes + l] = GetJ(i, j);
+			g.B[(size_t)i*BatchLanes + l] = 1;
+			g.B[((size_t)n + i)*BatchLanes + l] = X[i];
+		}
+		g.seconds[l] = Seconds() - start;
+		if (g.count == BatchLanes) solveGroup(n);
+	}
+
+	for (int n = 1; n <= batchMaxAtoms; n++) {
+		if (groups[n].count > 0) solveGroup(n);
+	}
+}
+/*****************************************************************************/
+void QeqBlockCirculant() {
+	// In an n1 x n2 x n3 supercell the hardness matrix is block-circulant: the interaction of
+	// site a in replica R with site b in replica R' only depends on R' - R. So only the first
+	// block row C_ab(D) = J((a,0),(b,D)) is evaluated (numSites*numAtoms kernel calls), and a
+	// DFT over the replica index turns J into one numSites x numSites block per wavevector.
+	solverName = "block-circulant";
+	StatsPhase("assemble");
+	int numReplicas = nRep[0]*nRep[1]*nRep[2];
+	int numSites = numAtoms / numReplicas;
+
+	vector<vector<complex<double> > > Chat(numSites*numSites, vector<complex<double> >(numReplicas));
+	for (int a = 0; a < numSites; a++) {
+		Checkpoint("assemble", (double)a / numSites);
+		for (int b = 0; b < numSites; b++) {
+			for (int c = 0; c < numReplicas; c++) {
+				Chat[a*numSites + b][c] = GetJ(ReplicaAtom[a*numReplicas], ReplicaAtom[b*numReplicas + c]);
+			}
+			FFT3D(Chat[a*numSites + b], nRep[0], nRep[1], nRep[2], +1);
+		}
+	}
+
+	// Equal electronegativity means J q = mu - X, so q = mu * J^-1 1 - J^-1 X, with mu fixed by
+	// the total charge. Both right-hand sides are the same in every replica, so only the
+	// k = 0 block is actually solved.
+	StatsPhase("solve");
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = BlockCirculantSolve(Chat, ones);
+	vector<double> y2 = BlockCirculantSolve(Chat, X);
+
+	SetChargesFromResponses(y1, y2);
+}
+/*****************************************************************************/
+void QeqDistributed() {
+#ifdef EQEQ_HAVE_MPI
+	solverName = "distributed";
+	StatsPhase("assemble");
+	// The lower triangle of J is cut into b x b tiles, and tile (I, K) belongs to rank
+	// (I mod pr) * pc + (K mod pc) of a pr x pc process grid (2D block-cyclic), so every rank
+	// evaluates and stores about 1/P of the lattice-sum kernel calls and of the matrix. The
+	// solve is CG with replicated vectors: each product is the rank's tiles (and their
+	// transposes) followed by one Allreduce of N doubles.
+	int size, rank;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	int pr = (int)sqrt((double)size);
+	while (size % pr != 0) pr--;
+	int pc = size / pr;
+
+	int b = mpiTileSize;
+	int T = (numAtoms + b - 1) / b;
+	vector<int> tileRow, tileCol; vector<vector<double> > tiles;
+	vector<double> diag(numAtoms, 0);
+	for (int I = 0; I < T; I++) {
+		for (int K = 0; K <= I; K++) {
+			if ((I % pr) * pc + (K % pc) != rank) continue;
+			TraceSpan span("assemble tile", (long long)I*T + K);
+			int rows = min(b, numAtoms - I*b); int cols = min(b, numAtoms - K*b);
+			vector<double> tile((size_t)rows * cols);
+			for (int r = 0; r < rows; r++) {
+				for (int c = 0; c < cols; c++) tile[(size_t)r*cols + c] = GetJ(I*b + r, K*b + c);
+			}
+			if (I == K) for (int r = 0; r < rows; r++) diag[I*b + r] = tile[(size_t)r*cols + r];
+			tileRow.push_back(I); tileCol.push_back(K); tiles.push_back(std::move(tile));
+		}
+	}
+	MPI_Allreduce(MPI_IN_PLACE, diag.data(), numAtoms, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+	auto apply = [&](const vector<double> &x, vector<double> &y) {
+		y.assign(numAtoms, 0);
+		for (size_t t = 0; t < tiles.size(); t++) {
+			int r0 = tileRow[t]*b; int c0 = tileCol[t]*b;
+			int rows = min(b, numAtoms - r0); int cols = min(b, numAtoms - c0);
+			const double *tile = tiles[t].data();
+			for (int r = 0; r < rows; r++) {
+				double sum = 0;
+				for (int c = 0; c < cols; c++) sum += tile[(size_t)r*cols + c] * x[c0 + c];
+				y[r0 + r] += sum;
+				if (r0 != c0) for (int c = 0; c < cols; c++) y[c0 + c] += tile[(size_t)r*cols + c] * x[r0 + r];
+			}
+		}
+		MPI_Allreduce(MPI_IN_PLACE, y.data(), numAtoms, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	};
+
+	StatsPhase("solve");
+	int iterations;
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = ConjugateGradient(apply, diag, ones, solverTol, solverMaxIterations, iterations);
+	vector<double> y2 = ConjugateGradient(apply, diag, X, solverTol, solverMaxIterations, iterations);
+
+	SetChargesFromResponses(y1, y2);
+#endif
+}
+/*****************************************************************************/
+void QeqHMatrix() {
+	solverName = "H-matrix";
+	StatsPhase("assemble");
+	// J is held as an H-matrix: O(N log N) storage and products for a fixed accuracy, with
+	// every stored entry exact (dense) or within acaTol (low rank). CG is preconditioned by
+	// the exact LDL^T of the dense diagonal leaf blocks, so each iteration only has to
+	// resolve the coupling between clusters.
+	BuildHMatrix();
+
+	auto precondition = [&](const vector<double> &r, vector<double> &z) {
+		for (const HBlock &B : HBlocks) {
+			if (B.F.empty()) continue;
+			int n = B.rowCount;
+			for (int i = 0; i < n; i++) {
+				double sum = r[B.row + i];
+				for (int j = 0; j < i; j++) sum -= B.F[i*n + j] * z[B.row + j];
+				z[B.row + i] = sum;
+			}
+			for (int i = 0; i < n; i++) z[B.row + i] /= B.Fd[i];
+			for (int i = n - 1; i >= 0; i--) {
+				double sum = z[B.row + i];
+				for (int j = i + 1; j < n; j++) sum -= B.F[j*n + i] * z[B.row + j];
+				z[B.row + i] = sum;
+			}
+		}
+	};
+
+	StatsPhase("solve");
+	int iterations;
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = ConjugateGradient(HMatrixMultiply, precondition, ones, solverTol, solverMaxIterations, iterations);
+	vector<double> y2 = ConjugateGradient(HMatrixMultiply, precondition, X, solverTol, solverMaxIterations, iterations);
+
+	SetChargesFromResponses(y1, y2);
+}
+/*****************************************************************************/
+void QeqMixedPrecision() {
+	// J is stored and factorized (LDL^T, no pivoting) in float: half the memory of the double
+	// solvers and twice the SIMD width in the dot products that dominate the factorization.
+	// The float solution is then refined in double, y += (LDL^T)^-1 (b - J y), until the
+	// charges move by less than a twentieth of the last digit RoundCharges keeps.
+	// One n x n float array holds J on and above the diagonal and L strictly below it. The
+	// residual must see J to more than float accuracy, or refinement only converges to the
+	// solution of float(J), so the rounding error of each upper entry is kept in a packed
+	// float triangle (J = hi + lo to ~48 bits): 3/4 of the memory of a double matrix.
+	solverName = "mixed-precision";
+	StatsPhase("assemble");
+	int n = numAtoms;
+	float *M = (float *)workspace.Buffer(ws_Matrix, (size_t)n * n * sizeof(float));
+	float *lo = (float *)workspace.Buffer(ws_MatrixLow, (size_t)n * (n + 1) / 2 * sizeof(float));
+	auto packed = [n](int i) { return (size_t)i*n - (size_t)i*(i-1)/2; }; // Start of row i of lo
+	for (int i = 0; i < n; i++) {
+		Checkpoint("assemble", (double)i * (2*n - i) / ((double)n * n));
+		for (int j = i; j < n; j++) {
+			double value = GetJ(i, j);
+			M[(size_t)i*n + j] = value;
+			lo[packed(i) + (j - i)] = value - M[(size_t)i*n + j];
+		}
+	}
+
+	StatsPhase("solve");
+	auto dot = [](const float *a, const float *b, int len) {
+		float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		int s = 0;
+		for (; s + 8 <= len; s += 8) {
+			for (int t = 0; t < 8; t++) acc[t] += a[s+t] * b[s+t];
+		}
+		float sum = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+		for (; s < len; s++) sum += a[s] * b[s];
+		return sum;
+	};
+	vector<float> d(n);
+	vector<float> w(n); // Row i of L D, filled as row i of L is computed
+	TraceSpan factorSpan("factor");
+	for (int i = 0; i < n; i++) {
+		Checkpoint("solve", (double)i / n);
+		float *Li = &M[(size_t)i*n];
+		for (int j = 0; j < i; j++) {
+			Li[j] = (M[(size_t)j*n + i] - dot(w.data(), &M[(size_t)j*n], j)) / d[j];
+			w[j] = Li[j] * d[j];
+		}
+		d[i] = Li[i] - dot(w.data(), Li, i);
+		if (fabs(d[i]) < 1e-30) {
+			throw EqeqError("Singular hardness matrix");
+		}
+	}
+
+	factorSpan.End();
+
+	// (L D L^T)^-1 for two right-hand sides, interleaved, in double on the float factors
+	auto solve = [&](vector<double> &r) {
+		for (int i = 0; i < n; i++) {
+			const float *Li = &M[(size_t)i*n];
+			double s0 = 0; double s1 = 0;
+			for (int j = 0; j < i; j++) { s0 += Li[j] * r[2*j]; s1 += Li[j] * r[2*j+1]; }
+			r[2*i] -= s0; r[2*i+1] -= s1;
+		}
+		for (int i = 0; i < n; i++) { r[2*i] /= d[i]; r[2*i+1] /= d[i]; }
+		for (int i = n - 1; i >= 0; i--) {
+			const float *Li = &M[(size_t)i*n];
+			for (int j = 0; j < i; j++) { r[2*j] -= Li[j] * r[2*i]; r[2*j+1] -= Li[j] * r[2*i+1]; }
+		}
+	};
+
+	vector<double> b(2*n);
+	for (int i = 0; i < n; i++) { b[2*i] = 1; b[2*i+1] = X[i]; }
+	vector<double> y = b;
+	solve(y);
+
+	vector<double> r(2*n);
+	vector<double> y1(n); vector<double> y2(n);
+	vector<double> previous;
+	double tolerance = 0.05 * pow(10.0, -chargePrecision);
+	for (int iteration = 0; ; iteration++) {
+		TraceSpan span("refine", iteration);
+		Checkpoint("refine", (double)iteration / maxRefinements);
+		for (int i = 0; i < n; i++) { y1[i] = y[2*i]; y2[i] = y[2*i+1]; }
+		SetChargesFromResponses(y1, y2);
+		if (!previous.empty()) {
+			double change = 0;
+			for (int i = 0; i < n; i++) change = max(change, fabs(Q[i] - previous[i]));
+			if (change < tolerance) break;
+		}
+		if (iteration == maxRefinements) {
+			Warn("mixed precision refinement did not converge");
+			break;
+		}
+		previous = Q;
+
+		// r = b - J y, with J_ij = J_ji read from the upper triangle
+		r = b;
+		for (int i = 0; i < n; i++) {
+			const float *Ji = &M[(size_t)i*n];
+			const float *loi = &lo[packed(i)];
+			double Jii = (double)Ji[i] + loi[0];
+			r[2*i] -= Jii * y[2*i]; r[2*i+1] -= Jii * y[2*i+1];
+			for (int j = i + 1; j < n; j++) {
+				double Jij = (double)Ji[j] + loi[j - i];
+				r[2*i] -= Jij * y[2*j]; r[2*i+1] -= Jij * y[2*j+1];
+				r[2*j] -= Jij * y[2*i]; r[2*j+1] -= Jij * y[2*i+1];
+			}
+		}
+		if (collectStats) { // Residual of the iterate being refined
+			double rNorm = 0; double bNorm = 0;
+			for (int i = 0; i < 2*n; i++) { rNorm += r[i]*r[i]; bNorm += b[i]*b[i]; }
+			solverResidual = sqrt(rNorm / bNorm);
+			solverIterations = iteration + 1;
+		}
+		solve(r);
+		for (int i = 0; i < 2*n; i++) y[i] += r[i];
+	}
+}
+/*****************************************************************************/
+void QeqScreen() {
+	// Screening (screenTol > 0): approximate charges for a fraction of the cost of a full
+	// solve, with an estimate of their error, refined only when the estimate is too large.
+	// The reference is converged Ewald, i.e. the SPME operator of QeqSPME.
+	// Tier one:
+	//   - Wolf real-space sums within screenCutoff (no reciprocal space), with the pair
+	//     values stored in float
+	//   - at most screenSweeps Jacobi-preconditioned CG iterations per right-hand side
+	// Estimate: screenEstimateSweeps CG iterations with the Ewald operator on the residual of
+	// the tier-one responses, and the largest change that makes to any charge, times
+	// screenSafety. Three sweeps do not converge the correction: over 22 test structures the
+	// change alone was 0.41 to 1.02 of the true error (the least on 2400-atom MOFs), so with
+	// the factor the estimate was 1.2 to 3.1 times the error there. That is an empirical
+	// scale, not a bound; a structure unlike the test set can be underestimated. (The rigorous
+	// bound |P(J q + X)| / lambda_min was ~90 times the error on the MOFs, too loose to screen.)
+	// Tier two, when that is above screenTol: the same correction solve carried on to
+	// solverTol, so the charges are those of QeqSPME.
+	solverName = "screen";
+	StatsPhase("assemble");
+	BuildRealSpacePairs(screenCutoff, 1 / wolfAlpha, true);
+	vector<int> rowStart = PairRowStart; vector<int> col = PairCol;
+	vector<float> val(PairVal.begin(), PairVal.end());
+
+	double pf = lambda * (k/2);
+	double self = -(erfc(wolfAlpha * screenCutoff) / screenCutoff + 2*wolfAlpha/sqrt(PI));
+	vector<double> diag(numAtoms);
+	for (int i = 0; i < numAtoms; i++) diag[i] = J[i] + pf * (PairDiag[i] + self);
+
+	auto apply = [&](const vector<double> &q, vector<double> &out) {
+		for (int i = 0; i < numAtoms; i++) out[i] = diag[i] * q[i];
+		for (int i = 0; i < numAtoms; i++) {
+			float qi = q[i]; float sum = 0;
+			for (int p = rowStart[i]; p < rowStart[i+1]; p++) {
+				sum += val[p] * (float)q[col[p]];
+				out[col[p]] += pf * val[p] * qi;
+			}
+			out[i] += pf * sum;
+		}
+	};
+
+	StatsPhase("solve");
+	int iterations;
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = ConjugateGradient(apply, diag, ones, solverTol, screenSweeps, iterations);
+	vector<double> y2 = ConjugateGradient(apply, diag, X, solverTol, screenSweeps, iterations);
+	SetChargesFromResponses(y1, y2);
+	vector<double> approximate = Q;
+
+	StatsPhase("estimate");
+	vector<double> ewaldDiag;
+	function<void(const vector<double> &, vector<double> &)> ewald = SPMEOperator(ewaldDiag);
+	// J (y + d) = b: d solves the residual system, to tol relative to b rather than to it
+	auto correct = [&](vector<double> &y, const vector<double> &b, int maxIterations, double tol) {
+		vector<double> r(numAtoms);
+		ewald(y, r);
+		double rNorm = 0; double bNorm = 0;
+		for (int i = 0; i < numAtoms; i++) { r[i] = b[i] - r[i]; rNorm += r[i]*r[i]; bNorm += b[i]*b[i]; }
+		if (rNorm == 0) return;
+		vector<double> d = ConjugateGradient(ewald, ewaldDiag, r, tol * sqrt(bNorm / rNorm), maxIterations, iterations);
+		for (int i = 0; i < numAtoms; i++) y[i] += d[i];
+	};
+	correct(y1, ones, screenEstimateSweeps, solverTol);
+	correct(y2, X, screenEstimateSweeps, solverTol);
+	SetChargesFromResponses(y1, y2);
+	screenEstimate = 0;
+	for (int i = 0; i < numAtoms; i++) screenEstimate = max(screenEstimate, fabs(Q[i] - approximate[i]));
+	screenEstimate *= screenSafety;
+	if (screenEstimate <= screenTol) {
+		Q = approximate;
+		return;
+	}
+
+	solverName = "screen+refine";
+	StatsPhase("refine");
+	correct(y1, ones, solverMaxIterations, solverTol);
+	correct(y2, X, solverMaxIterations, solverTol);
+	SetChargesFromResponses(y1, y2);
+}
+/*****************************************************************************/
+void QeqFamily() {
+	// Hypothetical-MOF libraries hold many structures on one framework and cell that differ in
+	// their functional groups. Each is solved with the matrix-free Ewald of QeqSPME, but the
+	// first one of a cell (the parent) leaves behind what its siblings can reuse:
+	//   - the SPME grid and influence function (SetupSPME keeps them while the cell is the same)
+	//   - a block-Jacobi preconditioner: the LDL^T of the near-field matrix (diagonal plus
+	//     real-space pairs) of each block of familyBlockSize atoms consecutive in Morton order
+	//   - its atoms by position, so that each sibling atom finds its counterpart
+	//   - its charges, from which the siblings' CG starts
+	// A block whose parent atoms are all in the sibling, at the same places, has the same
+	// near-field matrix there, so its factor is used as is; the other atoms get Jacobi.
+	// A structure with less than familyMinMatched of its atoms found in the parent (another
+	// framework in the same cell) would gain little from it, and becomes the new parent.
+	solverName = "family";
+	StatsPhase("assemble");
+	vector<double> diag;
+	function<void(const vector<double> &, vector<double> &)> apply = SPMEOperator(diag);
+
+	auto fractional = [](int i, double *f) {
+		f[0] = (Pos[i].x*hV[0] + Pos[i].y*hV[1] + Pos[i].z*hV[2]) / (2*PI);
+		f[1] = (Pos[i].x*jV[0] + Pos[i].y*jV[1] + Pos[i].z*jV[2]) / (2*PI);
+		f[2] = (Pos[i].x*kV[0] + Pos[i].y*kV[1] + Pos[i].z*kV[2]) / (2*PI);
+	};
+
+	// Each atom's counterpart in the parent; two atoms on one site only get it once
+	bool sibling = family.Matches();
+	vector<int> parentAtom(numAtoms, -1);
+	if (sibling) {
+		familyMatched = 0;
+		vector<bool> taken(family.numAtoms, false);
+		for (int i = 0; i < numAtoms; i++) {
+			double f[3];
+			fractional(i, f);
+			int m = family.sites.Find(f[0], f[1], f[2], Symbol[i]);
+			if ((m < 0) || taken[m]) continue;
+			taken[m] = true;
+			parentAtom[i] = m;
+			familyMatched++;
+		}
+		if (familyMatched < familyMinMatched * numAtoms) { // Too different to gain from the parent: it is replaced
+			sibling = false;
+			familyMatched = -1;
+			parentAtom.assign(numAtoms, -1);
+		}
+	}
+
+	// A new parent is built aside and only becomes the family once it is solved, so an
+	// interrupted or failed parent leaves the previous family (or none) in place
+	Family parent;
+	if (!sibling) {
+		double key[10] = {aLength, bLength, cLength, alphaAngle, betaAngle, gammaAngle, lambda, hI0, rcut, eta};
+		copy(key, key + 10, parent.key);
+		parent.numAtoms = numAtoms;
+		for (int i = 0; i < numAtoms; i++) {
+			double f[3];
+			fractional(i, f);
+			parent.sites.Add(i, f[0], f[1], f[2], Symbol[i]);
+			parentAtom[i] = i;
+		}
+
+		double pf = lambda * (k/2);
+		for (int s0 = 0; s0 < numAtoms; s0 += familyBlockSize) {
+			Checkpoint("assemble", (double)s0 / numAtoms);
+			int n = min(familyBlockSize, numAtoms - s0);
+			vector<double> A((size_t)n*n, 0);
+			for (int i = 0; i < n; i++) {
+				A[i*n + i] = diag[s0 + i];
+				for (int p = PairRowStart[s0 + i]; p < PairRowStart[s0 + i + 1]; p++) {
+					int j = PairCol[p] - s0; // Pairs have j > i
+					if (j >= n) continue;
+					A[i*n + j] += pf * PairVal[p];
+					A[j*n + i] += pf * PairVal[p];
+				}
+			}
+			LDLTFactor(A.data(), n);
+			for (int i = 0; i < n; i++) if (A[i*n + i] <= 0) A.clear();
+			parent.blockStart.push_back(s0);
+			parent.factor.push_back(A);
+		}
+		parent.blockStart.push_back(numAtoms);
+	}
+	const Family &source = sibling ? family : parent;
+
+	// Each parent atom's counterpart here, and the blocks that are all present
+	vector<int> siblingAtom(source.numAtoms, -1);
+	for (int i = 0; i < numAtoms; i++) {
+		if (parentAtom[i] >= 0) siblingAtom[parentAtom[i]] = i;
+	}
+	vector<int> blocks;
+	for (size_t b = 0; b + 1 < source.blockStart.size(); b++) {
+		bool present = !source.factor[b].empty();
+		for (int m = source.blockStart[b]; m < source.blockStart[b+1]; m++) present = present && (siblingAtom[m] >= 0);
+		if (present) blocks.push_back(b);
+	}
+
+	vector<double> w(familyBlockSize);
+	auto blockJacobi = [&](const vector<double> &r, vector<double> &z) {
+		for (int i = 0; i < numAtoms; i++) z[i] = r[i] / diag[i];
+		for (int b : blocks) {
+			int s0 = source.blockStart[b]; int n = source.blockStart[b+1] - s0;
+			for (int i = 0; i < n; i++) w[i] = r[siblingAtom[s0 + i]];
+			LDLTSolve(source.factor[b].data(), n, w.data(), 1);
+			for (int i = 0; i < n; i++) z[siblingAtom[s0 + i]] = w[i];
+		}
+	};
+
+	// The charges minimize q.J q / 2 + X.q over sum q = Qtot, so they are solved for directly
+	// with one CG on the zero-sum subspace rather than through the two responses of QeqSPME:
+	// the siblings change the charges only around their new groups, while J^-1 1 and
+	// J^-1 X change everywhere. Residuals are projected onto the subspace (J q + X less its
+	// mean), and so is the preconditioner: z = M^-1 r - M^-1 1 (1.M^-1 r) / (1.M^-1 1).
+	vector<double> ones(numAtoms, 1), M1(numAtoms);
+	blockJacobi(ones, M1);
+	double oneM1 = accumulate(M1.begin(), M1.end(), 0.0);
+	auto project = [](vector<double> &v) {
+		double mean = accumulate(v.begin(), v.end(), 0.0) / v.size();
+		for (double &x : v) x -= mean;
+	};
+	auto projectedApply = [&](const vector<double> &d, vector<double> &out) { apply(d, out); project(out); };
+	auto precondition = [&](const vector<double> &r, vector<double> &z) {
+		blockJacobi(r, z);
+		double c = 0;
+		for (int i = 0; i < numAtoms; i++) c += r[i] * M1[i];
+		for (int i = 0; i < numAtoms; i++) z[i] -= M1[i] * (c / oneM1);
+	};
+
+	// The parent starts from uniform charges, and a sibling from the parent's, with its new
+	// atoms at (mu - X_i) / J_ii for the parent's mu; either is then shifted to sum to Qtot
+	StatsPhase("solve");
+	vector<double> q(numAtoms, 0);
+	if (sibling) {
+		for (int i = 0; i < numAtoms; i++) q[i] = (parentAtom[i] >= 0) ? family.q[parentAtom[i]] : (family.mu - X[i]) / diag[i];
+	}
+	double shift = (Qtot - accumulate(q.begin(), q.end(), 0.0)) / numAtoms;
+	for (double &x : q) x += shift;
+
+	vector<double> r(numAtoms);
+	apply(q, r);
+	for (int i = 0; i < numAtoms; i++) r[i] = -(r[i] + X[i]);
+	project(r);
+	// Converged at the residual a solve from zero charges would stop at
+	vector<double> b = X;
+	project(b);
+	double rNorm = sqrt(inner_product(r.begin(), r.end(), r.begin(), 0.0));
+	double bNorm = sqrt(inner_product(b.begin(), b.end(), b.begin(), 0.0));
+	if (rNorm > 0) {
+		int iterations;
+		vector<double> d = ConjugateGradient(projectedApply, precondition, r, solverTol * bNorm / rNorm, solverMaxIterations, iterations);
+		for (int i = 0; i < numAtoms; i++) q[i] += d[i];
+	}
+
+	if (!sibling) { // mu is the (equalized) electronegativity J q + X
+		apply(q, r);
+		parent.mu = 0;
+		for (int i = 0; i < numAtoms; i++) parent.mu += (r[i] + X[i]) / numAtoms;
+		parent.q = q;
+		family = std::move(parent);
+	}
+	Q = q;
+}
+/*****************************************************************************/
+void QeqSPME() {
+	solverName = "SPME";
+	StatsPhase("assemble");
+	// Matrix-free Ewald for large cells. J q is applied as
+	//   hardness + self terms (diagonal)
+	//   + real space: erfc and overlap terms over a pair list within rcut
+	//   + reciprocal space: smooth particle mesh Ewald on a B-spline grid
+	// which is O(N log N) per application, and J q = mu - X is solved with CG.
+	// The Ewald split is converged by construction, so eta only has to keep the real-space
+	// part inside the cutoff; it is capped at rcut/3.5 (erfc(3.5) ~ 1e-6).
+	vector<double> diag;
+	function<void(const vector<double> &, vector<double> &)> apply = SPMEOperator(diag);
+
+	StatsPhase("solve");
+	int iterations;
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = ConjugateGradient(apply, diag, ones, solverTol, solverMaxIterations, iterations);
+	vector<double> y2 = ConjugateGradient(apply, diag, X, solverTol, solverMaxIterations, iterations);
+
+	SetChargesFromResponses(y1, y2);
+}
+/*****************************************************************************/
+function<void(const vector<double> &, vector<double> &)> SPMEOperator(vector<double> &diag) {
+	// J q as QeqSPME applies it, with the pair list and mesh set up here; diag gets its
+	// diagonal for the preconditioner
+	double splitting = min(eta, rcut / 3.5);
+
+	BuildRealSpacePairs(rcut, splitting, false);
+	SetupSPME(splitting);
 
-			// Change from fractional to cartesian:
-			tempAtom.x = tempAtom.x * aV[0] + tempAtom.y * bV[0] + tempAtom.z * cV[0];
-			tempAtom.y = tempAtom.x * aV[1] + tempAtom.y * bV[1] + tempAtom.z * cV[1];
-			tempAtom.z = tempAtom.x * aV[2] + tempAtom.y * bV[2] + tempAtom.z * cV[2];
+	double pf = lambda * (k/2);
+	diag.resize(numAtoms);
+	for (int i = 0; i < numAtoms; i++) {
+		diag[i] = J[i] + pf * (PairDiag[i] + SPMERecipDiag - 2/(splitting*sqrt(PI)));
+	}
 
-			Pos.push_back(tempAtom);
+	return [pf, splitting, phi = vector<double>(numAtoms)](const vector<double> &q, vector<double> &out) mutable {
+		SPMEPotential(q, phi);
+		for (int i = 0; i < numAtoms; i++) {
+			out[i] = (J[i] + pf * (PairDiag[i] - 2/(splitting*sqrt(PI)))) * q[i] + pf * phi[i];
+		}
+		for (int i = 0; i < numAtoms; i++) {
+			for (int p = PairRowStart[i]; p < PairRowStart[i+1]; p++) {
+				out[i] += pf * PairVal[p] * q[PairCol[p]];
+				out[PairCol[p]] += pf * PairVal[p] * q[i];
+			}
+		}
+	};
+}
+/*****************************************************************************/
+void QeqTiled() {
+	// Solves J y1 = 1 and J y2 = X with a left-looking LDL^T of the symmetric hardness matrix,
+	// which only needs its lower triangle: half the memory of QeqDense, and no copies.
+	// Column K of L is built from the tiles of row K (kept in memory) and the tiles of each
+	// row I streamed in, so the working set is one row/column panel of tiles however large
+	// the matrix is. The tiles themselves stay in memory if they fit, else in a scratch file.
+	solverName = "tiled";
+	StatsPhase("assemble");
+	size_t budget = (size_t)(maxMemory * 1048576 / sizeof(double));
+	auto panel = [&](int b) { return (size_t)((numAtoms + b - 1) / b + 2) * b * b + 4*(size_t)numAtoms; };
+	int b = 256;
+	while ((b > 16) && (panel(b) > budget)) b /= 2;
+	if (panel(b) > budget) {
+		throw EqeqError("max_memory is too small for " + to_string(numAtoms) + " atoms");
+	}
+	int T = (numAtoms + b - 1) / b;
+	bool inMemory = ((size_t)T*(T+1)/2 * b * b + panel(b) <= budget);
+	TileMatrix A(numAtoms, b, inMemory, scratchDir);
+
+	// Assembly; the padding of the last tile row is an identity block
+	vector<double> tile((size_t)b * b);
+	for (int I = 0; I < T; I++) {
+		TraceSpan span("assemble tile row", I);
+		Checkpoint("assemble", (double)I*(I+1) / (T*(T+1)));
+		for (int K = 0; K <= I; K++) {
+			for (int r = 0; r < b; r++) {
+				for (int c = 0; c < b; c++) {
+					int i = I*b + r; int j = K*b + c;
+					tile[r*b + c] = ((i < numAtoms) && (j < numAtoms)) ? GetJ(i, j) : ((i == j) ? 1 : 0);
+				}
+			}
+			A.Write(I, K, tile.data());
+		}
+	}
 
-			int i = Symbol.size() - 1;
-			int Z = s_mapStringAtomLabels[Symbol[i]]; // Get Z number from label
+	StatsPhase("solve");
+	// Factorization. Slots 0..K-1 of the panel hold D_P L_KP^T (as [c][s] = D_P[s] L_KP[c][s]),
+	// slots K..T-1 hold column K.
+	vector<double> D((size_t)T * b);
+	vector<double> work((size_t)T * b * b);
+	for (int K = 0; K < T; K++) {
+		TraceSpan span("factor panel", K);
+		Checkpoint("solve", (double)K / T);
+		for (int P = 0; P < K; P++) {
+			double *W = &work[(size_t)P*b*b];
+			A.Read(K, P, W);
+			for (int c = 0; c < b; c++) for (int s = 0; s < b; s++) W[c*b + s] *= D[P*b + s];
+		}
+		for (int I = K; I < T; I++) {
+			double *C = &work[(size_t)I*b*b];
+			A.Read(I, K, C);
+			for (int P = 0; P < K; P++) {
+				A.Read(I, P, tile.data());
+				const double *W = &work[(size_t)P*b*b];
+				for (int r = 0; r < b; r++) {
+					for (int c = 0; c < b; c++) {
+						double sum = 0;
+						for (int s = 0; s < b; s++) sum += tile[r*b + s] * W[c*b + s];
+						C[r*b + c] -= sum;
+					}
+				}
+			}
+		}
 
-			if (Symbol[i] == "H ") {
-				X.push_back(0.5*(hI1 + hI0));
-				J.push_back(hI1 - hI0);
-			} else {
-				int cC = IonizationData[Z].chargeCenter;
-				X.push_back(0.5*(IonizationData[Z].ionizationPotential[cC+1] +
-					IonizationData[Z].ionizationPotential[cC]));
-				J.push_back(IonizationData[Z].ionizationPotential[cC+1] -
-					IonizationData[Z].ionizationPotential[cC]);
-				X[i] -= cC*(J[i]);
+		// L_KK D_K L_KK^T = A_KK, then L_IK = A_IK L_KK^-T D_K^-1
+		double *C = &work[(size_t)K*b*b];
+		double *d = &D[K*b];
+		for (int j = 0; j < b; j++) {
+			double djj = C[j*b + j];
+			for (int s = 0; s < j; s++) djj -= C[j*b + s] * C[j*b + s] * d[s];
+			if (fabs(djj) < 1e-300) {
+				throw EqeqError("Singular hardness matrix");
+			}
+			d[j] = djj;
+			for (int i = j + 1; i < b; i++) {
+				double sum = C[i*b + j];
+				for (int s = 0; s < j; s++) sum -= C[i*b + s] * C[j*b + s] * d[s];
+				C[i*b + j] = sum / djj;
+			}
+		}
+		A.Write(K, K, C);
+		for (int I = K + 1; I < T; I++) {
+			double *L = &work[(size_t)I*b*b];
+			for (int r = 0; r < b; r++) {
+				for (int j = 0; j < b; j++) {
+					double sum = L[r*b + j];
+					for (int s = 0; s < j; s++) sum -= L[r*b + s] * d[s] * C[j*b + s];
+					L[r*b + j] = sum / d[j];
+				}
 			}
+			A.Write(I, K, L);
+		}
+	}
 
-			bool beenDone = false;
-			for (int j = 0; j < i; j++) {
-				if (Symbol[i] == Symbol[j]) beenDone = true;
+	// L z = rhs, z /= D, L^T y = z, for both right-hand sides at once
+	vector<double> y((size_t)T * b * 2, 0);
+	for (int i = 0; i < numAtoms; i++) { y[2*i] = 1; y[2*i+1] = X[i]; }
+	for (int I = 0; I < T; I++) {
+		for (int P = 0; P <= I; P++) {
+			A.Read(I, P, tile.data());
+			for (int r = 0; r < b; r++) {
+				double s0 = 0; double s1 = 0;
+				int cEnd = (P == I) ? r : b; // The diagonal tile is unit lower triangular
+				for (int c = 0; c < cEnd; c++) {
+					s0 += tile[r*b + c] * y[2*(P*b + c)];
+					s1 += tile[r*b + c] * y[2*(P*b + c) + 1];
+				}
+				y[2*(I*b + r)] -= s0; y[2*(I*b + r) + 1] -= s1;
 			}
-			if (beenDone == false) {
-				// cout << Symbol[i] << "\t";
-				// cout << "Z: " << Z+1 << "\t";
-				// cout << "Ch. Cent: " << IonizationData[Z].chargeCenter << "\t";
-				// cout << "X: " << X[i] << "\t";
-				// cout << "J: " << J[i] << "\t" << endl;
+		}
+	}
+	for (size_t i = 0; i < D.size(); i++) { y[2*i] /= D[i]; y[2*i+1] /= D[i]; }
+	for (int I = T - 1; I >= 0; I--) {
+		for (int P = T - 1; P >= I; P--) {
+			A.Read(P, I, tile.data()); // Row block P of column I of L: y_I -= L_PI^T y_P
+			for (int c = b - 1; c >= 0; c--) {
+				double s0 = 0; double s1 = 0;
+				int rStart = (P == I) ? c + 1 : 0;
+				for (int r = rStart; r < b; r++) {
+					s0 += tile[r*b + c] * y[2*(P*b + r)];
+					s1 += tile[r*b + c] * y[2*(P*b + r) + 1];
+				}
+				y[2*(I*b + c)] -= s0; y[2*(I*b + c) + 1] -= s1;
 			}
 		}
-		sInd = eInd2; // End of the previous line
-		eInd2 = data.find("\n", eInd2 + 1); // End of the next line
-		cStr = data.substr(sInd, eInd2 - sInd); // The line
 	}
 
-	numAtoms = Pos.size();
+	double dMin = fabs(D[0]); double dMax = fabs(D[0]);
+	for (int i = 0; i < numAtoms; i++) { dMin = min(dMin, fabs(D[i])); dMax = max(dMax, fabs(D[i])); }
+	conditionEstimate = dMax / dMin;
 
-	Q.resize(numAtoms, 0); // initialize charges to zero
+	vector<double> y1(numAtoms); vector<double> y2(numAtoms);
+	for (int i = 0; i < numAtoms; i++) { y1[i] = y[2*i]; y2[i] = y[2*i+1]; }
+	SetChargesFromResponses(y1, y2);
 }
-// /*****************************************************************************/
-// void OutputCIFFormatFile(string filename) {
-// 	FILE *out; string str = "";
-// 	int fileFormat = 2;
-// 	out = fopen(filename.c_str(),"wt");
-//
-// 	str += "data_functionalizedCrystal"; str	+= "\n";
-// 	str += "_audit_creation_method\t"; str += "'EQeq! by Chris Wilmer'"; str += "\n";
-// 	str += "_symmetry_space_group_name_H-M\t"; str += "'P1'"; str += "\n";
-// 	str += "_symmetry_Int_Tables_number\t"; str += "1"; str += "\n";
-// 	str += "_symmetry_cell_setting\t"; str += "triclinic"; str += "\n";
-// 	str += "loop_"; str += "\n";
-// 	str += "_symmetry_equiv_pos_as_xyz"; str += "\n";
-// 	str += "  x,y,z"; str += "\n";
-// 	fprintf(out,str.c_str());
-// 	fprintf(out,"_cell_length_a\t%f\n",aLength);
-// 	fprintf(out,"_cell_length_b\t%f\n",bLength);
-// 	fprintf(out,"_cell_length_c\t%f\n",cLength);
-// 	fprintf(out,"_cell_angle_alpha\t%f\n",alphaAngle*(180 / PI));
-// 	fprintf(out,"_cell_angle_beta\t%f\n",betaAngle*(180 / PI));
-// 	fprintf(out,"_cell_angle_gamma\t%f\n",gammaAngle*(180 / PI));
-// 	str = "";
-// 	str += "loop_"; str += "\n";
-// 	str += "_atom_site_label"; str += "\n";
-// 	str += "_atom_site_type_symbol"; str += "\n";
-// 	str += "_atom_site_fract_x"; str += "\n";
-// 	str += "_atom_site_fract_y"; str += "\n";
-// 	str += "_atom_site_fract_z"; str += "\n";
-// 	str += "_atom_site_charge"; str += "\n";
-// 	fprintf(out,str.c_str());
-//
-// 	int k = 0;
-//
-// 	// For all atoms
-// 	for (int i = 0; i < numAtoms ; i++) {
-// 		k++;
-// 		// Determine the fractional coordinates
-// 		double dx = Pos[i].x;
-// 		double dy = Pos[i].y;
-// 		double dz = Pos[i].z;
-//
-// 		// Convert to fractional coordinates (below is the "inverse transform matrix")
-// 		double a = (bV[2]*cV[1]*dx - bV[1]*cV[2]*dx - bV[2]*cV[0]*dy + bV[0]*cV[2]*dy + bV[1]*cV[0]*dz - bV[0]*cV[1]*dz)/
-// 		           (aV[2]*bV[1]*cV[0] - aV[1]*bV[2]*cV[0] - aV[2]*bV[0]*cV[1] +
-// 				    aV[0]*bV[2]*cV[1] + aV[1]*bV[0]*cV[2] - aV[0]*bV[1]*cV[2]);
-// 		double b = (aV[2]*cV[1]*dx - aV[1]*cV[2]*dx - aV[2]*cV[0]*dy + aV[0]*cV[2]*dy + aV[1]*cV[0]*dz - aV[0]*cV[1]*dz)/
-// 		           (-(aV[2]*bV[1]*cV[0]) + aV[1]*bV[2]*cV[0] + aV[2]*bV[0]*cV[1] -
-// 				   aV[0]*bV[2]*cV[1] - aV[1]*bV[0]*cV[2] + aV[0]*bV[1]*cV[2]);
-// 		double c = (aV[2]*bV[1]*dx - aV[1]*bV[2]*dx - aV[2]*bV[0]*dy + aV[0]*bV[2]*dy + aV[1]*bV[0]*dz - aV[0]*bV[1]*dz)/
-// 		           (aV[2]*bV[1]*cV[0] - aV[1]*bV[2]*cV[0] - aV[2]*bV[0]*cV[1] +
-// 				   aV[0]*bV[2]*cV[1] + aV[1]*bV[0]*cV[2] - aV[0]*bV[1]*cV[2]);
-//
-// 		fprintf(out,"cg");
-// 		fprintf(out,Symbol[i].c_str());
-// 		fprintf(out,"\t");
-// 		fprintf(out,Symbol[i].c_str());
-// 		fprintf(out,"\t%f\t%f\t%f\t%f\n",a,b,c,Q[i]);
-// 	}
-//
-// 	fprintf(out,"_end\n");
-// 	fclose(out);
-// }
-// /*****************************************************************************/
-// void OutputPDBFormatFile(string filename) {
-// 	FILE *out;
-// 	out = fopen(filename.c_str(),"wt");
-//
-// 	fprintf(out,"TITLE       YourMoleculeNameHere            \n");
-// 	fprintf(out,"REMARK   4\n");
-// 	fprintf(out,"REMARK   4      COMPLIES WITH FORMAT V. 2.2, 16-DEC-1996\n");
-// 	if (isPeriodic == true) {
-// 		fprintf(out,"CRYST1    %5.2f    %5.2f    %5.2f  %3.2f  %3.2f  %3.2f P1\n",
-// 			aLength,bLength,cLength,alphaAngle*180/PI,betaAngle*180/PI,gammaAngle*180/PI);
-// 	} else {
-// 		// Do nothing
-// 	}
-// 	for (int i = 0; i < numAtoms; i++) {
-// 		fprintf(out,"ATOM    %3d %s   MOL A   0     % 7.3f % 7.3f % 7.3f % 5.2f                %s\n",
-// 			i+1,Symbol[i].c_str(),Pos[i].x,Pos[i].y,Pos[i].z,Q[i],Symbol[i].c_str());
-// 	}
-//
-// 	fclose(out);
-// }
-// /*****************************************************************************/
-// void OutputMOLFormatFile(string filename) {
-// 	FILE *out;
-// 	out = fopen(filename.c_str(),"wt");
-//
-// 	fprintf(out," Molecule_name: hypotheticalMOF\n"); // This should be updated
-// 	fprintf(out,"\n");
-// 	fprintf(out,"  Coord_Info: Listed Cartesian None\n");
-// 	fprintf(out,"        %d\n",numAtoms);
-//
-// 	for (int i = 0; i < numAtoms; i++) {
-// 		fprintf(out,"  %4d  % 8.4f % 8.4f % 8.4f  Mof_%s   % 6.3f  0  0\n",
-// 			i+1,Pos[i].x,Pos[i].y,Pos[i].z,Symbol[i].c_str(),Q[i]);
-// 	}
-//
-// 	fprintf(out,"\n");
-// 	fprintf(out,"\n");
-// 	fprintf(out,"\n");
-// 	fprintf(out,"  Fundcell_Info: Listed\n");
-// 	fprintf(out,"        %8.4f      %8.4f      %8.4f\n",aLength,bLength,cLength);
-// 	fprintf(out,"        %8.4f      %8.4f      %8.4f\n",alphaAngle*180/PI,betaAngle*180/PI,gammaAngle*180/PI);
-// 	fprintf(out,"        0.00000        0.00000       0.00000\n");
-// 	fprintf(out,"        %8.4f      %8.4f      %8.4f\n",aLength,bLength,cLength);
-//
-// 	fclose(out);
-// }
 /*****************************************************************************/
-void Qeq() {
-	int i, j; // generic counter;
+void QeqTree() {
+	solverName = "tree";
+	StatsPhase("assemble");
+	// Matrix-free NonPeriodic method for large clusters. J q is applied as
+	//   hardness (diagonal)
+	//   + 1/R for all pairs, from a fast multipole tree code with expansion order treeOrder
+	//   + the orbital overlap term, exactly, over a pair list
+	// and J q = mu - X is solved with CG.
+	if ((treeOrder < 0) || (treeOrder > maxTreeOrder))
+		throw EqeqError("tree_order must be between 0 and " + to_string(maxTreeOrder) + ", not " + to_string(treeOrder));
+	if (numAtoms == 0) { Q.clear(); return; }
+	BuildOctree();
+
+	// The overlap term decays like exp(-a^2 R^2) with a = sqrt(Ji Jj)/k; cut it off at 1e-12
+	double Jmin = J[0];
+	for (int i = 1; i < numAtoms; i++) Jmin = min(Jmin, J[i]);
+	double aMin = max(Jmin, 1e-3) / k;
+	BuildOverlapPairs(sqrt(-log(1e-12)) / aMin);
+
+	double pf = lambda * (k/2);
+	vector<double> phi(numAtoms);
+	auto apply = [&](const vector<double> &q, vector<double> &out) {
+		TreePotential(q, phi);
+		for (int i = 0; i < numAtoms; i++) out[i] = J[i] * q[i] + pf * phi[i];
+		for (int i = 0; i < numAtoms; i++) {
+			for (int p = PairRowStart[i]; p < PairRowStart[i+1]; p++) {
+				out[i] += pf * PairVal[p] * q[PairCol[p]];
+				out[PairCol[p]] += pf * PairVal[p] * q[i];
+			}
+		}
+	};
 
-	// Formulate problem in the form of A x = b
-	vector<double> dummyRow(numAtoms, 0); // Is doing this necessary?
-	vector<vector<double> > A(numAtoms, dummyRow);
-	vector<double> b(numAtoms,0);
+	StatsPhase("solve");
+	int iterations;
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = ConjugateGradient(apply, J, ones, solverTol, solverMaxIterations, iterations);
+	vector<double> y2 = ConjugateGradient(apply, J, X, solverTol, solverMaxIterations, iterations);
 
-	// First row of A is all ones
-	for (int i = 0; i < numAtoms; i++) {
-		A[0][i] = 1;
-	}
+	SetChargesFromResponses(y1, y2);
+}
+/*****************************************************************************/
+void QeqWolf() {
+	solverName = "Wolf";
+	StatsPhase("assemble");
+	// Periodic charges from real-space sums alone. Every pair within rcut interacts through
+	// the damped shifted force potential (Fennell and Gezelter, 2006)
+	//   erfc(alpha R)/R - erfc(alpha Rc)/Rc + (erfc(alpha Rc)/Rc^2 + 2alpha/sqrt(pi) exp(-alpha^2 Rc^2)/Rc) (R - Rc)
+	// plus the same orbital overlap term as GetJ, and each atom gets the self term
+	// -(erfc(alpha Rc)/Rc + 2alpha/sqrt(pi)), which neutralizes the charge inside its cutoff sphere.
+	// The matrix is sparse, so one CG application is O(N).
+	double splitting = 1 / wolfAlpha;
+	BuildRealSpacePairs(rcut, splitting, true);
+
+	double pf = lambda * (k/2);
+	double self = -(erfc(wolfAlpha * rcut) / rcut + 2*wolfAlpha/sqrt(PI));
+	vector<double> diag(numAtoms);
+	for (int i = 0; i < numAtoms; i++) diag[i] = J[i] + pf * (PairDiag[i] + self);
+
+	auto apply = [&](const vector<double> &q, vector<double> &out) {
+		for (int i = 0; i < numAtoms; i++) out[i] = diag[i] * q[i];
+		for (int i = 0; i < numAtoms; i++) {
+			for (int p = PairRowStart[i]; p < PairRowStart[i+1]; p++) {
+				out[i] += pf * PairVal[p] * q[PairCol[p]];
+				out[PairCol[p]] += pf * PairVal[p] * q[i];
+			}
+		}
+	};
 
-	// First element in b is the total charge
-	b[0] = Qtot;
+	StatsPhase("solve");
+	int iterations;
+	vector<double> ones(numAtoms, 1);
+	vector<double> y1 = ConjugateGradient(apply, diag, ones, solverTol, solverMaxIterations, iterations);
+	vector<double> y2 = ConjugateGradient(apply, diag, X, solverTol, solverMaxIterations, iterations);
 
-	// Rest of elements in b are the differences in electronegativity
-	for (int i = 1; i < numAtoms; i++) {
-		b[i] = X[i] - X[i-1];
+	SetChargesFromResponses(y1, y2);
+}
+/*****************************************************************************/
+void QeqSymmetryAdapted() {
+	// Symmetry-equivalent atoms carry equal charges, so the unknowns are one charge per orbit.
+	// Row t of the reduced hardness matrix is the interaction of orbit representative t with
+	// every orbit s, summed over the members of s: Jred[t][s] = sum_{j in s} J(rep_t, j).
+	// This costs numOrbits*numAtoms kernel evaluations and a numOrbits^3 solve.
+	// The representative is the orbit's first atom in CIF order, whatever order the atoms are in now.
+	solverName = "symmetry-adapted";
+	StatsPhase("assemble");
+	vector<int> rep(numOrbits, -1);
+	vector<double> orbitSize(numOrbits, 0);
+	auto cifIndex = [](int i) { return AtomOrder.empty() ? i : AtomOrder[i]; };
+	for (int i = 0; i < numAtoms; i++) {
+		int &r = rep[Orbit[i]];
+		if ((r < 0) || (cifIndex(i) < cifIndex(r))) r = i;
+		orbitSize[Orbit[i]]++;
 	}
 
-	// Fill in 2nd to Nth rows of A
-	for (int i = 1; i < numAtoms; i++) {
-		// cout << ".";
+	vector<vector<double> > Jred(numOrbits, vector<double>(numOrbits, 0));
+	for (int t = 0; t < numOrbits; t++) {
+		Checkpoint("assemble", (double)t / numOrbits);
 		for (int j = 0; j < numAtoms; j++) {
-			A[i][j] = GetJ(i-1, j) - GetJ(i, j);
+			Jred[t][Orbit[j]] += GetJ(rep[t], j);
+		}
+	}
+
+	// Same A x = b form as Qeq(): total charge first, then equal electronegativity
+	// between consecutive representatives
+	size_t N = numOrbits;
+	double *A = (double *)workspace.Buffer(ws_Matrix, N * N * sizeof(double));
+	vector<double> b(numOrbits, 0);
+	for (int s = 0; s < numOrbits; s++) A[s] = orbitSize[s];
+	b[0] = Qtot;
+	for (int t = 1; t < numOrbits; t++) {
+		for (int s = 0; s < numOrbits; s++) {
+			A[t*N + s] = Jred[t-1][s] - Jred[t][s];
 		}
+		b[t] = X[rep[t]] - X[rep[t-1]];
 	}
 
-	Q = SolveMatrix(A,b);
+	StatsPhase("solve");
+	vector<double> original;
+	if (collectStats) original.assign(A, A + N*N);
+	vector<double> q = b;
+	SolveMatrixInPlace(A, numOrbits, q);
+	if (collectStats) solverResidual = RelativeResidual(original.data(), q, b);
+
+	Q.resize(numAtoms);
+	for (int i = 0; i < numAtoms; i++) Q[i] = q[Orbit[i]];
+}
+/*****************************************************************************/
+void ResetStats() {
+	Phases.clear();
+	kernelCalls = 0;
+	solverName = "";
+	solverIterations = 0;
+	solverResidual = -1;
+	conditionEstimate = -1;
+}
+/*****************************************************************************/
+bool ReadCachedCharges(const string &dir, const string &key) {
+	// Layout: magic[8], uint32 numAtoms, uint32 unused, char key[32], double Q[numAtoms], uint64 checksum
+	// Entries are only ever created by an atomic rename, so a file that exists is complete;
+	// the checksum guards against truncation by a crashed filesystem rather than by us.
+	string path = dir + "/" + key.substr(0, 2) + "/" + key + ".bin";
+	FILE *in = fopen(path.c_str(), "rb");
+	if (in == NULL) return false;
+
+	char magic[8]; uint32_t header[2]; char storedKey[32];
+	bool ok = (fread(magic, 1, 8, in) == 8) && (memcmp(magic, cacheMagic, 8) == 0) &&
+	          (fread(header, sizeof(uint32_t), 2, in) == 2) && ((int)header[0] == numAtoms) &&
+	          (fread(storedKey, 1, 32, in) == 32) && (memcmp(storedKey, key.data(), 32) == 0);
+
+	vector<double> charges(numAtoms);
+	uint64_t checksum = 0;
+	if (ok) ok = (fread(charges.data(), sizeof(double), numAtoms, in) == (size_t)numAtoms) &&
+	             (fread(&checksum, sizeof(checksum), 1, in) == 1);
+	fclose(in);
+
+	uint64_t h = 14695981039346656037ULL;
+	if (ok) HashBytes(h, charges.data(), numAtoms*sizeof(double));
+	if (!ok || (h != checksum)) return false;
+
+	Q = charges;
+	return true;
+}
+/*****************************************************************************/
+void RestoreAtomOrder() {
+	if (AtomOrder.empty()) return;
+	vector<int> inverse(numAtoms);
+	for (int n = 0; n < numAtoms; n++) inverse[AtomOrder[n]] = n;
+	AtomOrder.clear();
+	PermuteAtoms(inverse);
 }
 /*****************************************************************************/
 void RoundCharges(int digits) {
@@ -1143,6 +3857,7 @@ void RoundCharges(int digits) {
 		Q[i] = Round(Q[i]*factor)/factor;
 		qsum += Q[i];
 	}
+	qsum -= Qtot; // Excess over the total charge
 
 	if (qsum == 0) { // Great, rounding worked on the first try!
 		// do nothing
@@ -1151,11 +3866,707 @@ void RoundCharges(int digits) {
 		// cout << " adjusting the charge of " << numAtomsToAdjust << " atoms!" << endl;
 
 		int sign; if (qsum > 0) sign = -1; else sign = 1;
-		for (int i=0; i < numAtomsToAdjust; i++) { // Adjust
-			Q[i] += sign*(1/factor);
+
+		// Adjust whole symmetry orbits where possible so that equivalent sites stay equal
+		// (without symmetry every orbit is a single atom and this is just the first atoms)
+		vector<int> orbitSize(numOrbits, 0);
+		for (int i = 0; i < numAtoms; i++) orbitSize[Orbit[i]]++;
+		vector<bool> adjustOrbit(numOrbits, false);
+		for (int s = 0; (s < numOrbits) && (numAtomsToAdjust > 0); s++) {
+			if (orbitSize[s] <= numAtomsToAdjust) {
+				adjustOrbit[s] = true;
+				numAtomsToAdjust -= orbitSize[s];
+			}
+		}
+		for (int i = 0; i < numAtoms; i++) { // Adjust
+			if (adjustOrbit[Orbit[i]]) Q[i] += sign*(1/factor);
+		}
+		for (int i = 0; (i < numAtoms) && (numAtomsToAdjust > 0); i++, numAtomsToAdjust--) {
+			Q[i] += sign*(1/factor); // Leftover that no orbit fits exactly
+		}
+	}
+
+}
+/*****************************************************************************/
+double Seconds() {
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+/*****************************************************************************/
+void SetChargesFromResponses(const vector<double> &y1, const vector<double> &y2) {
+	// Equal electronegativity means J q = mu - X, so q = mu * y1 - y2 with y1 = J^-1 1 and
+	// y2 = J^-1 X, and mu is fixed by the total charge
+	double sum1 = 0; double sum2 = 0;
+	for (int i = 0; i < numAtoms; i++) { sum1 += y1[i]; sum2 += y2[i]; }
+	double mu = (Qtot + sum2) / sum1;
+
+	Q.resize(numAtoms);
+	for (int i = 0; i < numAtoms; i++) Q[i] = mu*y1[i] - y2[i];
+}
+/*****************************************************************************/
+void SetImageCounts() {
+	// Images n along an axis lie n perpendicular widths away, so the count along each axis is
+	// the radius over that axis' width: 2pi/|h| in real space and 2pi/|a| in reciprocal space.
+	// A thin cell gets many images across its short axes and few along its long one.
+	directRadius = 0;
+	const vector<double> *realAxis[3] = {&hV, &jV, &kV};
+	const vector<double> *recipAxis[3] = {&aV, &bV, &cV};
+	int *realNum[3] = {&aVnum, &bVnum, &cVnum};
+	int *recipNum[3] = {&hVnum, &jVnum, &kVnum};
+	for (int d = 0; d < 3; d++) {
+		double width = 2*PI / Mag(*realAxis[d]);
+		*realNum[d] = (mR >= 0) ? mR : max(1, (int)ceil(realRadius / width - 1e-9));
+		double recipWidth = 2*PI / Mag(*recipAxis[d]);
+		*recipNum[d] = (mK >= 0) ? mK : max(1, (int)ceil(kCutoff / recipWidth - 1e-9));
+	}
+}
+/*****************************************************************************/
+void SetupLatticeSums() {
+	SetImageCounts();
+	if (isPeriodic && !useEwardSums && (directTol > 0)) ConvergeDirectShells();
+}
+/*****************************************************************************/
+void SetupSPME(double splitting) {
+	// The grid, the influence function and the reciprocal-space diagonal only depend on the
+	// cell and the splitting, so they are kept while those stay the same (the siblings of a
+	// family all reuse the parent's)
+	double key[9] = {aLength, bLength, cLength, alphaAngle, betaAngle, gammaAngle, splitting, spmeSpacing, (double)spmeOrder};
+	if (!equal(key, key + 9, SPMEGridKey)) {
+		// Grid: smallest power of two per axis giving at most spmeSpacing between points
+		vector<double> length(3);
+		length[0] = aLength; length[1] = bLength; length[2] = cLength;
+		for (int d = 0; d < 3; d++) {
+			spmeK[d] = 8;
+			while (length[d] / spmeK[d] > spmeSpacing) spmeK[d] *= 2;
+		}
+
+		// B-spline moduli |b(m)|^2 along each axis
+		vector<double> M(spmeOrder);
+		BSplineWeights(0, spmeOrder, M.data()); // M[s] = M_n(s)
+		vector<vector<double> > bSq(3);
+		for (int d = 0; d < 3; d++) {
+			bSq[d].resize(spmeK[d]);
+			for (int m = 0; m < spmeK[d]; m++) {
+				complex<double> den = 0;
+				for (int j = 0; j <= spmeOrder - 2; j++) den += M[j+1] * polar(1.0, 2*PI*m*j/spmeK[d]);
+				bSq[d][m] = 1 / norm(den);
+			}
+		}
+
+		// Influence function from the reciprocal lattice vectors, and the reciprocal-space
+		// diagonal (betaStar of GetJ over the grid's wavevectors)
+		SPMEInfluence.assign(spmeK[0]*spmeK[1]*spmeK[2], 0);
+		SPMERecipDiag = 0;
+		for (int m1 = 0; m1 < spmeK[0]; m1++) {
+			for (int m2 = 0; m2 < spmeK[1]; m2++) {
+				for (int m3 = 0; m3 < spmeK[2]; m3++) {
+					if ((m1 == 0) && (m2 == 0) && (m3 == 0)) continue;
+					int u = (m1 <= spmeK[0]/2) ? m1 : m1 - spmeK[0];
+					int v = (m2 <= spmeK[1]/2) ? m2 : m2 - spmeK[1];
+					int w = (m3 <= spmeK[2]/2) ? m3 : m3 - spmeK[2];
+					double kx = u*hV[0] + v*jV[0] + w*kV[0];
+					double ky = u*hV[1] + v*jV[1] + w*kV[1];
+					double kz = u*hV[2] + v*jV[2] + w*kV[2];
+					double hSq = kx*kx + ky*ky + kz*kz;
+					SPMEInfluence[(m1*spmeK[1] + m2)*spmeK[2] + m3] = 4*PI / unitCellVolume *
+						exp(-0.25*hSq*splitting*splitting) / hSq * bSq[0][m1] * bSq[1][m2] * bSq[2][m3];
+					SPMERecipDiag += exp(-0.25*hSq*splitting*splitting) / hSq;
+				}
+			}
+		}
+		SPMERecipDiag *= 4*PI / unitCellVolume;
+		copy(key, key + 9, SPMEGridKey);
+	}
+
+	// Spline weights of every atom; the positions do not change during the solve
+	SplineIndex.resize(numAtoms*3*spmeOrder);
+	SplineWeight.resize(numAtoms*3*spmeOrder);
+	for (int i = 0; i < numAtoms; i++) {
+		double f[3];
+		f[0] = (Pos[i].x*hV[0] + Pos[i].y*hV[1] + Pos[i].z*hV[2]) / (2*PI);
+		f[1] = (Pos[i].x*jV[0] + Pos[i].y*jV[1] + Pos[i].z*jV[2]) / (2*PI);
+		f[2] = (Pos[i].x*kV[0] + Pos[i].y*kV[1] + Pos[i].z*kV[2]) / (2*PI);
+		for (int d = 0; d < 3; d++) {
+			double u = (f[d] - floor(f[d])) * spmeK[d];
+			int g = (int)floor(u);
+			int base = (i*3 + d)*spmeOrder;
+			BSplineWeights(u - g, spmeOrder, &SplineWeight[base]);
+			for (int s = 0; s < spmeOrder; s++) SplineIndex[base + s] = ((g - s) % spmeK[d] + spmeK[d]) % spmeK[d];
+		}
+	}
+}
+/*****************************************************************************/
+void SortAtomsSpatially() {
+	// Interleaving the bits of the three (fractional, or bounding box) coordinates gives a
+	// Morton key; sorting by it keeps atoms that are close in space close in memory, so pair
+	// lists, grids and matrix rows touch neighbouring cache lines instead of jumping around.
+	AtomOrder.clear();
+	if (numAtoms < 2) return;
+
+	double lo[3] = {0, 0, 0}; double span[3] = {1, 1, 1};
+	vector<double> f(3*numAtoms);
+	for (int i = 0; i < numAtoms; i++) {
+		if (isPeriodic) {
+			f[3*i]   = (Pos[i].x*hV[0] + Pos[i].y*hV[1] + Pos[i].z*hV[2]) / (2*PI);
+			f[3*i+1] = (Pos[i].x*jV[0] + Pos[i].y*jV[1] + Pos[i].z*jV[2]) / (2*PI);
+			f[3*i+2] = (Pos[i].x*kV[0] + Pos[i].y*kV[1] + Pos[i].z*kV[2]) / (2*PI);
+			for (int d = 0; d < 3; d++) f[3*i+d] -= floor(f[3*i+d]);
+		} else {
+			f[3*i] = Pos[i].x; f[3*i+1] = Pos[i].y; f[3*i+2] = Pos[i].z;
+		}
+	}
+	if (!isPeriodic) {
+		for (int d = 0; d < 3; d++) {
+			double hi = f[d]; lo[d] = f[d];
+			for (int i = 1; i < numAtoms; i++) { lo[d] = min(lo[d], f[3*i+d]); hi = max(hi, f[3*i+d]); }
+			span[d] = max(hi - lo[d], 1e-12);
+		}
+	}
+
+	auto spread = [](uint64_t v) { // 21 bits -> every third bit of 63
+		v &= 0x1fffff;
+		v = (v | (v << 32)) & 0x1f00000000ffffULL;
+		v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+		v = (v | (v << 8))  & 0x100f00f00f00f00fULL;
+		v = (v | (v << 4))  & 0x10c30c30c30c30c3ULL;
+		v = (v | (v << 2))  & 0x1249249249249249ULL;
+		return v;
+	};
+	vector<uint64_t> key(numAtoms);
+	for (int i = 0; i < numAtoms; i++) {
+		uint64_t c[3];
+		for (int d = 0; d < 3; d++) c[d] = (uint64_t)min(2097151.0, (f[3*i+d] - lo[d]) / span[d] * 2097152.0);
+		key[i] = spread(c[0]) | (spread(c[1]) << 1) | (spread(c[2]) << 2);
+	}
+
+	vector<int> order(numAtoms);
+	for (int i = 0; i < numAtoms; i++) order[i] = i;
+	stable_sort(order.begin(), order.end(), [&](int a, int b) { return key[a] < key[b]; });
+
+	bool sorted = true;
+	for (int i = 0; i < numAtoms; i++) if (order[i] != i) sorted = false;
+	if (sorted) return;
+
+	PermuteAtoms(order);
+	AtomOrder = order;
+}
+/*****************************************************************************/
+void StatsPhase(const char *name) {
+	static int running = -1; // Index in Phases of the running phase
+	static double wallStart, cpuStart; static long long heapStart;
+	static TraceEvent stage; // The phase as a trace span
+	if (!collectStats && !traceEnabled) { running = -1; return; }
+
+	double wall = chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+	timespec cpuTime;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuTime);
+	double cpu = cpuTime.tv_sec + 1e-9*cpuTime.tv_nsec;
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+	long long heap = (long long)mallinfo2().uordblks + (long long)mallinfo2().hblkhd;
+#else
+	long long heap = 0;
+#endif
+
+	if ((running >= 0) && (running < (int)Phases.size())) {
+		Phases[running].wall += wall - wallStart;
+		Phases[running].cpu += cpu - cpuStart;
+		Phases[running].heapBytes += heap - heapStart;
+		if (traceEnabled && (stage.start > 0)) {
+			stage.duration = TraceClock() - stage.start;
+			long long cycles, cacheMisses;
+			TraceCounters(cycles, cacheMisses);
+			if (stage.cycles >= 0) { stage.cycles = cycles - stage.cycles; stage.cacheMisses = cacheMisses - stage.cacheMisses; }
+			TraceEvents.push_back(stage);
+			if (TraceEvents.size() >= traceFlushEvents) TraceFlush();
+		}
+	}
+	running = -1;
+	stage.start = 0;
+	if (name == nullptr) return;
+
+	for (size_t p = 0; p < Phases.size(); p++) {
+		if (Phases[p].name == name) running = p;
+	}
+	if (running < 0) {
+		Phases.push_back(PhaseStats());
+		Phases.back().name = name;
+		running = Phases.size() - 1;
+	}
+	wallStart = wall; cpuStart = cpu; heapStart = heap;
+	if (traceEnabled) {
+		stage.name = name;
+		TraceCounters(stage.cycles, stage.cacheMisses);
+		stage.start = TraceClock();
+	}
+}
+/*****************************************************************************/
+void SPMEPotential(const vector<double> &q, vector<double> &phi) {
+	// phi_i = sum_j beta_ij q_j, with the structure factor interpolated on the grid:
+	// spread charges, FFT, multiply by the influence function, FFT back, gather
+	int n = spmeOrder;
+	vector<complex<double> > grid(spmeK[0]*spmeK[1]*spmeK[2], 0);
+
+	for (int i = 0; i < numAtoms; i++) {
+		const int *ix = &SplineIndex[i*3*n]; const double *wx = &SplineWeight[i*3*n];
+		for (int s1 = 0; s1 < n; s1++) {
+			for (int s2 = 0; s2 < n; s2++) {
+				double w12 = q[i] * wx[s1] * wx[n + s2];
+				int row = (ix[s1]*spmeK[1] + ix[n + s2])*spmeK[2];
+				for (int s3 = 0; s3 < n; s3++) grid[row + ix[2*n + s3]] += w12 * wx[2*n + s3];
+			}
+		}
+	}
+
+	FFT3D(grid, spmeK[0], spmeK[1], spmeK[2], -1);
+	for (size_t m = 0; m < grid.size(); m++) grid[m] *= SPMEInfluence[m];
+	FFT3D(grid, spmeK[0], spmeK[1], spmeK[2], +1);
+
+	phi.assign(numAtoms, 0);
+	for (int i = 0; i < numAtoms; i++) {
+		const int *ix = &SplineIndex[i*3*n]; const double *wx = &SplineWeight[i*3*n];
+		double sum = 0;
+		for (int s1 = 0; s1 < n; s1++) {
+			for (int s2 = 0; s2 < n; s2++) {
+				double w12 = wx[s1] * wx[n + s2];
+				int row = (ix[s1]*spmeK[1] + ix[n + s2])*spmeK[2];
+				for (int s3 = 0; s3 < n; s3++) sum += w12 * wx[2*n + s3] * grid[row + ix[2*n + s3]].real();
+			}
+		}
+		phi[i] = sum;
+	}
+}
+/*****************************************************************************/
+void TraceBegin(const string &path) {
+	// The file is written as the events come, traceFlushEvents at a time, so a process traced
+	// for its whole life (EQEQ_TRACE) holds no more than that many in memory
+	traceFile = fopen(path.c_str(), "wb");
+	if (!traceFile) throw EqeqError("Cannot write " + path);
+	fputs("{\"traceEvents\":[\n", traceFile);
+	traceFileEmpty = true;
+	traceOwner = getpid();
+	tracePath = path;
+	TraceEvents.clear();
+	traceEnabled = true;
+
+#ifdef __linux__
+	const char *counters = getenv("EQEQ_TRACE_COUNTERS");
+	if (counters && (string(counters) != "0") && (perfCycles < 0)) {
+		auto open = [](unsigned long long config, int group) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = config;
+			attr.exclude_kernel = 1; attr.exclude_hv = 1;
+			return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+		};
+		perfCycles = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+		if (perfCycles >= 0) perfCacheMisses = open(PERF_COUNT_HW_CACHE_MISSES, perfCycles);
+		if ((perfCycles < 0) || (perfCacheMisses < 0)) {
+			Warn("hardware counters are not available (perf_event_open failed), tracing without them");
+			if (perfCycles >= 0) close(perfCycles);
+			perfCycles = -1; perfCacheMisses = -1;
+		}
+	}
+#endif
+}
+/*****************************************************************************/
+double TraceClock() {
+	return chrono::duration<double, micro>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+/*****************************************************************************/
+void TraceCounters(long long &cycles, long long &cacheMisses) {
+	cycles = -1; cacheMisses = -1;
+#ifdef __linux__
+	if (perfCycles < 0) return;
+	long long value;
+	if (read(perfCycles, &value, sizeof(value)) == sizeof(value)) cycles = value;
+	if (read(perfCacheMisses, &value, sizeof(value)) == sizeof(value)) cacheMisses = value;
+#endif
+}
+/*****************************************************************************/
+void TraceEnd(const string &extraEvents) {
+	if (!traceEnabled) return;
+	TraceFlush();
+	if (!extraEvents.empty()) {
+		if (!traceFileEmpty) fputs(",\n", traceFile);
+		fwrite(extraEvents.data(), 1, extraEvents.size(), traceFile);
+	}
+	fputs("\n]}\n", traceFile);
+	bool failed = (fclose(traceFile) != 0);
+	traceFile = nullptr;
+	TraceEvents.clear();
+	traceEnabled = false;
+	if (failed) throw EqeqError("Cannot write " + tracePath);
+}
+/*****************************************************************************/
+string TraceEventsJSON() {
+	// Chrome trace-event format ("X" = complete event), viewable in chrome://tracing or Perfetto
+	string out;
+	out.reserve(TraceEvents.size() * 128);
+	int pid = getpid();
+	for (size_t e = 0; e < TraceEvents.size(); e++) {
+		const TraceEvent &event = TraceEvents[e];
+		if (e > 0) out += ",\n";
+		out += "{\"name\":\""; out += event.name;
+		out += "\",\"ph\":\"X\",\"pid\":"; AppendInt(out, pid);
+		out += ",\"tid\":0,\"ts\":"; AppendFixed(out, event.start, 3);
+		out += ",\"dur\":"; AppendFixed(out, event.duration, 3);
+		out += ",\"args\":{";
+		bool first = true;
+		auto separator = [&]() { if (!first) out += ","; first = false; };
+		if (event.index >= 0) { separator(); out += "\"index\":"; AppendInt(out, event.index); }
+		if (!event.file.empty()) { separator(); out += "\"file\":"; AppendJSONString(out, event.file); }
+		if (event.cycles >= 0) {
+			separator(); out += "\"cycles\":"; AppendInt(out, event.cycles);
+			out += ",\"cache_misses\":"; AppendInt(out, event.cacheMisses);
+		}
+		out += "}}";
+	}
+	return out;
+}
+/*****************************************************************************/
+void TraceFlush() {
+	if (!traceFile || (getpid() != traceOwner) || TraceEvents.empty()) return; // Workers hand theirs to the parent
+	string events = TraceEventsJSON();
+	if (!traceFileEmpty) fputs(",\n", traceFile);
+	fwrite(events.data(), 1, events.size(), traceFile);
+	fflush(traceFile); // Nothing buffered for a forked worker to inherit
+	traceFileEmpty = false;
+	TraceEvents.clear();
+}
+/*****************************************************************************/
+void TraceFromEnvironment() {
+	static bool checked = false;
+	if (checked) return;
+	checked = true;
+	const char *path = getenv("EQEQ_TRACE");
+	if (path && *path && (MPIWorldRank() == 0)) { // Under mpirun the other ranks would write the same file
+		TraceBegin(path);
+		atexit([]() { TraceEnd(); });
+	}
+}
+/*****************************************************************************/
+void TreePotential(const vector<double> &q, vector<double> &phi) {
+	// Fast multipole evaluation with Cartesian Taylor expansions of order treeOrder:
+	//   1. moments M_k = sum_j q_j (y_j - c)^k of every node
+	//   2. over the interaction lists from BuildOctree: well-separated node pairs turn the
+	//      source moments into a local expansion about the target center, neighbouring
+	//      leaves interact directly
+	//   3. local expansions are shifted down to the leaves and evaluated at the atoms
+	int numTerms = numTreeTerms;
+	int numNodes = Tree.size();
+	vector<double> moments(numNodes*numTerms, 0);
+	vector<double> locals(numNodes*numTerms, 0);
+	vector<double> px(treeOrder + 1), py(treeOrder + 1), pz(treeOrder + 1);
+	auto powers = [&](double dx, double dy, double dz, double scale, double *out) {
+		px[0] = scale; py[0] = 1; pz[0] = 1;
+		for (int p = 1; p <= treeOrder; p++) { px[p] = px[p-1]*dx; py[p] = py[p-1]*dy; pz[p] = pz[p-1]*dz; }
+		for (int t = 0; t < numTerms; t++) out[t] = px[MultiIndex[3*t]] * py[MultiIndex[3*t+1]] * pz[MultiIndex[3*t+2]];
+	};
+
+	vector<double> pw(numTerms);
+	for (int n = 0; n < numNodes; n++) {
+		double *M = &moments[n*numTerms];
+		for (int m = Tree[n].first; m < Tree[n].first + Tree[n].count; m++) {
+			int j = TreeAtom[m];
+			powers(Pos[j].x - Tree[n].center.x, Pos[j].y - Tree[n].center.y, Pos[j].z - Tree[n].center.z, q[j], pw.data());
+			for (int t = 0; t < numTerms; t++) M[t] += pw[t];
+		}
+	}
+
+	phi.assign(numAtoms, 0);
+	int numKernelTerms = MultiIndex.size() / 3;
+	for (size_t p = 0; p < TreeM2L.size() / 2; p++) {
+		double *L = &locals[TreeM2L[2*p]*numTerms];
+		const double *M = &moments[TreeM2L[2*p+1]*numTerms];
+		const double *b = &TreeM2LKernel[p*numKernelTerms];
+		for (size_t e = 0; e < M2LCoef.size(); e++) {
+			L[M2LIndex[3*e]] += M2LCoef[e] * b[M2LIndex[3*e+2]] * M[M2LIndex[3*e+1]];
+		}
+	}
+	for (size_t p = 0; p < TreeP2P.size() / 2; p++) {
+		const TreeNode &T = Tree[TreeP2P[2*p]]; const TreeNode &S = Tree[TreeP2P[2*p+1]];
+		for (int mi = T.first; mi < T.first + T.count; mi++) {
+			int i = TreeAtom[mi];
+			double sum = 0;
+			for (int mj = S.first; mj < S.first + S.count; mj++) {
+				int j = TreeAtom[mj];
+				if (j == i) continue;
+				double ex = Pos[i].x - Pos[j].x;
+				double ey = Pos[i].y - Pos[j].y;
+				double ez = Pos[i].z - Pos[j].z;
+				sum += q[j] / sqrt(ex*ex + ey*ey + ez*ez);
+			}
+			phi[i] += sum;
+		}
+	}
+
+	// Nodes were created breadth-first, so parents are always shifted before their children
+	for (int n = 0; n < numNodes; n++) {
+		const double *Lp = &locals[n*numTerms];
+		for (int c : Tree[n].children) {
+			powers(Tree[c].center.x - Tree[n].center.x, Tree[c].center.y - Tree[n].center.y,
+				Tree[c].center.z - Tree[n].center.z, 1, pw.data());
+			double *Lc = &locals[c*numTerms];
+			for (size_t e = 0; e < L2LCoef.size(); e++) {
+				Lc[L2LIndex[3*e]] += L2LCoef[e] * pw[L2LIndex[3*e+2]] * Lp[L2LIndex[3*e+1]];
+			}
+		}
+		if (Tree[n].children.empty()) {
+			for (int m = Tree[n].first; m < Tree[n].first + Tree[n].count; m++) {
+				int i = TreeAtom[m];
+				powers(Pos[i].x - Tree[n].center.x, Pos[i].y - Tree[n].center.y, Pos[i].z - Tree[n].center.z, 1, pw.data());
+				for (int t = 0; t < numTerms; t++) phi[i] += Lp[t] * pw[t];
+			}
+		}
+	}
+}
+/*****************************************************************************/
+void Warn(const string &message) {
+#ifdef EQEQ_LIBRARY
+	runWarnings += (runWarnings.empty() ? "Warning: " : "\nWarning: ") + message;
+#else
+	cout << "Warning: " << message << endl;
+#endif
+}
+/*****************************************************************************/
+void WolfVersusEwald(double &maxDeviation, double &meanDeviation) {
+	// Solves the loaded structure twice, with the Wolf method and with SPME Ewald at the same
+	// rcut (converged to ~1e-7 e), and compares the unrounded charges
+	bool saveWolf = useWolf; bool saveSPME = useSPME; bool saveEwald = useEwardSums;
+	isPeriodic = true;
+
+	useWolf = true;
+	Qeq();
+	vector<double> wolfQ = Q;
+
+	useWolf = false; useSPME = true; useEwardSums = true;
+	Qeq();
+
+	maxDeviation = 0; meanDeviation = 0;
+	for (int i = 0; i < numAtoms; i++) {
+		double d = fabs(wolfQ[i] - Q[i]);
+		maxDeviation = max(maxDeviation, d);
+		meanDeviation += d / numAtoms;
+	}
+	useWolf = saveWolf; useSPME = saveSPME; useEwardSums = saveEwald;
+}
+/*****************************************************************************/
+void WriteCachedCharges(const string &dir, const string &key) {
+	// Best effort: any failure just means the next run recomputes.
+	// Writers fill a private temp file and rename() it into place, which is atomic on POSIX,
+	// so concurrent processes never observe a partial entry and the last writer simply wins.
+	std::error_code ec;
+	string subdir = dir + "/" + key.substr(0, 2);
+	std::filesystem::create_directories(subdir, ec);
+
+	static int tmpCounter = 0;
+	string path = subdir + "/" + key + ".bin";
+	string tmpPath = path + ".tmp." + to_string(getpid()) + "." + to_string(tmpCounter++);
+
+	FILE *out = fopen(tmpPath.c_str(), "wb");
+	if (out == NULL) return;
+
+	uint32_t header[2] = {(uint32_t)numAtoms, 0};
+	uint64_t checksum = 14695981039346656037ULL;
+	HashBytes(checksum, Q.data(), numAtoms*sizeof(double));
+
+	bool ok = (fwrite(cacheMagic, 1, 8, out) == 8) &&
+	          (fwrite(header, sizeof(uint32_t), 2, out) == 2) &&
+	          (fwrite(key.data(), 1, 32, out) == 32) &&
+	          (fwrite(Q.data(), sizeof(double), numAtoms, out) == (size_t)numAtoms) &&
+	          (fwrite(&checksum, sizeof(checksum), 1, out) == 1);
+	ok = (fclose(out) == 0) && ok;
+
+	if (ok) std::filesystem::rename(tmpPath, path, ec);
+	if (!ok || ec) std::filesystem::remove(tmpPath, ec);
+}
+/*****************************************************************************/
+void AppendFixed(string &out, double value, int decimals, int width, bool signSpace) {
+	char buffer[64];
+	char *p = buffer;
+	if (signSpace && !signbit(value)) *p++ = ' ';
+	to_chars_result result = to_chars(p, buffer + sizeof(buffer), value, chars_format::fixed, decimals);
+	if (result.ec != errc()) { // From about 1e56 on the digits do not fit; a double has at most 309 before the point
+		string text(1 + 1 + 309 + 1 + decimals, '\0');
+		char *q = &text[0];
+		if (signSpace && !signbit(value)) *q++ = ' ';
+		q = to_chars(q, text.data() + text.size(), value, chars_format::fixed, decimals).ptr;
+		int length = (int)(q - text.data());
+		if (length < width) out.append(width - length, ' ');
+		out.append(text, 0, length);
+		return;
+	}
+	int length = (int)(result.ptr - buffer);
+	if (length < width) out.append(width - length, ' ');
+	out.append(buffer, length);
+}
+/*****************************************************************************/
+void AppendInt(string &out, long long value, int width) {
+	char buffer[24];
+	char *p = to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+	int length = (int)(p - buffer);
+	if (length < width) out.append(width - length, ' ');
+	out.append(buffer, length);
+}
+/*****************************************************************************/
+void AppendJSONString(string &out, const string &text) {
+	out += '"';
+	for (char c : text) {
+		if ((c == '"') || (c == '\\')) {
+			out += '\\'; out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)c);
+			out += escape;
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+/*****************************************************************************/
+void BatchedLDLTSolve(double *A, double *B, int n, int numRHS, bool *singular) {
+	// Element (i, j) of lane l is A[(i*n + j)*BatchLanes + l] and only i >= j is used; the
+	// factorization overwrites it (unit L below the diagonal, D on it). Right-hand side r is
+	// B[(r*n + i)*BatchLanes + l] and is overwritten by the solution. No pivoting, as in the
+	// other LDL^T solvers: J is symmetric with a dominant diagonal. A lane with a zero or
+	// non-finite pivot (e.g. two atoms on one site) gets singular[l] set and a meaningless
+	// solution; the other lanes are not affected.
+	const int W = BatchLanes;
+	vector<double> v((size_t)n*W);
+	for (int l = 0; l < W; l++) singular[l] = false;
+	for (int j = 0; j < n; j++) {
+		double *Ajj = &A[((size_t)j*n + j)*W];
+		for (int k = 0; k < j; k++) {
+			const double *Ljk = &A[((size_t)j*n + k)*W];
+			const double *Dk = &A[((size_t)k*n + k)*W];
+			for (int l = 0; l < W; l++) {
+				v[(size_t)k*W + l] = Ljk[l] * Dk[l];
+				Ajj[l] -= Ljk[l] * v[(size_t)k*W + l];
+			}
+		}
+		double inv[BatchLanes];
+		for (int l = 0; l < W; l++) {
+			if (!(std::isfinite(Ajj[l]) && (fabs(Ajj[l]) >= 1e-300))) singular[l] = true; // As in LDLTFactor
+			inv[l] = 1 / Ajj[l];
+		}
+		for (int i = j + 1; i < n; i++) {
+			double *Aij = &A[((size_t)i*n + j)*W];
+			for (int k = 0; k < j; k++) {
+				const double *Lik = &A[((size_t)i*n + k)*W];
+				for (int l = 0; l < W; l++) Aij[l] -= Lik[l] * v[(size_t)k*W + l];
+			}
+			for (int l = 0; l < W; l++) Aij[l] *= inv[l];
+		}
+	}
+
+	for (int r = 0; r < numRHS; r++) {
+		double *x = &B[(size_t)r*n*W];
+		for (int i = 0; i < n; i++) { // L z = b
+			for (int k = 0; k < i; k++) {
+				const double *Lik = &A[((size_t)i*n + k)*W];
+				for (int l = 0; l < W; l++) x[(size_t)i*W + l] -= Lik[l] * x[(size_t)k*W + l];
+			}
+		}
+		for (int i = 0; i < n; i++) { // D y = z
+			const double *Dii = &A[((size_t)i*n + i)*W];
+			for (int l = 0; l < W; l++) x[(size_t)i*W + l] /= Dii[l];
+		}
+		for (int i = n - 1; i >= 0; i--) { // L^T x = y
+			for (int k = i + 1; k < n; k++) {
+				const double *Lki = &A[((size_t)k*n + i)*W];
+				for (int l = 0; l < W; l++) x[(size_t)i*W + l] -= Lki[l] * x[(size_t)k*W + l];
+			}
+		}
+	}
+}
+/*****************************************************************************/
+void BSplineWeights(double w, int order, double *M) {
+	// Cardinal B-spline values M_n(w + s) for s = 0..n-1, built up from M_2 with
+	// M_n(x) = x/(n-1) M_{n-1}(x) + (n-x)/(n-1) M_{n-1}(x-1)
+	M[0] = w; M[1] = 1 - w;
+	for (int n = 3; n <= order; n++) {
+		M[n-1] = 0;
+		for (int s = n - 1; s >= 0; s--) {
+			double x = w + s;
+			M[s] = (x * M[s] + (n - x) * (s > 0 ? M[s-1] : 0)) / (n - 1);
+		}
+	}
+}
+/*****************************************************************************/
+vector<double> ConjugateGradient(const function<void(const vector<double> &, vector<double> &)> &apply,
+	const vector<double> &diag, const vector<double> &b, double tol, int maxIterations, int &iterations) {
+	// Jacobi preconditioner
+	auto precondition = [&](const vector<double> &r, vector<double> &z) {
+		for (size_t i = 0; i < r.size(); i++) z[i] = r[i] / diag[i];
+	};
+	return ConjugateGradient(apply, precondition, b, tol, maxIterations, iterations);
+}
+/*****************************************************************************/
+vector<double> ConjugateGradient(const function<void(const vector<double> &, vector<double> &)> &apply,
+	const function<void(const vector<double> &, vector<double> &)> &precondition,
+	const vector<double> &b, double tol, int maxIterations, int &iterations) {
+	return ConjugateGradient(apply, precondition, b, vector<double>(b.size(), 0), tol, maxIterations, iterations);
+}
+/*****************************************************************************/
+vector<double> ConjugateGradient(const function<void(const vector<double> &, vector<double> &)> &apply,
+	const function<void(const vector<double> &, vector<double> &)> &precondition,
+	const vector<double> &b, const vector<double> &x0, double tol, int maxIterations, int &iterations) {
+	// Preconditioned conjugate gradients for a symmetric positive definite operator.
+	// Stops when |r| <= tol |b|.
+	TraceSpan span("CG");
+	int N = b.size();
+	vector<double> x = x0, r = b, z(N), p(N), Ap(N);
+	if (any_of(x0.begin(), x0.end(), [](double v) { return v != 0; })) { // Warm start
+		apply(x0, Ap);
+		for (int i = 0; i < N; i++) r[i] -= Ap[i];
+	}
+
+	double bNorm = 0;
+	for (int i = 0; i < N; i++) bNorm += b[i]*b[i];
+	bNorm = sqrt(bNorm);
+
+	precondition(r, z);
+	p = z;
+	double rz = 0;
+	for (int i = 0; i < N; i++) rz += r[i]*z[i];
+
+	vector<double> alphas, betas; // For the condition estimate
+	double rNorm = 0;
+	for (iterations = 0; iterations < maxIterations; iterations++) {
+		rNorm = 0;
+		for (int i = 0; i < N; i++) rNorm += r[i]*r[i];
+		if (sqrt(rNorm) <= tol*bNorm) break;
+		// Progress as the fraction of the digits to tol gained so far
+		Checkpoint("solve", (bNorm > 0 && rNorm > 0) ? log(sqrt(rNorm) / bNorm) / log(tol) : 0);
+
+		apply(p, Ap);
+		double pAp = 0;
+		for (int i = 0; i < N; i++) pAp += p[i]*Ap[i];
+		if (pAp <= 0) {
+			Warn("hardness matrix is not positive definite, CG stopped early.");
+			break;
 		}
+		double alpha = rz / pAp;
+		for (int i = 0; i < N; i++) { x[i] += alpha*p[i]; r[i] -= alpha*Ap[i]; }
+
+		precondition(r, z);
+		double rzNew = 0;
+		for (int i = 0; i < N; i++) rzNew += r[i]*z[i];
+		for (int i = 0; i < N; i++) p[i] = z[i] + (rzNew / rz)*p[i];
+		if (collectStats) { alphas.push_back(alpha); betas.push_back(rzNew / rz); }
+		rz = rzNew;
 	}
 
+	if (collectStats) {
+		solverIterations += iterations;
+		solverResidual = max(solverResidual, (bNorm > 0) ? sqrt(rNorm) / bNorm : 0.0);
+	}
+	if (collectStats && !alphas.empty()) conditionEstimate = max(conditionEstimate, LanczosConditionNumber(alphas, betas));
+
+	if ((iterations == maxIterations) && (maxIterations == solverMaxIterations)) Warn("CG did not converge in " + to_string(maxIterations) + " iterations.");
+	return x;
 }
 /*****************************************************************************/
 vector<double> Cross(vector<double> a, vector<double> b) {
@@ -1173,10 +4584,104 @@ double Dot(vector<double> a, vector<double> b) {
 	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
 }
 /*****************************************************************************/
+double LanczosConditionNumber(const vector<double> &alpha, const vector<double> &beta) {
+	// CG is a Lanczos process in disguise: its step lengths give the tridiagonal matrix
+	// T_kk = 1/alpha_k + beta_{k-1}/alpha_{k-1}, T_k,k+1 = sqrt(beta_k)/alpha_k, whose extreme
+	// eigenvalues (found by Sturm-sequence bisection) approach those of the preconditioned J.
+	int m = alpha.size();
+	vector<double> diag(m), off(m, 0);
+	for (int k = 0; k < m; k++) {
+		diag[k] = 1/alpha[k] + ((k > 0) ? beta[k-1]/alpha[k-1] : 0);
+		if (k + 1 < m) off[k] = sqrt(beta[k])/alpha[k];
+	}
+	double lo = diag[0], hi = diag[0]; // Gershgorin bounds
+	for (int k = 0; k < m; k++) {
+		double radius = off[k] + ((k > 0) ? off[k-1] : 0);
+		lo = min(lo, diag[k] - radius); hi = max(hi, diag[k] + radius);
+	}
+	auto countBelow = [&](double x) { // Eigenvalues of T below x
+		int count = 0; double d = 1;
+		for (int k = 0; k < m; k++) {
+			d = diag[k] - x - ((k > 0) ? off[k-1]*off[k-1] / d : 0);
+			if (d == 0) d = 1e-300;
+			if (d < 0) count++;
+		}
+		return count;
+	};
+	auto eigenvalue = [&](int index) { // index-th smallest
+		double a = lo, b = hi;
+		for (int it = 0; it < 100; it++) {
+			double mid = 0.5*(a + b);
+			if (countBelow(mid) > index) b = mid; else a = mid;
+		}
+		return 0.5*(a + b);
+	};
+	double smallest = eigenvalue(0);
+	return (smallest > 0) ? eigenvalue(m - 1) / smallest : -1;
+}
+/*****************************************************************************/
+void LDLTFactor(double *A, int n) {
+	// The factorization of QeqMixedPrecision in double: row i of L from the rows above it,
+	// with w = row i of L D so each entry is one contiguous dot product
+	vector<double> w(n);
+	for (int i = 0; i < n; i++) {
+		Checkpoint("factor", (double)i / n);
+		double *Li = &A[(size_t)i*n];
+		for (int j = 0; j < i; j++) {
+			const double *Lj = &A[(size_t)j*n];
+			double sum = 0;
+			for (int s = 0; s < j; s++) sum += w[s] * Lj[s];
+			Li[j] = (Lj[i] - sum) / Lj[j];
+			w[j] = Li[j] * Lj[j];
+		}
+		double sum = 0;
+		for (int s = 0; s < i; s++) sum += w[s] * Li[s];
+		Li[i] -= sum;
+		if (fabs(Li[i]) < 1e-300) {
+			throw EqeqError("Singular hardness matrix");
+		}
+	}
+}
+/*****************************************************************************/
+void LDLTSolve(const double *A, int n, double *x, int numRHS) {
+	// Each step updates a whole row of x, so the right-hand sides share every pass over L
+	size_t k = numRHS;
+	for (int i = 0; i < n; i++) {
+		const double *Li = &A[(size_t)i*n];
+		double *xi = &x[i*k];
+		for (int j = 0; j < i; j++) {
+			const double *xj = &x[j*k];
+			for (size_t r = 0; r < k; r++) xi[r] -= Li[j] * xj[r];
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		for (size_t r = 0; r < k; r++) x[i*k + r] /= A[(size_t)i*n + i];
+	}
+	for (int i = n - 1; i >= 0; i--) {
+		const double *Li = &A[(size_t)i*n];
+		const double *xi = &x[i*k];
+		for (int j = 0; j < i; j++) {
+			double *xj = &x[j*k];
+			for (size_t r = 0; r < k; r++) xj[r] -= Li[j] * xi[r];
+		}
+	}
+}
+/*****************************************************************************/
 double Mag(vector<double> a) {
 	return sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
 }
 /*****************************************************************************/
+double RelativeResidual(const double *A, const vector<double> &x, const vector<double> &b) {
+	double rNorm = 0; double bNorm = 0;
+	size_t N = b.size();
+	for (size_t i = 0; i < N; i++) {
+		double r = b[i];
+		for (size_t j = 0; j < N; j++) r -= A[i*N + j] * x[j];
+		rNorm += r*r; bNorm += b[i]*b[i];
+	}
+	return (bNorm > 0) ? sqrt(rNorm / bNorm) : sqrt(rNorm);
+}
+/*****************************************************************************/
 double Round(double num) {
 	return (num > 0.0) ? floor(num + 0.5) : ceil(num - 0.5);
 }
@@ -1187,96 +4692,726 @@ vector<double> Scalar(double a, vector<double> b) {
 	return c;
 }
 /*****************************************************************************/
-vector<double> SolveMatrix(vector<vector<double> > A, vector<double> b) {
-	// Assumptions: A x = b, A is a MxN matrix, M = rows, N = cols, x is a vector, b is vector
-	// matrix has more rows than columns
-	// number of rows of matrix is equal to size of the vector x
+void TaylorCoefficients(double x, double y, double z, int order, double *b) {
+	// Coefficients b_k(x) of 1/|x - y| = sum_k b_k(x) y^k, for all |k| <= order, in the
+	// MultiIndex order. Uses the recurrence (Duan & Krasny)
+	//   n |x|^2 b_k = (2n - 1) sum_i x_i b_{k - e_i} - (n - 1) sum_i b_{k - 2e_i},  n = |k|
+	// with the positions of k - e_i and k - 2e_i precomputed in TaylorPrev (-1 if not a term).
+	double rSq = x*x + y*y + z*z;
+	double r[3] = {x, y, z};
+	int numTerms = MultiIndex.size() / 3;
+
+	b[0] = 1 / sqrt(rSq);
+	for (int t = 1; t < numTerms; t++) {
+		int n = MultiIndex[3*t] + MultiIndex[3*t+1] + MultiIndex[3*t+2];
+		if (n > order) break;
+		const int *prev = &TaylorPrev[6*t];
+		double first = 0; double second = 0;
+		for (int d = 0; d < 3; d++) {
+			if (prev[d] >= 0) first += r[d] * b[prev[d]];
+			if (prev[3+d] >= 0) second += b[prev[3+d]];
+		}
+		b[t] = ((2*n - 1)*first - (n - 1)*second) / (n * rSq);
+	}
+}
+/*****************************************************************************/
+vector<complex<double> > SolveComplexMatrix(vector<vector<complex<double> > > A, vector<complex<double> > b) {
+	// Gaussian elimination with partial pivoting, for the small per-wavevector blocks
+	int N = A.size();
+
+	for (int i = 0; i < N; i++) {
+		int pivot = i;
+		for (int r = i + 1; r < N; r++) if (abs(A[r][i]) > abs(A[pivot][i])) pivot = r;
+		if (abs(A[pivot][i]) == 0) throw EqeqError("Singular hardness matrix (rank deficient)");
+		swap(A[i], A[pivot]); swap(b[i], b[pivot]);
+
+		for (int r = i + 1; r < N; r++) {
+			complex<double> f = A[r][i] / A[i][i];
+			for (int c = i; c < N; c++) A[r][c] -= f * A[i][c];
+			b[r] -= f * b[i];
+		}
+	}
 
-    // Initialize x = b
-    vector<double> x;
-    x = b;
+	vector<complex<double> > x(N);
+	for (int i = N-1; i >= 0; i--) {
+		complex<double> sum = 0;
+		for (int c = i + 1; c < N; c++) sum += A[i][c] * x[c];
+		x[i] = (b[i] - sum) / A[i][i];
+	}
+	return x;
+}
+/*****************************************************************************/
+vector<double> SolveMatrix(vector<vector<double> > A, vector<double> b) {
+	// Assumptions: A x = b, A is a NxN matrix, x is a vector, b is vector
+	int N = A.size();
+	double *M = (double *)workspace.Buffer(ws_Matrix, (size_t)N * N * sizeof(double));
+	for (int i = 0; i < N; i++) memcpy(&M[(size_t)i*N], A[i].data(), N * sizeof(double));
+	SolveMatrixInPlace(M, N, b);
+	return b;
+}
+/*****************************************************************************/
+void SolveMatrixInPlace(double *A, int N, vector<double> &x) {
+	// Householder QR of A, applied to x as it goes, then back-substitution. The column
+	// operations run row by row, so every sweep streams through contiguous memory, but each
+	// sum is still accumulated over the rows in ascending order, as in the original
+	// column-at-a-time loops, and gives the same bits.
+	vector<double> d(N), f(N);
+
+	/* Perform Householder transformation */
+	for (int i = 0; i < N; i++) {
+		Checkpoint("solve", (double)i / N);
+		double *Ai = &A[(size_t)i*N];
+		double r = 0.0;
+		for (int k = i; k < N; k++) r += A[(size_t)k*N + i] * A[(size_t)k*N + i];
+
+		if (!(r > 0)) throw EqeqError("Singular hardness matrix (rank deficient)"); // Also catches NaN, e.g. from two atoms on one site
+
+		double alef = (Ai[i] < 0) ? -sqrt(r) : sqrt(r);
+		double ak = 1.0 / (r + alef * Ai[i]);
+		Ai[i] += alef;
+		d[i] = -alef;
+
+		// Column k -= (ak * column k . column i) column i, for every k > i
+		for (int k = i + 1; k < N; k++) f[k] = 0.0;
+		for (int j = i; j < N; j++) {
+			const double *Aj = &A[(size_t)j*N];
+			for (int k = i + 1; k < N; k++) f[k] += Aj[k] * Aj[i];
+		}
+		for (int k = i + 1; k < N; k++) f[k] *= ak;
+		for (int j = i; j < N; j++) {
+			double *Aj = &A[(size_t)j*N];
+			for (int k = i + 1; k < N; k++) Aj[k] -= f[k] * Aj[i];
+		}
 
-    int i, j, k;
-    int N = A.size();
-    int M = A[0].size();
+		if (fabs(alef) < 0.00001) throw EqeqError("Singular hardness matrix (apparent singularity)");
 
-    vector<double> d (N);
+		double g = 0.0;
+		for (int j = i; j < N; j++) g += x[j] * A[(size_t)j*N + i];
+		g *= ak;
+		for (int j = i; j < N; j++) x[j] -= g * A[(size_t)j*N + i];
+	}
 
-    /* Perform Householder transformation */
-    for (i = 0; i < N; i++) {
-        const double aii = A[i][i];
-        double alef, f, ak;
-        double max_norm = 0.0;
-        double r = 0.0;
+	// |R_ii| of the QR factorization bound the condition number from below
+	double dMin = fabs(d[0]), dMax = fabs(d[0]);
+	for (int i = 0; i < N; i++) { dMin = min(dMin, fabs(d[i])); dMax = max(dMax, fabs(d[i])); }
+	conditionEstimate = dMax / dMin;
+
+	/* Perform back-substitution */
+	for (int i = N-1; i >= 0; i--) {
+		const double *Ai = &A[(size_t)i*N];
+		double sum = 0.0;
+		for (int k = i + 1; k < N; k++) sum += Ai[k] * x[k];
+		x[i] = (x[i] - sum) / d[i];
+	}
+}
+/*****************************************************************************/
+static void LoadTables() {
+    static bool loaded = false; // The element tables never change, so parse them once
+    if (loaded) return;
+    InitializeStringAtomLabelsEnumeration();
+    LoadIonizationDataFromString(ionization_data_text);
+    LoadChargeCentersFromString(chargecenters_text);
+    TraceFromEnvironment();
+    loaded = true;
+}
+/*****************************************************************************/
+#ifndef EQEQ_LIBRARY // libeqeq takes its atoms from the caller, not from CIF files
+static void LoadStructure(const std::string &cif_path) {
+    LoadTables();
+
+    Pos.clear();
+    Frac.clear();
+    J.clear();
+    X.clear();
+    Label.clear();
+    Symbol.clear();
+
+    LoadCIFFile(cif_path);
+}
+#endif
+/*****************************************************************************/
+static void SelectMethod(const std::string &method) {
+    if (method == "NonPeriodic" || method == "nonperiodic") {
+        isPeriodic = false;
+    } else if (method == "Direct" || method == "direct") {
+        useEwardSums = false;
+        isPeriodic = true;
+    } else if (method == "Wolf" || method == "wolf") {
+        useWolf = true;
+        isPeriodic = true;
+    } else { // default "Ewald"
+        useEwardSums = true;
+        isPeriodic = true;
+    }
+}
+/*****************************************************************************/
+#if !defined(EQEQ_BENCH) && !defined(EQEQ_LIBRARY) // For result stores: run_batch and eqeq_cli --store
+static std::string BatchParameters(const std::string &method, int precision) {
+    // The META chunk of a result store: everything that determines the charges, as JSON
+    std::string json = "{\"method\": \"" + method + "\", \"precision\": ";
+    AppendInt(json, precision);
+    json += ", \"lambda\": "; AppendFixed(json, lambda, 6);
+    json += ", \"hI0\": "; AppendFixed(json, hI0, 6);
+    json += ", \"mR\": "; AppendInt(json, mR);
+    json += ", \"mK\": "; AppendInt(json, mK);
+    json += ", \"eta\": "; AppendFixed(json, eta, 6);
+    json += ", \"rmax\": "; AppendFixed(json, realRadius, 6);
+    json += ", \"kmax\": "; AppendFixed(json, kCutoff, 6);
+    json += ", \"tol\": "; AppendFixed(json, directTol, 12);
+    json += useSymmetry ? ", \"symmetry\": true" : ", \"symmetry\": false";
+    json += useSupercell ? ", \"supercell\": true" : ", \"supercell\": false";
+    json += ", \"max_atoms\": "; AppendInt(json, batchMaxAtoms);
+    if (screenTol > 0) { json += ", \"screen\": "; AppendFixed(json, screenTol, 12); }
+    if (useFamily) json += ", \"family\": true";
+    json += ", \"cache_version\": "; AppendInt(json, cacheVersion);
+    json += ", \"started\": "; AppendInt(json, (long long)time(nullptr));
+    json += "}";
+    return json;
+}
+#endif
+/*****************************************************************************/
+// The solver state is global, so runs (Python calls, C API contexts) take turns on this lock
+static std::mutex engineMutex;
+static unsigned long long engineOwner = 0; // Context that computed last (0: eqeq.run and the other Python calls)
+static std::atomic<unsigned long long> lastContextId{0};
+
+// A C API context records the structure and the parameters, and eqeq_compute loads them into
+// the engine: every option is set from the context, and what the engine kept from earlier
+// runs is either dropped (the SPME grid, when another context or a Python call used it last)
+// or kept per context (the family parent of family=1, swapped in for the computation)
+struct eqeq_context {
+    bool periodic = false;
+    double cell[9] = {0}; // Rows a, b, c
+    std::vector<double> xyz;
+    std::vector<int> numbers;
+    std::string method = "ewald";
+    std::map<std::string, double> parameters = { // The defaults of eqeq.run
+        {"precision", 3}, {"charge", 0}, {"lambda", 1.2}, {"hI0", -2.0}, {"mR", 2}, {"mK", 2},
+        {"eta", 50.0}, {"rmax", 20.0}, {"kmax", 1.25}, {"tol", 0.0}, {"symmetry", 1}, {"supercell", 0},
+        {"spme", 0}, {"rcut", 12.0}, {"tree", 0}, {"tree_order", 4}, {"theta", 0.5}, {"wolf_alpha", 0.2},
+        {"max_memory", 0.0}, {"mixed_precision", 0}, {"hmatrix", 0}, {"aca_tol", 1e-8}, {"screen", 0.0},
+        {"family", 0}, {"deadline", 0.0}};
+    std::string error;
+    unsigned long long id = ++lastContextId;
+    Family family; // Parent of this context's family=1 computations
+};
 
-        for (k = i; k < M; k++) {
-          r += A[k][i] * A[k][i];
+static int ContextResult(eqeq_context *ctx, int code, const std::string &message = "") {
+    if (ctx) ctx->error = message;
+    return code;
+}
+/*****************************************************************************/
+static void LoadContext(const eqeq_context *ctx) {
+    auto p = [ctx](const char *name) { return ctx->parameters.at(name); };
+    lambda = p("lambda");
+    hI0 = static_cast<float>(p("hI0"));
+    mR = (int)p("mR");
+    mK = (int)p("mK");
+    eta = p("eta");
+    realRadius = p("rmax");
+    kCutoff = p("kmax");
+    directTol = p("tol");
+    useSymmetry = p("symmetry") != 0;
+    useSupercell = p("supercell") != 0;
+    useSPME = p("spme") != 0;
+    rcut = p("rcut");
+    useTree = p("tree") != 0;
+    treeOrder = (int)p("tree_order");
+    theta = p("theta");
+    wolfAlpha = p("wolf_alpha");
+    maxMemory = p("max_memory");
+    scratchDir.clear();
+    useMixedPrecision = p("mixed_precision") != 0;
+    useHMatrix = p("hmatrix") != 0;
+    acaTol = p("aca_tol");
+    screenTol = p("screen");
+    useFamily = p("family") != 0;
+    useHugePages = false;
+    collectStats = false;
+    chargePrecision = (int)p("precision");
+    Qtot = p("charge");
+    useWolf = false;
+    useEwardSums = true;
+    SelectMethod(ctx->method);
+    if (!ctx->periodic) isPeriodic = false;
+
+    LoadTables();
+    Pos.clear();
+    Frac.clear();
+    J.clear();
+    X.clear();
+    Label.clear();
+    Symbol.clear();
+    SymOps.clear(); // The atoms are the whole cell
+
+    // The engine builds its own cell (a along x, b in the xy plane) from the lengths and
+    // angles, and places the atoms by their fractional coordinates, so the caller's
+    // orientation does not matter. A molecule gets a cubic box around it that the
+    // NonPeriodic method never repeats.
+    size_t n = ctx->numbers.size();
+    const double *a = ctx->cell, *b = ctx->cell + 3, *c = ctx->cell + 6;
+    double inverse[9], origin[3] = {0, 0, 0};
+    if (ctx->periodic) {
+        auto length = [](const double *v) { return sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]); };
+        auto angle = [&](const double *u, const double *v) {
+            return acos((u[0]*v[0] + u[1]*v[1] + u[2]*v[2]) / (length(u) * length(v))) * 180.0 / PI;
+        };
+        SetUnitCell(length(a), length(b), length(c), angle(b, c), angle(a, c), angle(a, b));
+        // frac = r M^-1 with the lattice vectors as the rows of M
+        double det = a[0]*(b[1]*c[2] - b[2]*c[1]) - a[1]*(b[0]*c[2] - b[2]*c[0]) + a[2]*(b[0]*c[1] - b[1]*c[0]);
+        for (int r = 0; r < 3; r++) {
+            for (int s = 0; s < 3; s++) {
+                int r1 = (r + 1) % 3, r2 = (r + 2) % 3, s1 = (s + 1) % 3, s2 = (s + 2) % 3;
+                inverse[s*3 + r] = (ctx->cell[r1*3 + s1] * ctx->cell[r2*3 + s2] - ctx->cell[r1*3 + s2] * ctx->cell[r2*3 + s1]) / det;
+            }
         }
-
-        if (r == 0) {
-          cout << "Error! Matrix is rank deficient." << endl;
-          // return -1;
+    } else {
+        double low[3] = {HUGE_VAL, HUGE_VAL, HUGE_VAL}, high[3] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+        for (size_t i = 0; i < n; i++) {
+            for (int d = 0; d < 3; d++) {
+                low[d] = std::min(low[d], ctx->xyz[3*i + d]);
+                high[d] = std::max(high[d], ctx->xyz[3*i + d]);
+            }
         }
+        double box = 10.0;
+        for (int d = 0; d < 3; d++) box = std::max(box, high[d] - low[d] + 10.0);
+        SetUnitCell(box, box, box, 90, 90, 90);
+        for (int d = 0; d < 9; d++) inverse[d] = (d % 4 == 0) ? 1.0 / box : 0.0;
+        for (int d = 0; d < 3; d++) origin[d] = 0.5 * (low[d] + high[d]) - 0.5 * box;
+    }
 
-        if (A[i][i] < 0)
-          alef = (-1)*sqrt(r);
-        else
-          alef = sqrt(r);
-
-        ak = 1.0 / (r + alef * A[i][i]);
-
-        A[i][i] +=  alef;
-
-        d[i] = -alef;
-
-        for (k = i + 1; k < N; k++) {
-          double norm = 0.0;
-          f = 0.0;
-
-          for (j = i; j < M; j++) {
-            norm += A[j][k] * A[j][k];
-            f += A[j][k] * A[j][i];
-          }
-
-          max_norm = max(max_norm, norm);
-
-          f *= ak;
-
-          for (j = i; j < M; j++) {
-            A[j][k] -= f * A[j][i];
-          }
+    for (size_t i = 0; i < n; i++) {
+        double r[3];
+        for (int d = 0; d < 3; d++) r[d] = ctx->xyz[3*i + d] - origin[d];
+        Coordinates frac;
+        frac.x = r[0]*inverse[0] + r[1]*inverse[3] + r[2]*inverse[6];
+        frac.y = r[0]*inverse[1] + r[1]*inverse[4] + r[2]*inverse[7];
+        frac.z = r[0]*inverse[2] + r[1]*inverse[5] + r[2]*inverse[8];
+        const std::string &symbol = IonizationData[ctx->numbers[i] - 1].Label; // Two characters, as in s_mapStringAtomLabels
+        std::string label = symbol.substr(0, symbol[1] == ' ' ? 1 : 2) + std::to_string(i + 1);
+        AddAtom(label, symbol, frac);
+    }
+    FinishStructure();
+}
+/*****************************************************************************/
+int eqeq_abi_version(void) {
+    return EQEQ_ABI_VERSION;
+}
+/*****************************************************************************/
+eqeq_context *eqeq_create(void) {
+    return new (std::nothrow) eqeq_context();
+}
+/*****************************************************************************/
+void eqeq_destroy(eqeq_context *ctx) {
+    delete ctx;
+}
+/*****************************************************************************/
+int eqeq_set_cell(eqeq_context *ctx, const double *cell) {
+    if (!ctx) return EQEQ_INVALID_ARGUMENT;
+    if (!cell) {
+        ctx->periodic = false;
+        return ContextResult(ctx, EQEQ_OK);
+    }
+    const double *a = cell, *b = cell + 3, *c = cell + 6;
+    double volume = a[0]*(b[1]*c[2] - b[2]*c[1]) - a[1]*(b[0]*c[2] - b[2]*c[0]) + a[2]*(b[0]*c[1] - b[1]*c[0]);
+    if (!(fabs(volume) > 1e-6)) return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, "The cell has no volume");
+    ctx->periodic = true;
+    std::copy(cell, cell + 9, ctx->cell);
+    return ContextResult(ctx, EQEQ_OK);
+}
+/*****************************************************************************/
+int eqeq_set_atoms(eqeq_context *ctx, size_t n, const double *xyz, const int *atomic_numbers) {
+    if (!ctx) return EQEQ_INVALID_ARGUMENT;
+    if ((n > 0) && (!xyz || !atomic_numbers)) return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, "Missing coordinates or atomic numbers");
+    for (size_t i = 0; i < n; i++) {
+        if ((atomic_numbers[i] < 1) || (atomic_numbers[i] > TABLE_OF_ELEMENTS_SIZE)) {
+            return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, "Atom " + std::to_string(i) + " has no element data (Z = " + std::to_string(atomic_numbers[i]) + ")");
         }
-
-        if (fabs(alef) < 0.00001) {
-          cout << "Apparent singularity in matrix." << endl;
-          // return -1;
+    }
+    ctx->xyz.assign(xyz, xyz + 3*n);
+    ctx->numbers.assign(atomic_numbers, atomic_numbers + n);
+    return ContextResult(ctx, EQEQ_OK);
+}
+/*****************************************************************************/
+int eqeq_set_method(eqeq_context *ctx, const char *method) {
+    if (!ctx) return EQEQ_INVALID_ARGUMENT;
+    std::string name = method ? method : "";
+    for (char &ch : name) ch = tolower(ch);
+    if ((name != "ewald") && (name != "direct") && (name != "wolf") && (name != "nonperiodic")) {
+        return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, "Unknown method " + name);
+    }
+    ctx->method = name;
+    return ContextResult(ctx, EQEQ_OK);
+}
+/*****************************************************************************/
+int eqeq_set_parameter(eqeq_context *ctx, const char *name, double value) {
+    if (!ctx) return EQEQ_INVALID_ARGUMENT;
+    auto parameter = ctx->parameters.find(name ? name : "");
+    if (parameter == ctx->parameters.end()) return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, std::string("Unknown parameter ") + (name ? name : ""));
+    if (std::isnan(value)) return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, parameter->first + " is not a number");
+    parameter->second = value;
+    return ContextResult(ctx, EQEQ_OK);
+}
+/*****************************************************************************/
+int eqeq_compute(eqeq_context *ctx, double *charges) {
+    if (!ctx) return EQEQ_INVALID_ARGUMENT;
+    if (ctx->numbers.empty()) return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, "No atoms");
+    if (!charges) return ContextResult(ctx, EQEQ_INVALID_ARGUMENT, "No output buffer");
+
+    std::lock_guard<std::mutex> engine(engineMutex);
+    double deadline = ctx->parameters["deadline"];
+    cancelFlag = nullptr;
+    progressCallback = nullptr;
+    deadlineTime = (deadline > 0) ? Seconds() + deadline : 0;
+    int code = EQEQ_OK;
+    std::string message;
+    runWarnings.clear();
+    if (engineOwner != ctx->id) { // The grid was made for someone else's cell (or the same one)
+        std::fill(SPMEGridKey, SPMEGridKey + 9, NAN);
+        engineOwner = ctx->id;
+    }
+    std::swap(family, ctx->family);
+    try {
+        LoadContext(ctx);
+        Qeq();
+        RoundCharges(chargePrecision);
+        for (int i = 0; i < numAtoms; i++) {
+            if (!std::isfinite(Q[i])) throw EqeqError("The charge of atom " + std::to_string(i) + " is not finite (singular hardness matrix?)");
         }
+        std::copy(Q.begin(), Q.end(), charges);
+        message = runWarnings;
+    } catch (const QeqInterrupted &e) {
+        code = e.deadline ? EQEQ_DEADLINE_EXCEEDED : EQEQ_FAILED;
+        message = e.what();
+    } catch (const std::exception &e) {
+        code = EQEQ_FAILED;
+        message = e.what();
+    }
+    std::swap(family, ctx->family);
+    deadlineTime = 0;
+    Qtot = 0; // What everything else expects
+    return ContextResult(ctx, code, message);
+}
+/*****************************************************************************/
+const char *eqeq_last_error(const eqeq_context *ctx) {
+    return ctx ? ctx->error.c_str() : "No context";
+}
+/*****************************************************************************/
+#ifndef EQEQ_STANDALONE
+static py::dict RunStatsDict(bool cached) {
+    py::dict phases;
+    for (const PhaseStats &phase : Phases) {
+        py::dict entry;
+        entry["wall"] = phase.wall;
+        entry["cpu"] = phase.cpu;
+        entry["heap_bytes"] = phase.heapBytes;
+        phases[py::str(phase.name)] = entry;
+    }
 
-        f = 0.0;
-
-        for (j = i; j < M; j++) {
-          f += x[j] * A[j][i];
+    // Lattice-sum terms behind each GetJ call: real-space images, plus k-vectors for Ewald
+    long long realImages = (long long)(2*aVnum + 1) * (2*bVnum + 1) * (2*cVnum + 1);
+    long long kVectors = (long long)(2*hVnum + 1) * (2*jVnum + 1) * (2*kVnum + 1) - 1;
+    long long termsPerCall = 1;
+    if (isPeriodic && !useWolf) termsPerCall = realImages + (useEwardSums ? kVectors : 0);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    py::dict info;
+    info["phases"] = phases;
+    info["atoms"] = numAtoms;
+    info["solver"] = cached ? std::string("cache") : solverName;
+    info["kernel_calls"] = kernelCalls;
+    info["kernel_terms"] = kernelCalls * termsPerCall;
+    if (isPeriodic && !useWolf) info["real_images"] = realImages;
+    if (isPeriodic && !useWolf && useEwardSums) info["k_vectors"] = kVectors;
+    if (solverName == "SPME" || solverName == "family" || solverName == "Wolf" || solverName == "tree") info["pairs"] = PairCol.size();
+    if (solverIterations > 0) info["iterations"] = solverIterations;
+    if (solverResidual >= 0) info["residual"] = solverResidual;
+    if (conditionEstimate >= 0) info["condition_estimate"] = conditionEstimate;
+    if (screenEstimate >= 0) info["screen_estimate"] = screenEstimate;
+    if (familyMatched >= 0) info["family_matched"] = familyMatched;
+    info["threads"] = numThreads;
+    info["peak_rss_bytes"] = (long long)usage.ru_maxrss * 1024;
+    info["workspace_bytes"] = workspace.Bytes();
+    return info;
+}
+/*****************************************************************************/
+static py::dict ReadStore(const std::string &path) {
+    // The whole file is mapped once, privately (so the arrays are writable without touching
+    // the file), and every column is a NumPy view into the mapping, which is released with
+    // the last of them. A chunk cut short by an interrupted writer is left out.
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Unable to open result store " + path);
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = info.st_size;
+    char *data = nullptr;
+    if (size > 0) data = (char *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ((size < 8) || (data == MAP_FAILED) || (memcmp(data, "EQEQRES1", 8) != 0)) {
+        if ((size > 0) && (data != MAP_FAILED)) munmap(data, size);
+        throw std::runtime_error(path + " is not a result store");
+    }
+    size_t *mapping = new size_t[2]{(size_t)data, size};
+    py::capsule owner(mapping, [](void *p) {
+        size_t *m = (size_t *)p;
+        munmap((void *)m[0], m[1]);
+        delete[] m;
+    });
+
+    py::list parameters, chunks;
+    for (size_t at = 8; at + 48 <= size; ) {
+        long long header[5];
+        memcpy(header, data + at + 8, sizeof(header));
+        if ((header[0] < 48) || (at + header[0] > size)) break;
+        const char *body = data + at + 48;
+        if (memcmp(data + at, "META", 4) == 0) {
+            parameters.append(py::str(std::string(body, header[1])));
+        } else if (memcmp(data + at, "RSLT", 4) == 0) {
+            long long S = header[1], A = header[2];
+            size_t offset = 0;
+            auto column = [&](auto type, long long count) {
+                using T = decltype(type);
+                py::array_t<T> array(count, (const T *)(body + offset), owner);
+                offset += (count * sizeof(T) + 7) / 8 * 8;
+                return array;
+            };
+            py::dict chunk;
+            chunk["id"] = column((long long)0, S);
+            chunk["atom_offsets"] = column((long long)0, S + 1);
+            chunk["seconds"] = column(0.0, S);
+            chunk["path_offsets"] = column((long long)0, S + 1);
+            chunk["charges"] = column(0.0, A);
+            chunk["label_offsets"] = column((long long)0, A + 1);
+            chunk["species"] = column((uint8_t)0, A);
+            chunk["paths"] = column((uint8_t)0, header[3]);
+            chunk["labels"] = column((uint8_t)0, header[4]);
+            chunks.append(chunk);
         }
+        at += header[0];
+    }
+    py::dict out;
+    out["parameters"] = parameters;
+    out["chunks"] = chunks;
+    return out;
+}
+/*****************************************************************************/
+// Runs take their turn on engineMutex with the GIL released while they wait or compute;
+// run_async only moves the waiting off the caller's thread
+static thread_local const std::atomic<bool> *asyncCancelFlag = nullptr; // Of the run_async on this thread
+
+static std::unique_lock<std::mutex> LockEngine() {
+    py::gil_scoped_release release;
+    std::unique_lock<std::mutex> engine(engineMutex);
+    if (engineOwner != 0) { // As in eqeq_compute: no SPME grid from a context
+        std::fill(SPMEGridKey, SPMEGridKey + 9, NAN);
+        engineOwner = 0;
+    }
+    return engine;
+}
+/*****************************************************************************/
 
-        f *= ak;
-
-        for (j = i; j < M; j++) {
-          x[j] -= f * A[j][i];
+// Handle returned by run_async: eqeq.run(*args, **kwargs) on a thread of its own
+class AsyncRun {
+    public:
+        AsyncRun(py::object function, py::args args, py::kwargs kwargs);
+        ~AsyncRun();
+        void Cancel();
+        bool Done();
+        py::object Result(py::object timeout);
+
+        std::atomic<bool> cancelled;
+        bool finished;
+        std::mutex lock;
+        std::condition_variable finishedChanged;
+        py::object function; py::object args; py::object kwargs; // Released by the worker when done
+        py::object value;
+        std::exception_ptr error;
+        std::thread worker;
+};
+/*****************************************************************************/
+AsyncRun::AsyncRun(py::object function, py::args args, py::kwargs kwargs) {
+    cancelled = false;
+    finished = false;
+    this->function = function; this->args = args; this->kwargs = kwargs;
+    worker = std::thread([this]() {
+        py::gil_scoped_acquire gil;
+        asyncCancelFlag = &cancelled;
+        try {
+            value = this->function(*this->args, **this->kwargs);
+        } catch (...) {
+            error = std::current_exception();
         }
+        asyncCancelFlag = nullptr;
+        this->function = py::object(); this->args = py::object(); this->kwargs = py::object();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            finished = true;
+        }
+        finishedChanged.notify_all();
+    });
+}
+/*****************************************************************************/
+AsyncRun::~AsyncRun() {
+    // A handle dropped while running cancels the run rather than leaving it behind
+    Cancel();
+    if (worker.joinable()) {
+        py::gil_scoped_release release;
+        worker.join();
     }
+}
+/*****************************************************************************/
+void AsyncRun::Cancel() {
+    cancelled = true;
+}
+/*****************************************************************************/
+bool AsyncRun::Done() {
+    std::lock_guard<std::mutex> guard(lock);
+    return finished;
+}
+/*****************************************************************************/
+py::object AsyncRun::Result(py::object timeout) {
+    double seconds = timeout.is_none() ? -1 : std::max(0.0, timeout.cast<double>());
+    {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> guard(lock);
+        if (seconds < 0) {
+            finishedChanged.wait(guard, [this]() { return finished; });
+        } else {
+            finishedChanged.wait_for(guard, std::chrono::duration<double>(seconds), [this]() { return finished; });
+        }
+    }
+    if (!Done()) {
+        PyErr_SetString(PyExc_TimeoutError, "run_async result not ready");
+        throw py::error_already_set();
+    }
+    if (error) std::rethrow_exception(error);
+    return value;
+}
+/*****************************************************************************/
 
-    /* Perform back-substitution */
-
-    for (i = N-1; i >= 0; i--) {
-      double sum = 0.0;
-
-      for (k = i + 1; k < N; k++) {
-        sum += A[i][k] * x[k];
-      }
-
-      x[i] = (x[i] - sum) / d[i] ;
+// eqeq.Context: the C API (eqeq.h) for structures held in arrays rather than CIF files
+class Context {
+    public:
+        Context();
+        ~Context();
+        Context(const Context &) = delete;
+        void Check(int code); // Raises the context's error
+        void SetCell(const std::optional<std::array<std::array<double, 3>, 3> > &cell);
+        void SetAtoms(py::array_t<double, py::array::c_style | py::array::forcecast> xyz,
+                      py::array_t<int, py::array::c_style | py::array::forcecast> numbers);
+        py::array_t<double> Compute();
+
+        eqeq_context *ctx;
+        size_t numAtoms;
+};
+/*****************************************************************************/
+Context::Context() {
+    ctx = eqeq_create();
+    if (!ctx) throw std::bad_alloc();
+    numAtoms = 0;
+}
+/*****************************************************************************/
+Context::~Context() {
+    eqeq_destroy(ctx);
+}
+/*****************************************************************************/
+void Context::Check(int code) {
+    if (code == EQEQ_OK) return;
+    if (code == EQEQ_INVALID_ARGUMENT) throw py::value_error(eqeq_last_error(ctx));
+    if (code == EQEQ_DEADLINE_EXCEEDED) throw QeqInterrupted(true);
+    throw std::runtime_error(eqeq_last_error(ctx));
+}
+/*****************************************************************************/
+void Context::SetCell(const std::optional<std::array<std::array<double, 3>, 3> > &cell) {
+    double rows[9];
+    if (cell) {
+        for (int r = 0; r < 3; r++) for (int c = 0; c < 3; c++) rows[r*3 + c] = (*cell)[r][c];
+    }
+    Check(eqeq_set_cell(ctx, cell ? rows : nullptr));
+}
+/*****************************************************************************/
+void Context::SetAtoms(py::array_t<double, py::array::c_style | py::array::forcecast> xyz,
+                       py::array_t<int, py::array::c_style | py::array::forcecast> numbers) {
+    if ((xyz.ndim() != 2) || (xyz.shape(1) != 3)) throw py::value_error("xyz must have shape (n, 3)");
+    if ((numbers.ndim() != 1) || (numbers.shape(0) != xyz.shape(0))) throw py::value_error("numbers must have one entry per atom");
+    Check(eqeq_set_atoms(ctx, xyz.shape(0), xyz.data(), numbers.data()));
+    numAtoms = xyz.shape(0);
+}
+/*****************************************************************************/
+py::array_t<double> Context::Compute() {
+    py::array_t<double> charges(numAtoms);
+    double *out = charges.mutable_data();
+    int code;
+    {
+        py::gil_scoped_release release;
+        code = eqeq_compute(ctx, out);
+    }
+    Check(code);
+    return charges;
+}
+/*****************************************************************************/
+// hardness_matrix and factorize: the structure and lattice sums as run() sets them up, no solve
+static void LoadHardnessStructure(const std::string &cif_path, const std::string &method, double lambda_val,
+                                  double hI0_in, int mR_in, int mK_in, double eta_in, double rmax, double kmax,
+                                  double tol) {
+    lambda = lambda_val;
+    hI0 = static_cast<float>(hI0_in);
+    mR = mR_in;
+    mK = mK_in;
+    eta = eta_in;
+    realRadius = rmax;
+    kCutoff = kmax;
+    directTol = tol;
+    useWolf = false;
+    useEwardSums = true;
+    SelectMethod(method);
+    if (useWolf) {
+        useWolf = false;
+        throw py::value_error("The Wolf method has no hardness matrix; use Ewald, Direct or NonPeriodic");
     }
+    py::gil_scoped_release release;
+    LoadStructure(cif_path);
+}
+/*****************************************************************************/
 
+// Returned by factorize: J = L D L^T of one structure, for any number of right-hand sides
+class Factorization {
+    public:
+        Factorization(double *factor, size_t bytes, int n);
+        ~Factorization();
+        Factorization(const Factorization &) = delete;
+        py::array_t<double> Solve(py::array_t<double, py::array::c_style | py::array::forcecast> rhs);
+
+        double *factor; size_t bytes; // A detached workspace mapping, n x n row-major
+        int n;
+        std::vector<std::string> labels;
+        std::vector<double> electronegativity;
+};
+/*****************************************************************************/
+Factorization::Factorization(double *factor, size_t bytes, int n) {
+    this->factor = factor; this->bytes = bytes; this->n = n;
+}
+/*****************************************************************************/
+Factorization::~Factorization() {
+    munmap(factor, bytes);
+}
+/*****************************************************************************/
+py::array_t<double> Factorization::Solve(py::array_t<double, py::array::c_style | py::array::forcecast> rhs) {
+    if ((rhs.ndim() < 1) || (rhs.ndim() > 2) || (rhs.shape(0) != n)) {
+        throw py::value_error("rhs must have shape (" + std::to_string(n) + ",) or (" + std::to_string(n) + ", k)");
+    }
+    int numRHS = (rhs.ndim() == 2) ? rhs.shape(1) : 1;
+    std::vector<ssize_t> shape{n};
+    if (rhs.ndim() == 2) shape.push_back(numRHS);
+    py::array_t<double> x(shape);
+    double *out = x.mutable_data();
+    std::memcpy(out, rhs.data(), (size_t)n * numRHS * sizeof(double));
+    {
+        py::gil_scoped_release release; // Only reads the factor, so no engine lock
+        LDLTSolve(factor, n, out, numRHS);
+    }
     return x;
 }
 /*****************************************************************************/
@@ -1288,6 +5423,16 @@ PYBIND11_MODULE(eqeq, m) {
     // m.def("load_chargecenters_from_string", &LoadChargeCentersFromString);
     // m.def("load_cif", &LoadCIFFile);
 
+    // Cancelled runs raise eqeq.Cancelled, runs past their deadline TimeoutError
+    static py::handle cancelledType = py::exception<QeqInterrupted>(m, "Cancelled").release();
+    py::register_exception_translator([](std::exception_ptr p) {
+        try {
+            if (p) std::rethrow_exception(p);
+        } catch (const QeqInterrupted &e) {
+            PyErr_SetString(e.deadline ? PyExc_TimeoutError : cancelledType.ptr(), e.what());
+        }
+    });
+
     m.def("run", [](const std::string &cif_path,
                     int precision,
                     const std::string &method,
@@ -1297,8 +5442,34 @@ PYBIND11_MODULE(eqeq, m) {
                     bool use_ewald,
                     int mR_in,
                     int mK_in,
-                    double eta_in) {
-
+                    double eta_in,
+                    double rmax,
+                    double kmax,
+                    double tol,
+                    const std::string &cache_dir,
+                    bool symmetry,
+                    bool supercell,
+                    bool spme,
+                    double rcut_in,
+                    bool tree,
+                    int tree_order,
+                    double theta_in,
+                    double wolf_alpha,
+                    double max_memory,
+                    const std::string &scratch_dir,
+                    bool mixed_precision,
+                    bool hmatrix,
+                    double aca_tol,
+                    bool stats,
+                    const std::string &trace,
+                    double deadline,
+                    py::object progress,
+                    bool huge_pages,
+                    double screen,
+                    bool family_mode) -> py::object {
+
+        double start = Seconds();
+        std::unique_lock<std::mutex> engine = LockEngine();
 
         lambda = lambda_val;
         hI0 = static_cast<float>(hI0_in);
@@ -1307,39 +5478,92 @@ PYBIND11_MODULE(eqeq, m) {
         mR = mR_in;
         mK = mK_in;
         eta = eta_in;
-
-
-        if (method == "NonPeriodic" || method == "nonperiodic") {
-            isPeriodic = false;
-        } else if (method == "Direct" || method == "direct") {
-            useEwardSums = false;
-            isPeriodic = true;
-        } else { // default "Ewald"
-            useEwardSums = true;
-            isPeriodic = true;
+        realRadius = rmax;
+        kCutoff = kmax;
+        directTol = tol;
+        useSymmetry = symmetry;
+        useSupercell = supercell;
+        useSPME = spme;
+        rcut = rcut_in;
+        useTree = tree;
+        treeOrder = tree_order;
+        theta = theta_in;
+        wolfAlpha = wolf_alpha;
+        useWolf = false;
+        maxMemory = max_memory;
+        scratchDir = scratch_dir;
+        useMixedPrecision = mixed_precision;
+        useHMatrix = hmatrix;
+        acaTol = aca_tol;
+        chargePrecision = precision;
+        useHugePages = huge_pages;
+        screenTol = screen;
+        useFamily = family_mode;
+
+
+        SelectMethod(method);
+        collectStats = stats;
+        ResetStats();
+
+        // EQEQ_TRACE already records everything into its own file
+        LoadTables();
+        bool traceRun = !trace.empty() && !traceEnabled;
+        if (traceRun) TraceBegin(trace);
+
+        // The solvers call progress (taking the GIL only for the call) and stop at their
+        // next checkpoint once cancelled or past the deadline
+        cancelFlag = asyncCancelFlag;
+        deadlineTime = (deadline > 0) ? start + deadline : 0;
+        if (!progress.is_none()) {
+            progressCallback = [progress](const char *stage, double fraction) {
+                py::gil_scoped_acquire gil;
+                progress(stage, fraction);
+            };
         }
-
-
-        InitializeStringAtomLabelsEnumeration();
-        LoadIonizationDataFromString(ionization_data_text);
-        LoadChargeCentersFromString(chargecenters_text);
-
-        Pos.clear();
-        J.clear();
-        X.clear();
-        Label.clear();
-        Symbol.clear();
-
-        LoadCIFFile(cif_path);
-        Qeq();
-        RoundCharges(precision);
+        auto endInterruption = [&]() {
+            cancelFlag = nullptr;
+            deadlineTime = 0;
+            progressCallback = nullptr;
+            StatsPhase(nullptr);
+            collectStats = false;
+            if (traceRun) TraceEnd();
+        };
+
+        bool cached = false;
+        try {
+            py::gil_scoped_release release;
+            StatsPhase("parse");
+            LoadStructure(cif_path);
+
+            // A cache hit skips both the matrix assembly and the solve
+            std::string cacheKey;
+            if (!cache_dir.empty()) {
+                StatsPhase("cache");
+                cacheKey = CacheKey(precision);
+                cached = ReadCachedCharges(cache_dir, cacheKey);
+            }
+            if (!cached) {
+                Qeq();
+                StatsPhase("round");
+                RoundCharges(precision);
+                if (!cache_dir.empty()) {
+                    StatsPhase("cache");
+                    WriteCachedCharges(cache_dir, cacheKey);
+                }
+            }
+        } catch (...) {
+            endInterruption();
+            throw;
+        }
+        endInterruption();
 
 
         std::map<std::string, double> out;
         for (int i = 0; i < numAtoms; ++i) {
             out[ Label[i] ] = Q[i];
         }
-        return out;
+        if (!stats) return py::cast(out);
+        return py::make_tuple(out, RunStatsDict(cached));
     },
     py::arg("cif_path"),
     py::arg("precision") = 3,
@@ -1351,5 +5575,869 @@ PYBIND11_MODULE(eqeq, m) {
     py::arg("mR") = 2,
     py::arg("mK") = 2,
     py::arg("eta") = 50.0,
-    "Run full EQeq workflow with configurable parameters and return {label: charge}.");
-}
\ No newline at end of file
+    py::arg("rmax") = 20.0,
+    py::arg("kmax") = 1.25,
+    py::arg("tol") = 0.0,
+    py::arg("cache_dir") = "",
+    py::arg("symmetry") = true,
+    py::arg("supercell") = false,
+    py::arg("spme") = false,
+    py::arg("rcut") = 12.0,
+    py::arg("tree") = false,
+    py::arg("tree_order") = 4,
+    py::arg("theta") = 0.5,
+    py::arg("wolf_alpha") = 0.2,
+    py::arg("max_memory") = 0.0,
+    py::arg("scratch_dir") = "",
+    py::arg("mixed_precision") = false,
+    py::arg("hmatrix") = false,
+    py::arg("aca_tol") = 1e-8,
+    py::arg("stats") = false,
+    py::arg("trace") = "",
+    py::arg("deadline") = 0.0,
+    py::arg("progress") = py::none(),
+    py::arg("huge_pages") = false,
+    py::arg("screen") = 0.0,
+    py::arg("family") = false,
+    "Run full EQeq workflow with configurable parameters and return {label: charge} "
+    "(with stats=True: ({label: charge}, {per-phase timings and solver counters})). "
+    "trace=\"file.json\" writes a Chrome trace of the run. deadline=S raises TimeoutError "
+    "once the run has taken S seconds; progress(stage, fraction) is called as the solver advances. "
+    "screen=TOL keeps fast approximate Ewald charges when their estimated error (stats: screen_estimate, "
+    "an empirical estimate that can fall below the true error) is at most TOL, and solves in full otherwise. family=True solves converged Ewald, starting each structure "
+    "from the first one solved in the same cell (its parent; stats: family_matched).");
+
+    m.def("release_workspace", []() {
+        std::unique_lock<std::mutex> engine = LockEngine();
+        workspace.Release();
+        family = Family();
+    },
+    "Unmap the matrices that run() keeps for the next structure, and forget the family parent.");
+
+    m.def("run_async", [](py::args args, py::kwargs kwargs) {
+        py::object run = py::module_::import("eqeq").attr("run");
+        return std::make_unique<AsyncRun>(run, args, kwargs);
+    },
+    "Start run(*args, **kwargs) on a worker thread and return an AsyncRun handle. "
+    "Runs take turns, as the solver state is shared.");
+
+    py::class_<AsyncRun>(m, "AsyncRun")
+        .def("cancel", &AsyncRun::Cancel,
+             "Stop the run at the solver's next checkpoint; result() then raises eqeq.Cancelled")
+        .def("cancelled", [](AsyncRun &self) { return self.cancelled.load(); })
+        .def("done", &AsyncRun::Done)
+        .def("result", &AsyncRun::Result, py::arg("timeout") = py::none(),
+             "Wait for the run (at most timeout seconds) and return what run() returns, or raise what it raised");
+
+    py::class_<Context>(m, "Context")
+        .def(py::init<>())
+        .def("set_cell", &Context::SetCell, py::arg("cell"),
+             "Lattice vectors a, b, c as the rows of a 3x3 array (Angstroms); None for a molecule")
+        .def("set_atoms", &Context::SetAtoms, py::arg("xyz"), py::arg("numbers"),
+             "Cartesian coordinates (n x 3, Angstroms) and atomic numbers")
+        .def("set_method", [](Context &self, const std::string &method) { self.Check(eqeq_set_method(self.ctx, method.c_str())); },
+             py::arg("method"), "ewald, direct, wolf or nonperiodic")
+        .def("set_parameter", [](Context &self, const std::string &name, double value) {
+                 self.Check(eqeq_set_parameter(self.ctx, name.c_str(), value));
+             },
+             py::arg("name"), py::arg("value"), "A keyword of run() (flags as 0/1), charge (total) or deadline")
+        .def("compute", &Context::Compute,
+             "Charges in the order of the atoms; runs take turns with run() and other contexts");
+
+    m.def("run_batch", [](const std::vector<std::string> &cif_paths,
+                          int precision,
+                          const std::string &method,
+                          double lambda_val,
+                          double hI0_in,
+                          int mR_in,
+                          int mK_in,
+                          double eta_in,
+                          double rmax,
+                          double kmax,
+                          double tol,
+                          bool symmetry,
+                          bool supercell,
+                          int max_atoms,
+                          const std::string &trace,
+                          const std::string &store,
+                          double screen,
+                          const std::vector<std::string> &refine,
+                          bool family_mode) -> py::object {
+
+        std::unique_lock<std::mutex> engine = LockEngine();
+        lambda = lambda_val;
+        hI0 = static_cast<float>(hI0_in);
+        mR = mR_in;
+        mK = mK_in;
+        eta = eta_in;
+        realRadius = rmax;
+        kCutoff = kmax;
+        directTol = tol;
+        useSymmetry = symmetry;
+        useSupercell = supercell;
+        useSPME = false;
+        useTree = false;
+        useWolf = false;
+        maxMemory = 0;
+        useMixedPrecision = false;
+        useHMatrix = false;
+        batchMaxAtoms = max_atoms;
+        chargePrecision = precision;
+        screenTol = screen;
+        screenRefine = std::unordered_set<std::string>(refine.begin(), refine.end());
+        useFamily = family_mode;
+        SelectMethod(method);
+
+        LoadTables();
+        bool traceRun = !trace.empty() && !traceEnabled;
+        if (traceRun) TraceBegin(trace);
+
+        // With a store every structure goes to the file as it is solved, instead of into a
+        // list of dicts
+        if (!store.empty()) {
+            ResultStore results(store, BatchParameters(method, precision));
+            QeqBatch(cif_paths, precision, [&](size_t p, double seconds) { results.Add(p, cif_paths[p], seconds); });
+            if (traceRun) TraceEnd();
+            return py::cast(results.written);
+        }
+
+        std::vector<std::map<std::string, double> > out(cif_paths.size());
+        py::list screened(cif_paths.size());
+        QeqBatch(cif_paths, precision, [&](size_t p, double seconds) {
+            for (int i = 0; i < numAtoms; ++i) {
+                out[p][ Label[i] ] = Q[i];
+            }
+            if (screen > 0) {
+                py::dict entry;
+                entry["estimate"] = (screenEstimate >= 0) ? py::cast(screenEstimate) : py::none();
+                entry["refined"] = screenSkip || (screenEstimate > screenTol);
+                screened[p] = entry;
+            }
+        });
+        if (traceRun) TraceEnd();
+        if (screen > 0) return py::make_tuple(out, screened);
+        return py::cast(out);
+    },
+    py::arg("cif_paths"),
+    py::arg("precision") = 3,
+    py::arg("method") = "Ewald",
+    py::arg("lambda") = 1.2,
+    py::arg("hI0") = -2.0,
+    py::arg("mR") = 2,
+    py::arg("mK") = 2,
+    py::arg("eta") = 50.0,
+    py::arg("rmax") = 20.0,
+    py::arg("kmax") = 1.25,
+    py::arg("tol") = 0.0,
+    py::arg("symmetry") = true,
+    py::arg("supercell") = false,
+    py::arg("max_atoms") = 64,
+    py::arg("trace") = "",
+    py::arg("store") = "",
+    py::arg("screen") = 0.0,
+    py::arg("refine") = std::vector<std::string>(),
+    py::arg("family") = false,
+    "Charges of many small structures, solved together in batches: [{label: charge}] in the order of cif_paths. "
+    "Batches are dense solves in CIF atom order; supercells, structures with symmetry and every other method "
+    "go through the same solvers as run(). "
+    "With store=\"file\" the results are appended to that columnar file instead (see read_store) "
+    "and the number of structures written is returned. screen=TOL screens periodic structures as run() does "
+    "and returns ([{label: charge}], [{\"estimate\": estimated error or None, \"refined\": bool}]); the paths in refine "
+    "are always solved in full. family=True solves periodic structures as run(family=True) does.");
+
+    m.def("read_store", &ReadStore, py::arg("path"),
+    "Map a run_batch/eqeq_cli result store: {\"parameters\": [JSON of each run], \"chunks\": [{column: NumPy array}]}. "
+    "The arrays are copy-on-write views of the file.");
+
+    m.def("compare_wolf", [](const std::vector<std::string> &cif_paths,
+                             double lambda_val,
+                             double hI0_in,
+                             double rcut_in,
+                             double wolf_alpha) {
+
+        std::unique_lock<std::mutex> engine = LockEngine();
+        lambda = lambda_val;
+        hI0 = static_cast<float>(hI0_in);
+        rcut = rcut_in;
+        wolfAlpha = wolf_alpha;
+        isPeriodic = true;
+        useTree = false;
+
+        std::map<std::string, std::map<std::string, double> > out;
+        for (const std::string &path : cif_paths) {
+            LoadStructure(path);
+            double maxDeviation, meanDeviation;
+            WolfVersusEwald(maxDeviation, meanDeviation);
+            out[path]["max"] = maxDeviation;
+            out[path]["mean"] = meanDeviation;
+        }
+        return out;
+    },
+    py::arg("cif_paths"),
+    py::arg("lambda") = 1.2,
+    py::arg("hI0") = -2.0,
+    py::arg("rcut") = 12.0,
+    py::arg("wolf_alpha") = 0.2,
+    "Charge deviation of method=\"Wolf\" from converged Ewald for each CIF: {path: {\"max\": .., \"mean\": ..}}.");
+
+    m.def("hardness_matrix", [](const std::string &cif_path,
+                                const std::string &method,
+                                bool packed,
+                                double lambda_val,
+                                double hI0_in,
+                                int mR_in,
+                                int mK_in,
+                                double eta_in,
+                                double rmax,
+                                double kmax,
+                                double tol) -> py::object {
+
+        std::unique_lock<std::mutex> engine = LockEngine();
+        LoadHardnessStructure(cif_path, method, lambda_val, hI0_in, mR_in, mK_in, eta_in, rmax, kmax, tol);
+        ssize_t n = numAtoms;
+        double *A = (double *)workspace.Buffer(ws_Matrix, (size_t)n * n * sizeof(double));
+        {
+            py::gil_scoped_release release;
+            AssembleHardness(A);
+        }
+        if (packed) { // Lower triangle by rows (LAPACK's column-major upper packing)
+            py::array_t<double> out(n * (n + 1) / 2);
+            double *p = out.mutable_data();
+            for (ssize_t i = 0; i < n; i++) p = std::copy(A + i*n, A + i*n + i + 1, p);
+            return out;
+        }
+        // The matrix leaves the workspace with the array, which unmaps it when it goes
+        size_t bytes;
+        workspace.Detach(ws_Matrix, bytes);
+        size_t *mapping = new size_t[2]{(size_t)A, bytes};
+        py::capsule owner(mapping, [](void *p) {
+            size_t *m = (size_t *)p;
+            munmap((void *)m[0], m[1]);
+            delete[] m;
+        });
+        return py::array_t<double>(std::vector<ssize_t>{n, n}, A, owner);
+    },
+    py::arg("cif_path"),
+    py::arg("method") = "Ewald",
+    py::arg("packed") = false,
+    py::arg("lambda") = 1.2,
+    py::arg("hI0") = -2.0,
+    py::arg("mR") = 2,
+    py::arg("mK") = 2,
+    py::arg("eta") = 50.0,
+    py::arg("rmax") = 20.0,
+    py::arg("kmax") = 1.25,
+    py::arg("tol") = 0.0,
+    "The hardness matrix J of run() (Ewald, Direct or NonPeriodic) as an n x n array that owns the "
+    "engine's buffer, atoms in CIF order; packed=True gives the lower triangle by rows, n(n+1)/2 values.");
+
+    py::class_<Factorization>(m, "Factorization")
+        .def("solve", &Factorization::Solve, py::arg("rhs"),
+             "J^-1 rhs for rhs of shape (n,) or (n, k)")
+        .def_readonly("size", &Factorization::n)
+        .def_readonly("labels", &Factorization::labels, "Atoms in the order of the rows")
+        .def_readonly("electronegativity", &Factorization::electronegativity,
+                      "X of each atom: the charges are J^-1 (mu - X) with mu fixing the total charge");
+
+    m.def("factorize", [](const std::string &cif_path,
+                          const std::string &method,
+                          double lambda_val,
+                          double hI0_in,
+                          int mR_in,
+                          int mK_in,
+                          double eta_in,
+                          double rmax,
+                          double kmax,
+                          double tol) {
+
+        std::unique_lock<std::mutex> engine = LockEngine();
+        LoadHardnessStructure(cif_path, method, lambda_val, hI0_in, mR_in, mK_in, eta_in, rmax, kmax, tol);
+        int n = numAtoms;
+        double *A = (double *)workspace.Buffer(ws_Matrix, (size_t)n * n * sizeof(double));
+        {
+            py::gil_scoped_release release;
+            AssembleHardness(A);
+            LDLTFactor(A, n);
+        }
+        size_t bytes;
+        workspace.Detach(ws_Matrix, bytes);
+        auto factorization = std::make_unique<Factorization>(A, bytes, n);
+        factorization->labels = Label;
+        factorization->electronegativity = X;
+        return factorization;
+    },
+    py::arg("cif_path"),
+    py::arg("method") = "Ewald",
+    py::arg("lambda") = 1.2,
+    py::arg("hI0") = -2.0,
+    py::arg("mR") = 2,
+    py::arg("mK") = 2,
+    py::arg("eta") = 50.0,
+    py::arg("rmax") = 20.0,
+    py::arg("kmax") = 1.25,
+    py::arg("tol") = 0.0,
+    "Assemble and factorize (LDL^T) the hardness matrix once; the result's solve(rhs) then costs O(n^2) "
+    "per right-hand side.");
+
+    m.def("direct_shells", []() { return directShells; },
+    "Number of image shells used by the last run(method=\"Direct\", tol=...).");
+}
+#elif defined(EQEQ_CLI)
+static void Usage() {
+    cout << "Usage: eqeq_cli [options] CIF... (wildcards are expanded, e.g. 'structures/*.cif')\n"
+            "  --list FILE        also read CIF paths from FILE, one per line\n"
+            "  --method M         Ewald (default), Direct, NonPeriodic or Wolf\n"
+            "  --precision N      digits of the charges (3)\n"
+            "  --lambda X         dielectric screening parameter (1.2)\n"
+            "  --hI0 X            electron affinity of hydrogen (-2.0)\n"
+            "  --mR N, --mK N     real and reciprocal image counts (2; -1 = per axis from --rmax/--kmax)\n"
+            "  --eta X            Ewald splitting parameter (50)\n"
+            "  --rmax X, --kmax X image radius and reciprocal cutoff for --mR/--mK -1 (20, 1.25)\n"
+            "  --tol X            Direct sums: converge image shells to X eV\n"
+            "  --no-symmetry      solve every atom of the P1 cell, not only symmetry-unique ones\n"
+            "  --supercell        block-circulant solve of exact supercells (changes the charges, see README)\n"
+            "  --formats LIST     per-structure outputs, any of cif,pdb,mol (all three unless --table)\n"
+            "  --table FILE       write every charge to one table: file, label, charge\n"
+            "  --store FILE       append every charge to a columnar result store (see read_store)\n"
+            "  --trace FILE       write a Chrome trace (also EQEQ_TRACE=FILE)\n"
+            "  --deadline S       give up on a structure after S seconds and go on with the next\n"
+            "  --screen TOL       Ewald: keep fast approximate charges whose estimated error is at most TOL\n"
+            "  --refine FILE      with --screen, solve the CIF paths in FILE (one per line) in full\n"
+            "  --family           Ewald: solve structures sharing a cell from the first one in it (see README)\n"
+            "  --huge-pages       back the hardness matrix with transparent huge pages\n"
+            "  -j N, --jobs N     worker processes (1)" << endl;
+}
+/*****************************************************************************/
+static string RunWorker(const vector<string> &paths, size_t firstId, const string &method, int precision,
+                        const vector<string> &formats, bool table, const string &storePath, double deadline,
+                        size_t &failed) {
+    // Charges every structure in paths and returns its rows of the combined table; the
+    // structures also go to the result store as they are done, numbered from firstId.
+    // A structure that runs past the deadline is reported and left out, and so is one that
+    // cannot be solved (bad CIF, singular matrix, ...), which is also counted in failed.
+    vector<vector<string> > labels(paths.size());
+    vector<vector<double> > charges(paths.size());
+    bool root = (MPIWorldRank() == 0); // Every MPI rank solves, rank 0 writes
+    unique_ptr<ResultStore> store;
+    if (!storePath.empty() && root) store.reset(new ResultStore(storePath, ""));
+    auto keep = [&](size_t p, double seconds) {
+        if (screenEstimate > screenTol) {
+            cout << paths[p] << ": estimated error " << screenEstimate << " above " << screenTol << ", refined" << endl;
+        }
+        if (table) { labels[p] = Label; charges[p] = Q; }
+        if (store) store->Add(firstId + p, paths[p], seconds);
+    };
+    auto skip = [&](size_t p, const EqeqError &e) {
+        cout << paths[p] << ": " << e.what() << ", skipped" << endl;
+        failed++;
+    };
+
+    if (formats.empty() && (deadline == 0)) {
+        QeqBatch(paths, precision, keep, skip);
+    } else {
+        string suffix = "_EQeq_" + method + "_";
+        AppendFixed(suffix, lambda, 2, 4); suffix += "_"; AppendFixed(suffix, hI0, 2, 4);
+        for (size_t p = 0; p < paths.size(); p++) {
+            double start = Seconds();
+            deadlineTime = (deadline > 0) ? start + deadline : 0;
+            try {
+                LoadStructure(paths[p]);
+                screenSkip = (screenRefine.count(paths[p]) > 0);
+                Qeq();
+                screenSkip = false;
+            } catch (const QeqInterrupted &) {
+                screenSkip = false;
+                StatsPhase(nullptr);
+                cout << paths[p] << ": deadline of " << deadline << " s exceeded, skipped" << endl;
+                continue;
+            } catch (const EqeqError &e) {
+                screenSkip = false;
+                StatsPhase(nullptr);
+                skip(p, e);
+                continue;
+            }
+            StatsPhase("round");
+            RoundCharges(precision);
+            StatsPhase("write");
+            for (const string &format : formats) {
+                if (!root) continue;
+                if (format == "cif") OutputCIFFormatFile(paths[p] + suffix + ".cif");
+                if (format == "pdb") OutputPDBFormatFile(paths[p] + suffix + ".pdb");
+                if (format == "mol") OutputMOLFormatFile(paths[p] + suffix + ".mol");
+            }
+            StatsPhase(nullptr);
+            keep(p, Seconds() - start);
+        }
+    }
+
+    string rows;
+    if (table) {
+        for (size_t p = 0; p < paths.size(); p++) {
+            for (size_t i = 0; i < labels[p].size(); i++) {
+                rows += paths[p]; rows += '\t'; rows += labels[p][i]; rows += '\t';
+                AppendFixed(rows, charges[p][i], precision);
+                rows += '\n';
+            }
+        }
+    }
+    return rows;
+}
+/*****************************************************************************/
+static int Main(int argc, char *argv[]) {
+    vector<string> paths, formats;
+    string method = "Ewald", tablePath, storePath, list, trace, refineList;
+    int precision = 3, jobs = 1;
+    double deadline = 0;
+    bool formatsGiven = false;
+
+    // Under mpirun every rank runs the whole program, as each takes part in every solve, but
+    // only rank 0 prints and writes files
+    bool root = (MPIWorldRank() == 0);
+    if (!root && !freopen("/dev/null", "w", stdout)) return 1;
+
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        auto value = [&]() -> string {
+            if (a + 1 >= argc) { cout << "Missing value for " << arg << endl; exit(1); }
+            return argv[++a];
+        };
+        if (arg == "-h" || arg == "--help") { Usage(); return 0; }
+        else if (arg == "--list") list = value();
+        else if (arg == "--method") method = value();
+        else if (arg == "--precision") precision = atoi(value().c_str());
+        else if (arg == "--lambda") lambda = atof(value().c_str());
+        else if (arg == "--hI0") hI0 = atof(value().c_str());
+        else if (arg == "--mR") mR = atoi(value().c_str());
+        else if (arg == "--mK") mK = atoi(value().c_str());
+        else if (arg == "--eta") eta = atof(value().c_str());
+        else if (arg == "--rmax") realRadius = atof(value().c_str());
+        else if (arg == "--kmax") kCutoff = atof(value().c_str());
+        else if (arg == "--tol") directTol = atof(value().c_str());
+        else if (arg == "--symmetry") useSymmetry = true;
+        else if (arg == "--no-symmetry") useSymmetry = false;
+        else if (arg == "--supercell") useSupercell = true;
+        else if (arg == "--no-supercell") useSupercell = false;
+        else if (arg == "--table") tablePath = value();
+        else if (arg == "--store") storePath = value();
+        else if (arg == "--trace") trace = value();
+        else if (arg == "--deadline") deadline = atof(value().c_str());
+        else if (arg == "--huge-pages") useHugePages = true;
+        else if (arg == "--screen") screenTol = atof(value().c_str());
+        else if (arg == "--refine") refineList = value();
+        else if (arg == "--family") useFamily = true;
+        else if (arg == "-j" || arg == "--jobs") jobs = max(1, atoi(value().c_str()));
+        else if (arg == "--formats") {
+            formatsGiven = true;
+            stringstream stream(value()); string format;
+            while (getline(stream, format, ',')) {
+                if (format != "cif" && format != "pdb" && format != "mol") { cout << "Unknown format " << format << endl; exit(1); }
+                formats.push_back(format);
+            }
+        }
+        else if (arg.size() > 1 && arg[0] == '-') { cout << "Unknown option " << arg << endl; Usage(); exit(1); }
+        else if (arg.find_first_of("*?[") != string::npos) {
+            glob_t matches;
+            if (glob(arg.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; i++) paths.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        }
+        else paths.push_back(arg);
+    }
+    if (!list.empty()) {
+        ifstream listInput(list.c_str());
+        if (!listInput) { cout << list << " is not a valid filename" << endl; exit(1); }
+        string line;
+        while (getline(listInput, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) paths.push_back(line);
+        }
+    }
+    if (!refineList.empty()) {
+        ifstream refineInput(refineList.c_str());
+        if (!refineInput) { cout << refineList << " is not a valid filename" << endl; exit(1); }
+        string line;
+        while (getline(refineInput, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) screenRefine.insert(line);
+        }
+    }
+    if (paths.empty()) { Usage(); exit(1); }
+    if (!formatsGiven && tablePath.empty() && storePath.empty()) formats = {"cif", "mol", "pdb"};
+
+    chargePrecision = precision;
+    useWolf = false;
+    SelectMethod(method);
+    if (!isPeriodic) method = "NonPeriodic";
+    else if (useWolf) method = "Wolf";
+    else method = useEwardSums ? "Ewald" : "Direct";
+    LoadTables();
+    if (!trace.empty() && !traceEnabled && root) {
+        TraceBegin(trace);
+        atexit([]() { TraceEnd(); });
+    }
+
+    // The solver state is global, so the workers are processes: each takes a contiguous
+    // slice of the paths and hands its table rows back through a part file
+    jobs = min(jobs, (int)paths.size());
+    if ((jobs > 1) && (MPIWorldSize() > 1)) { // Forked workers cannot share the ranks' communicator
+        cout << "Ignoring --jobs under MPI" << endl;
+        jobs = 1;
+    }
+    bool table = !tablePath.empty();
+    if (!storePath.empty() && root) { // Run parameters, before any worker appends
+        ResultStore meta(storePath, BatchParameters(method, precision));
+    }
+    string rows;
+    size_t failed = 0; // Structures that could not be solved (under -j, workers that skipped any)
+    if (jobs == 1) {
+        rows = RunWorker(paths, 0, method, precision, formats, table, storePath, deadline, failed);
+    } else {
+        vector<pid_t> workers;
+        for (int w = 0; w < jobs; w++) {
+            size_t first = paths.size() * w / jobs, last = paths.size() * (w + 1) / jobs;
+            pid_t pid = fork();
+            if (pid < 0) { cout << "Cannot start worker process" << endl; exit(1); }
+            if (pid == 0) { // Leaves by _exit on every path: the atexit handlers belong to the parent
+                // Exit status 0: all solved; 2: the part is complete but some structures were
+                // skipped; anything else: the worker itself failed
+                int status = 0;
+                try {
+                    vector<string> slice(paths.begin() + first, paths.begin() + last);
+                    size_t sliceFailed = 0;
+                    string part = RunWorker(slice, first, method, precision, formats, table, storePath, deadline, sliceFailed);
+                    if (table) WriteFile(tablePath + ".part" + to_string(w), part);
+                    if (traceEnabled) WriteFile(tracePath + ".part" + to_string(w), TraceEventsJSON());
+                    if (sliceFailed > 0) status = 2;
+                } catch (const exception &e) {
+                    cout << e.what() << ". Exiting" << endl;
+                    status = 1;
+                } catch (...) {
+                    status = 1;
+                }
+                fflush(stdout);
+                _exit(status);
+            }
+            workers.push_back(pid);
+        }
+        bool crashed = false;
+        for (pid_t pid : workers) {
+            int status;
+            waitpid(pid, &status, 0);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 2) failed++;
+            else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) crashed = true;
+        }
+        for (int w = 0; w < jobs && table; w++) {
+            string partPath = tablePath + ".part" + to_string(w);
+            ifstream part(partPath.c_str(), ios::binary);
+            rows.append(istreambuf_iterator<char>(part), istreambuf_iterator<char>());
+            part.close();
+            remove(partPath.c_str());
+        }
+        if (traceEnabled) { // The workers' spans join the trace written at exit
+            string events;
+            for (int w = 0; w < jobs; w++) {
+                string partPath = tracePath + ".part" + to_string(w);
+                ifstream part(partPath.c_str(), ios::binary);
+                string text((istreambuf_iterator<char>(part)), istreambuf_iterator<char>());
+                part.close();
+                remove(partPath.c_str());
+                if (text.empty()) continue;
+                if (!events.empty()) events += ",\n";
+                events += text;
+            }
+            TraceEnd(events);
+        }
+        if (crashed) { cout << "A worker process failed" << endl; exit(1); }
+    }
+
+    if (table && root) WriteFile(tablePath, "file\tlabel\tcharge\n" + rows);
+    if (failed > 0) { cout << "Some structures could not be solved (see above)" << endl; return 1; } // The others are written all the same
+    return 0;
+}
+/*****************************************************************************/
+int main(int argc, char *argv[]) {
+    try {
+        return Main(argc, argv);
+    } catch (const EqeqError &e) {
+        cout << e.what() << ". Exiting" << endl;
+        return 1;
+    }
+}
+#elif defined(EQEQ_BENCH)
+static void Usage() {
+    cout << "Usage: eqeq_bench [options]\n"
+            "  --atoms N          atoms of the structure used by the micro-benchmarks (256)\n"
+            "  --sizes LIST       atom counts of the end-to-end sweeps (64,128,256,512,1024)\n"
+            "  --methods LIST     methods to sweep (NonPeriodic,Direct,Ewald,SPME,Screen,Wolf,Tree,HMatrix,MixedPrecision,Tiled)\n"
+            "  --shape A:B:C      cell edge ratios (1:1:1)\n"
+            "  --angles A,B,G     cell angles in degrees (90,90,90)\n"
+            "  --mix LIST         species and weights (Zn:1,O:4,C:8,H:4)\n"
+            "  --volume X         cell volume per atom in cubic Angstroms (15)\n"
+            "  --mR N, --mK N     image counts of the lattice sums (2; -1 = per axis)\n"
+            "  --budget S         stop growing a method once one run takes more than S/8 seconds (20)\n"
+            "  --seed N           random seed (1)\n"
+            "  --skip-micro, --skip-sweep\n"
+            "  --json FILE        write the results to FILE instead of stdout" << endl;
+}
+/*****************************************************************************/
+static string SyntheticCIF(int numAtoms, const double shape[3], const double angles[3], double volumePerAtom,
+                           const vector<pair<string, double> > &mix, unsigned seed) {
+    // A MOF-like P1 cell: atoms on a jittered grid (so no two come closer than ~1 Angstrom
+    // at the default density), species drawn with the weights of mix, and the cell scaled to
+    // numAtoms * volumePerAtom. The result only depends on the arguments.
+    mt19937 random(seed);
+    uniform_real_distribution<double> uniform(0, 1);
+
+    double ca = cos(angles[0]*PI/180), cb = cos(angles[1]*PI/180), cg = cos(angles[2]*PI/180);
+    double unitVolume = shape[0]*shape[1]*shape[2] * sqrt(1 - ca*ca - cb*cb - cg*cg + 2*ca*cb*cg);
+    double scale = cbrt(numAtoms * volumePerAtom / unitVolume);
+
+    int grid[3];
+    double gridScale = cbrt((double)numAtoms / (shape[0]*shape[1]*shape[2]));
+    for (int d = 0; d < 3; d++) grid[d] = max(1, (int)ceil(shape[d] * gridScale));
+    vector<int> cells(grid[0]*grid[1]*grid[2]);
+    iota(cells.begin(), cells.end(), 0);
+    shuffle(cells.begin(), cells.end(), random);
+
+    double totalWeight = 0;
+    for (const auto &species : mix) totalWeight += species.second;
+
+    string out;
+    out += "data_synthetic\n_symmetry_space_group_name_H-M\t'P1'\nloop_\n_symmetry_equiv_pos_as_xyz\n  x,y,z\n";
+    const char *lengthTags[3] = {"_cell_length_a\t", "_cell_length_b\t", "_cell_length_c\t"};
+    const char *angleTags[3] = {"_cell_angle_alpha\t", "_cell_angle_beta\t", "_cell_angle_gamma\t"};
+    for (int d = 0; d < 3; d++) { out += lengthTags[d]; AppendFixed(out, shape[d]*scale, 4); out += "\n"; }
+    for (int d = 0; d < 3; d++) { out += angleTags[d]; AppendFixed(out, angles[d], 4); out += "\n"; }
+    out += "loop_\n_atom_site_label\n_atom_site_type_symbol\n_atom_site_fract_x\n_atom_site_fract_y\n_atom_site_fract_z\n";
+    for (int i = 0; i < numAtoms; i++) {
+        double pick = uniform(random) * totalWeight;
+        size_t t = 0;
+        while ((t + 1 < mix.size()) && (pick >= mix[t].second)) pick -= mix[t++].second;
+        int cell = cells[i];
+        int g[3] = {cell % grid[0], (cell / grid[0]) % grid[1], cell / (grid[0]*grid[1])};
+        out += mix[t].first; AppendInt(out, i + 1); out += "  "; out += mix[t].first;
+        for (int d = 0; d < 3; d++) {
+            out += "  "; AppendFixed(out, (g[d] + 0.5 + 0.3*(uniform(random) - 0.5)) / grid[d], 6);
+        }
+        out += "\n";
+    }
+    out += "_end\n";
+    return out;
+}
+/*****************************************************************************/
+static double TimePerRepetition(const function<void()> &work, int &repetitions) {
+    // Repeats work until 0.2 s have passed (at least once)
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    for (repetitions = 0; (repetitions == 0) || (elapsed < 0.2); ) {
+        work();
+        repetitions++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    return elapsed / repetitions;
+}
+/*****************************************************************************/
+static void ResetMethod(const string &method) {
+    useSPME = false; useTree = false; useWolf = false; useHMatrix = false;
+    useMixedPrecision = false; maxMemory = 0; directTol = 0; screenTol = 0;
+    if (method == "SPME") { SelectMethod("Ewald"); useSPME = true; }
+    else if (method == "Screen") { SelectMethod("Ewald"); screenTol = 0.01; }
+    else if (method == "Tree") { SelectMethod("NonPeriodic"); useTree = true; }
+    else if (method == "HMatrix") { SelectMethod("NonPeriodic"); useHMatrix = true; }
+    else if (method == "MixedPrecision") { SelectMethod("NonPeriodic"); useMixedPrecision = true; }
+    else if (method == "Tiled") { SelectMethod("NonPeriodic"); maxMemory = 1e6; }
+    else SelectMethod(method);
+}
+/*****************************************************************************/
+static int Main(int argc, char *argv[]) {
+    int microAtoms = 256;
+    vector<int> sizes = {64, 128, 256, 512, 1024};
+    vector<string> methods = {"NonPeriodic", "Direct", "Ewald", "SPME", "Screen", "Wolf", "Tree", "HMatrix", "MixedPrecision", "Tiled"};
+    double shape[3] = {1, 1, 1}, angles[3] = {90, 90, 90};
+    vector<pair<string, double> > mix = {{"Zn", 1}, {"O", 4}, {"C", 8}, {"H", 4}};
+    double volumePerAtom = 15, budget = 20;
+    unsigned seed = 1;
+    bool micro = true, sweep = true;
+    string jsonPath;
+
+    auto split = [](const string &text, char separator) {
+        vector<string> parts; stringstream stream(text); string part;
+        while (getline(stream, part, separator)) parts.push_back(part);
+        return parts;
+    };
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        auto value = [&]() -> string {
+            if (a + 1 >= argc) { cout << "Missing value for " << arg << endl; exit(1); }
+            return argv[++a];
+        };
+        if (arg == "-h" || arg == "--help") { Usage(); return 0; }
+        else if (arg == "--atoms") microAtoms = atoi(value().c_str());
+        else if (arg == "--sizes") { sizes.clear(); for (const string &n : split(value(), ',')) sizes.push_back(atoi(n.c_str())); }
+        else if (arg == "--methods") methods = split(value(), ',');
+        else if (arg == "--shape" || arg == "--angles") {
+            vector<string> parts = split(value(), arg == "--shape" ? ':' : ',');
+            if (parts.size() != 3) { cout << arg << " takes three values" << endl; exit(1); }
+            for (int d = 0; d < 3; d++) (arg == "--shape" ? shape : angles)[d] = atof(parts[d].c_str());
+        }
+        else if (arg == "--mix") {
+            mix.clear();
+            for (const string &entry : split(value(), ',')) {
+                size_t colon = entry.find(':');
+                mix.push_back({entry.substr(0, colon), (colon == string::npos) ? 1.0 : atof(entry.substr(colon + 1).c_str())});
+            }
+        }
+        else if (arg == "--volume") volumePerAtom = atof(value().c_str());
+        else if (arg == "--mR") mR = atoi(value().c_str());
+        else if (arg == "--mK") mK = atoi(value().c_str());
+        else if (arg == "--budget") budget = atof(value().c_str());
+        else if (arg == "--seed") seed = atoi(value().c_str());
+        else if (arg == "--skip-micro") micro = false;
+        else if (arg == "--skip-sweep") sweep = false;
+        else if (arg == "--json") jsonPath = value();
+        else { cout << "Unknown option " << arg << endl; Usage(); exit(1); }
+    }
+    LoadTables();
+    useSymmetry = false; useSupercell = false;
+
+    string scratch = (filesystem::temp_directory_path() / ("eqeq_bench_" + to_string(getpid()) + ".cif")).string();
+    auto loadSynthetic = [&](int n) {
+        WriteFile(scratch, SyntheticCIF(n, shape, angles, volumePerAtom, mix, seed));
+        LoadStructure(scratch);
+    };
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    string json = "{\n  \"host\": "; AppendJSONString(json, host);
+    json += ",\n  \"compiler\": "; AppendJSONString(json, __VERSION__);
+    json += ",\n";
+    json += "  \"cache_version\": "; AppendInt(json, cacheVersion);
+#ifdef EQEQ_HAVE_FFTW
+    json += ",\n  \"fftw\": true";
+#else
+    json += ",\n  \"fftw\": false";
+#endif
+    json += ",\n  \"mR\": "; AppendInt(json, mR); json += ", \"mK\": "; AppendInt(json, mK);
+    json += ", \"volume_per_atom\": "; AppendFixed(json, volumePerAtom, 3);
+    json += ", \"seed\": "; AppendInt(json, seed);
+    json += ",\n  \"micro\": [";
+
+    if (micro) {
+        // Micro-benchmarks on one structure: time per operation and per unit of work
+        bool first = true;
+        auto report = [&](const char *name, double seconds, int repetitions, double units, const char *unit) {
+            json += first ? "\n" : ",\n"; first = false;
+            json += "    {\"name\": "; AppendJSONString(json, name); json += ", \"atoms\": "; AppendInt(json, numAtoms);
+            json += ", \"repetitions\": "; AppendInt(json, repetitions);
+            json += ", \"seconds\": "; AppendFixed(json, seconds, 9);
+            json += ", \"ns_per_"; json += unit; json += "\": "; AppendFixed(json, 1e9 * seconds / units, 3);
+            json += "}";
+            cerr << name << ": " << 1e9 * seconds / units << " ns per " << unit << endl;
+        };
+        int repetitions;
+        double seconds;
+
+        loadSynthetic(microAtoms);
+        seconds = TimePerRepetition([&]() { LoadStructure(scratch); }, repetitions);
+        report("parse", seconds, repetitions, numAtoms, "atom");
+
+        // Kernel calls over a fixed sample of pairs
+        vector<pair<int, int> > sample;
+        for (int i = 0; (i < numAtoms) && (sample.size() < 4096); i++) {
+            for (int j = 0; (j < i) && (sample.size() < 4096); j++) sample.push_back({i, j});
+        }
+        volatile double sink = 0;
+        auto pairKernel = [&]() { double sum = 0; for (auto &ij : sample) sum += GetJ(ij.first, ij.second); sink = sum; };
+
+        ResetMethod("NonPeriodic"); SetImageCounts();
+        seconds = TimePerRepetition(pairKernel, repetitions);
+        report("kernel_overlap", seconds, repetitions, sample.size(), "pair");
+
+        ResetMethod("Direct"); SetImageCounts();
+        seconds = TimePerRepetition(pairKernel, repetitions);
+        report("kernel_direct", seconds, repetitions, sample.size() * (double)((2*aVnum+1)*(2*bVnum+1)*(2*cVnum+1)), "term");
+
+        ResetMethod("Ewald"); SetImageCounts();
+        hVnum = 0; jVnum = 0; kVnum = 0; // Real-space images only
+        seconds = TimePerRepetition(pairKernel, repetitions);
+        report("kernel_real", seconds, repetitions, sample.size() * (double)((2*aVnum+1)*(2*bVnum+1)*(2*cVnum+1)), "term");
+
+        SetImageCounts();
+        aVnum = 0; bVnum = 0; cVnum = 0; // Reciprocal space (and the home cell)
+        seconds = TimePerRepetition(pairKernel, repetitions);
+        report("kernel_reciprocal", seconds, repetitions, sample.size() * (double)((2*hVnum+1)*(2*jVnum+1)*(2*kVnum+1) - 1), "term");
+
+        double splitting = min(eta, rcut / 3.5);
+        seconds = TimePerRepetition([&]() { BuildRealSpacePairs(rcut, splitting, false); }, repetitions);
+        report("pair_list", seconds, repetitions, PairCol.size(), "pair");
+
+        SetupSPME(splitting);
+        vector<double> q(numAtoms), phi;
+        for (int i = 0; i < numAtoms; i++) q[i] = (i % 2) ? 0.5 : -0.5;
+        seconds = TimePerRepetition([&]() { SPMEPotential(q, phi); }, repetitions);
+        report("spme_potential", seconds, repetitions, numAtoms, "atom");
+
+        SetImageCounts();
+        vector<vector<double> > A(numAtoms, vector<double>(numAtoms));
+        seconds = TimePerRepetition([&]() {
+            for (int i = 0; i < numAtoms; i++) for (int j = 0; j <= i; j++) A[i][j] = A[j][i] = GetJ(i, j);
+        }, repetitions);
+        report("assembly_ewald", seconds, repetitions, numAtoms * (numAtoms + 1) / 2.0, "element");
+
+        vector<double> b(X.begin(), X.end());
+        seconds = TimePerRepetition([&]() { SolveMatrix(A, b); }, repetitions);
+        report("solve_matrix", seconds, repetitions, pow((double)numAtoms, 3), "n3");
+    }
+    json += "\n  ],\n  \"sweep\": [";
+
+    if (sweep) {
+        // End-to-end: every method at growing sizes, with the per-phase breakdown of run(stats=True)
+        bool first = true;
+        for (const string &method : methods) {
+            for (int n : sizes) {
+                loadSynthetic(n);
+                ResetMethod(method);
+                collectStats = true;
+                ResetStats();
+                auto start = chrono::steady_clock::now();
+                Qeq();
+                StatsPhase(nullptr);
+                double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                collectStats = false;
+
+                json += first ? "\n" : ",\n"; first = false;
+                json += "    {\"method\": "; AppendJSONString(json, method); json += ", \"atoms\": "; AppendInt(json, numAtoms);
+                json += ", \"solver\": "; AppendJSONString(json, solverName); json += ", \"seconds\": "; AppendFixed(json, wall, 6);
+                json += ", \"atoms_per_second\": "; AppendFixed(json, numAtoms / wall, 1);
+                json += ", \"kernel_calls\": "; AppendInt(json, kernelCalls);
+                json += ", \"iterations\": "; AppendInt(json, solverIterations);
+                if (screenEstimate >= 0) { json += ", \"screen_estimate\": "; AppendFixed(json, screenEstimate, 6); }
+                json += ", \"phases\": {";
+                for (size_t p = 0; p < Phases.size(); p++) {
+                    if (p > 0) json += ", ";
+                    json += "\"" + Phases[p].name + "\": "; AppendFixed(json, Phases[p].wall, 6);
+                }
+                json += "}}";
+                cerr << method << " " << numAtoms << " atoms: " << wall << " s" << endl;
+                if (wall > budget / 8) break;
+            }
+        }
+    }
+    json += "\n  ]\n}\n";
+    remove(scratch.c_str());
+
+    if (jsonPath.empty()) cout << json;
+    else WriteFile(jsonPath, json);
+    return 0;
+}
+/*****************************************************************************/
+int main(int argc, char *argv[]) {
+    try {
+        return Main(argc, argv);
+    } catch (const EqeqError &e) {
+        cout << e.what() << ". Exiting" << endl;
+        return 1;
+    }
+}
+#endif
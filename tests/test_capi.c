@@ -0,0 +1,76 @@
+/* The C API of libeqeq (eqeq.h): return codes, eqeq_last_error, and nothing on stdout */
+#include "eqeq.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void Expect(int condition, const char *what) {
+	if (!condition) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+/* Runs eqeq_compute with stdout sent to a scratch file; returns the bytes written there */
+static long ComputeSilently(eqeq_context *ctx, double *charges, int *code) {
+	FILE *capture = tmpfile();
+	if (!capture) return -1;
+	fflush(stdout);
+	int saved = dup(1);
+	dup2(fileno(capture), 1);
+	*code = eqeq_compute(ctx, charges);
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+	struct stat info;
+	long written = (fstat(fileno(capture), &info) == 0) ? (long)info.st_size : -1;
+	fclose(capture);
+	return written;
+}
+
+int main(void) {
+	double charges[3];
+	int code;
+
+	/* A water molecule: neutral, finite charges, no message */
+	eqeq_context *ctx = eqeq_create();
+	double water[9] = {0, 0, 0, 0.757, 0.586, 0, -0.757, 0.586, 0};
+	int waterZ[3] = {8, 1, 1};
+	Expect(eqeq_set_atoms(ctx, 3, water, waterZ) == EQEQ_OK, "set_atoms (water)");
+	Expect(eqeq_set_method(ctx, "nonperiodic") == EQEQ_OK, "set_method (nonperiodic)");
+	Expect(ComputeSilently(ctx, charges, &code) == 0, "water writes nothing to stdout");
+	Expect(code == EQEQ_OK, "water computes");
+	Expect(strcmp(eqeq_last_error(ctx), "") == 0, "water leaves no message");
+	Expect(isfinite(charges[0]) && (charges[0] < 0) && (fabs(charges[0] + charges[1] + charges[2]) < 1e-9), "water charges");
+
+	/* Two H atoms on one site make J singular: EQEQ_FAILED with a message, not NaN charges */
+	double coincident[6] = {1, 1, 1, 1, 1, 1};
+	int hydrogens[2] = {1, 1};
+	Expect(eqeq_set_atoms(ctx, 2, coincident, hydrogens) == EQEQ_OK, "set_atoms (coincident)");
+	Expect(ComputeSilently(ctx, charges, &code) == 0, "coincident atoms write nothing to stdout");
+	Expect(code == EQEQ_FAILED, "coincident atoms fail");
+	Expect(strlen(eqeq_last_error(ctx)) > 0, "coincident atoms leave a message");
+	eqeq_destroy(ctx);
+
+	/* A Direct sum that cannot converge to 1e-14 eV: the warning goes to eqeq_last_error */
+	ctx = eqeq_create();
+	double cell[9] = {5, 0, 0, 0, 5, 0, 0, 0, 5};
+	double salt[6] = {0, 0, 0, 2.5, 2.5, 2.5};
+	int saltZ[2] = {11, 17};
+	Expect(eqeq_set_cell(ctx, cell) == EQEQ_OK, "set_cell");
+	Expect(eqeq_set_atoms(ctx, 2, salt, saltZ) == EQEQ_OK, "set_atoms (salt)");
+	Expect(eqeq_set_method(ctx, "direct") == EQEQ_OK, "set_method (direct)");
+	Expect(eqeq_set_parameter(ctx, "tol", 1e-14) == EQEQ_OK, "set_parameter (tol)");
+	Expect(ComputeSilently(ctx, charges, &code) == 0, "unconverged Direct sum writes nothing to stdout");
+	Expect(code == EQEQ_OK, "unconverged Direct sum still computes");
+	Expect(strstr(eqeq_last_error(ctx), "not converged") != NULL, "unconverged Direct sum is reported in eqeq_last_error");
+	Expect(isfinite(charges[0]) && (charges[0] > 0), "salt charges");
+	eqeq_destroy(ctx);
+
+	if (failures == 0) printf("All C API checks passed\n");
+	return (failures == 0) ? 0 : 1;
+}
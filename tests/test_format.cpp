@@ -0,0 +1,52 @@
+// The output writers' number formatting (AppendFixed, AppendInt) must give the same bytes as
+// printf, for every value the CIF, PDB, MOL and table writers can be handed, and JSON strings
+// (AppendJSONString) must stay valid JSON whatever they hold.
+#define EQEQ_LIBRARY	// The engine without Python and without a main()
+#include "../main.cpp"
+
+static int failures = 0;
+
+static void Check(double value, int decimals, int width, bool signSpace) {
+	string got;
+	AppendFixed(got, value, decimals, width, signSpace);
+	char expected[512];
+	snprintf(expected, sizeof(expected), signSpace ? "% *.*f" : "%*.*f", width, decimals, value);
+	if (got != expected) {
+		printf("AppendFixed(%g, %d, %d, %d): \"%s\", printf gives \"%s\"\n", value, decimals, width, signSpace, got.c_str(), expected);
+		failures++;
+	}
+}
+
+int main() {
+	double values[] = {0.0, -0.0, 0.5, -0.5, 1.0005, -2.675, 13.598, 123456.789, -1e-300,
+		1e55, 1e56, -1e56, 1e57, 1e100, -1.7976931348623157e308, HUGE_VAL, -HUGE_VAL};
+	for (double value : values) {
+		for (int decimals : {0, 3, 6, 17}) {
+			Check(value, decimals, 0, false);
+			Check(value, decimals, 12, false);
+			Check(value, decimals, 0, true);
+			Check(value, decimals, 9, true);
+		}
+	}
+
+	for (long long value : {0LL, 7LL, -42LL, 9223372036854775807LL, -9223372036854775807LL - 1}) {
+		string got;
+		AppendInt(got, value, 8);
+		char expected[32];
+		snprintf(expected, sizeof(expected), "%8lld", value);
+		if (got != expected) {
+			printf("AppendInt(%lld, 8): \"%s\", printf gives \"%s\"\n", value, got.c_str(), expected);
+			failures++;
+		}
+	}
+
+	string json;
+	AppendJSONString(json, "gcc \"12\" C:\\bin\ttab\n");
+	if (json != "\"gcc \\\"12\\\" C:\\\\bin\\u0009tab\\u000a\"") {
+		printf("AppendJSONString: %s\n", json.c_str());
+		failures++;
+	}
+
+	if (failures == 0) printf("All formatting checks passed\n");
+	return (failures == 0) ? 0 : 1;
+}
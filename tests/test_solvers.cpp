@@ -0,0 +1,275 @@
+// Every solver path against the dense solve (QeqDense) of the same structure, on small
+// synthetic cells and molecules, within the accuracy each solver claims. Paths that solve a
+// different operator (SPME, Wolf, screening, family) are held against dense Ewald with
+// converged lattice sums, or against SPME where that is their reference.
+#define EQEQ_LIBRARY	// The engine without Python and without a main()
+#include "../main.cpp"
+
+static int failures = 0;
+static bool verbose = false; // EQEQ_TEST_VERBOSE=1 prints every deviation
+
+// A P1 cell of n atoms on a jittered grid (as eqeq_bench makes them), scaled to 15 A^3 per
+// atom along a, or a molecule in the middle of a box when boxSize > 0. With replicas > 1 the
+// cell is repeated that many times along a.
+static string SyntheticCIF(int n, unsigned seed, double boxSize = 0, int replicas = 1) {
+	mt19937 random(seed);
+	uniform_real_distribution<double> uniform(0, 1);
+	const char *species[] = {"Zn", "O", "O", "O", "C", "C", "C", "H", "H", "N"};
+	int grid = (int)ceil(cbrt((double)n));
+	double edge = cbrt(n * 15.0); // Cell edge, or the molecule's extent
+	double cell[3] = {edge * replicas, edge, edge};
+	if (boxSize > 0) { cell[0] = cell[1] = cell[2] = boxSize; }
+
+	vector<int> sites(grid*grid*grid);
+	iota(sites.begin(), sites.end(), 0);
+	shuffle(sites.begin(), sites.end(), random);
+	vector<array<double, 3> > frac;
+	vector<string> symbol;
+	for (int i = 0; i < n; i++) {
+		int s = sites[i];
+		double f[3] = {(s % grid + 0.5 + 0.3*(uniform(random) - 0.5)) / grid,
+		               ((s / grid) % grid + 0.5 + 0.3*(uniform(random) - 0.5)) / grid,
+		               (s / (grid*grid) + 0.5 + 0.3*(uniform(random) - 0.5)) / grid};
+		if (boxSize > 0) for (double &x : f) x = 0.5 + (x - 0.5) * edge / boxSize;
+		frac.push_back({f[0], f[1], f[2]});
+		symbol.push_back(species[random() % 10]);
+	}
+
+	string out = "data_synthetic\n_symmetry_space_group_name_H-M\t'P1'\nloop_\n_symmetry_equiv_pos_as_xyz\n  x,y,z\n";
+	const char *lengthTags[3] = {"_cell_length_a\t", "_cell_length_b\t", "_cell_length_c\t"};
+	for (int d = 0; d < 3; d++) { out += lengthTags[d]; AppendFixed(out, cell[d], 6); out += '\n'; }
+	out += "_cell_angle_alpha\t90.0\n_cell_angle_beta\t90.0\n_cell_angle_gamma\t90.0\n";
+	out += "loop_\n_atom_site_label\n_atom_site_type_symbol\n_atom_site_fract_x\n_atom_site_fract_y\n_atom_site_fract_z\n";
+	for (int r = 0; r < replicas; r++) {
+		for (int i = 0; i < n; i++) {
+			out += symbol[i] + to_string(r*n + i + 1) + "  " + symbol[i] + "  ";
+			AppendFixed(out, (frac[i][0] + r) / replicas, 6); out += "  ";
+			AppendFixed(out, frac[i][1], 6); out += "  ";
+			AppendFixed(out, frac[i][2], 6); out += '\n';
+		}
+	}
+	out += "_end\n";
+	return out;
+}
+
+// A P2_1 cell (x,y,z and -x,y+1/2,-z) from n atoms of the asymmetric unit, which sit in
+// y < 1/2 so no atom meets its own image
+static string SymmetricCIF(int n, unsigned seed) {
+	string cif = SyntheticCIF(n, seed);
+	string out;
+	stringstream in(cif); string line;
+	bool atoms = false;
+	while (getline(in, line)) {
+		if (line == "  x,y,z") { out += "  x,y,z\n  -x,y+1/2,-z\n"; continue; }
+		if (line.rfind("_cell_length_b", 0) == 0) {
+			out += "_cell_length_b\t"; AppendFixed(out, 2 * atof(line.substr(15).c_str()), 6); out += '\n';
+			continue;
+		}
+		if (line == "_atom_site_fract_z") { out += line + '\n'; atoms = true; continue; }
+		if (atoms && (line != "_end")) {
+			stringstream fields(line); string label, symbol; double x, y, z;
+			fields >> label >> symbol >> x >> y >> z;
+			out += label + "  " + symbol + "  ";
+			AppendFixed(out, x, 6); out += "  "; AppendFixed(out, y / 2, 6); out += "  "; AppendFixed(out, z, 6); out += '\n';
+			continue;
+		}
+		out += line + '\n';
+	}
+	return out;
+}
+
+// The options of run() at their defaults, with no solver state left from the last structure
+static void Defaults() {
+	useSymmetry = true; useSupercell = false; useSpatialOrder = true;
+	useSPME = false; useTree = false; useWolf = false; useHMatrix = false; useMixedPrecision = false;
+	useFamily = false; family = Family();
+	maxMemory = 0; screenTol = 0; screenSkip = false;
+	mR = 2; mK = 2; eta = 50; realRadius = 20; kCutoff = 1.25; directTol = 0;
+	rcut = 12; wolfAlpha = 0.2; treeOrder = 4; theta = 0.5; acaTol = 1e-8;
+	lambda = 1.2; hI0 = -2.0; Qtot = 0;
+	useWolf = false; useEwardSums = true; isPeriodic = true;
+}
+
+static string WriteCIF(const string &cif, const string &name) {
+	string path = (std::filesystem::temp_directory_path() / ("eqeq_test_" + to_string(getpid()) + "_" + name + ".cif")).string();
+	WriteFile(path, cif);
+	return path;
+}
+
+// Unrounded charges in CIF order of the structure in cif, solved with method and options
+static vector<double> Charges(const string &cif, const string &method, const function<void()> &options) {
+	Defaults();
+	SelectMethod(method);
+	options();
+	string path = WriteCIF(cif, "charges");
+	Pos.clear(); Frac.clear(); J.clear(); X.clear(); Label.clear(); Symbol.clear();
+	LoadCIFFile(path);
+	remove(path.c_str());
+	Qeq();
+	return Q;
+}
+
+static void Expect(const string &what, const vector<double> &got, const vector<double> &reference, double tol) {
+	double deviation = (got.size() == reference.size()) ? 0 : HUGE_VAL;
+	for (size_t i = 0; (i < got.size()) && (got.size() == reference.size()); i++) {
+		deviation = max(deviation, std::isfinite(got[i]) ? fabs(got[i] - reference[i]) : HUGE_VAL);
+	}
+	if (verbose) printf("%-48s %.3g (tolerance %.3g)\n", what.c_str(), deviation, tol);
+	if (!(deviation <= tol)) {
+		printf("FAILED: %s deviates from its reference by %g (tolerance %g)\n", what.c_str(), deviation, tol);
+		failures++;
+	}
+}
+
+int main() {
+	verbose = getenv("EQEQ_TEST_VERBOSE") != nullptr;
+	LoadTables();
+	auto none = []() {};
+	auto dense = []() { useSymmetry = false; useSpatialOrder = false; };
+
+	// Exact reformulations of the dense system: the same charges to round-off
+	string cell = SyntheticCIF(48, 1);
+	vector<double> reference = Charges(cell, "Ewald", dense);
+	Expect("Morton order (Ewald)", Charges(cell, "Ewald", none), reference, 1e-10);
+	Expect("tiled, 16 KB budget", Charges(cell, "Ewald", []() { maxMemory = 0.016; }), reference, 1e-10);
+	Expect("mixed precision", Charges(cell, "Ewald", []() { useMixedPrecision = true; }), reference, 1e-10);
+
+	string molecule = SyntheticCIF(300, 3, 40);
+	vector<double> moleculeReference = Charges(molecule, "NonPeriodic", dense);
+	Expect("H-matrix, aca_tol 1e-8 (NonPeriodic)", Charges(molecule, "NonPeriodic", []() { useHMatrix = true; }), moleculeReference, 1e-6);
+	Expect("tree code, order 4 (NonPeriodic)", Charges(molecule, "NonPeriodic", []() { useTree = true; }), moleculeReference, 1e-3);
+	Expect("tree code, order 6 (NonPeriodic)", Charges(molecule, "NonPeriodic", []() { useTree = true; treeOrder = 6; }), moleculeReference, 1e-4);
+
+	// Many small structures in one batch: the charges of solving them one at a time
+	vector<string> paths, cifs;
+	for (int s = 0; s < 20; s++) {
+		cifs.push_back((s % 2) ? SyntheticCIF(4 + s % 3, 10 + s) : SyntheticCIF(4 + s % 3, 10 + s, 20));
+		paths.push_back(WriteCIF(cifs.back(), "batch" + to_string(s)));
+	}
+	for (const char *method : {"NonPeriodic", "Ewald"}) {
+		Defaults(); SelectMethod(method);
+		vector<vector<double> > batched(paths.size());
+		QeqBatch(paths, 8, [&](size_t p, double) { batched[p] = Q; });
+		for (size_t p = 0; p < paths.size(); p++) {
+			Charges(cifs[p], method, none);
+			RoundCharges(8);
+			Expect(string("batched (") + method + ", " + to_string(p) + ")", batched[p], Q, 1e-7);
+		}
+	}
+	// A lane with two atoms on one site: whatever solving it alone does (raise, for these
+	// methods), the batch does too, rather than handing out NaN charges
+	string last = cifs[2].substr(0, cifs[2].rfind("_end"));
+	last = last.substr(last.rfind('\n', last.size() - 2) + 1);
+	string duplicate = cifs[2].substr(0, cifs[2].rfind("_end")) + last + "_end\n";
+	paths[2] = WriteCIF(duplicate, "batch2");
+	for (const char *method : {"NonPeriodic", "Ewald"}) {
+		string single = "charges", batch = "charges";
+		try { Charges(duplicate, method, none); } catch (const EqeqError &e) { single = e.what(); }
+		Defaults(); SelectMethod(method);
+		try { QeqBatch(paths, 8, [](size_t, double) {}); } catch (const EqeqError &e) { batch = e.what(); }
+		if (verbose) printf("two atoms on one site (%s): %s\n", method, single.c_str());
+		if ((batch != single) || (single == "charges")) {
+			printf("FAILED: two atoms on one site (%s): run() gives \"%s\", the batch \"%s\"\n", method, single.c_str(), batch.c_str());
+			failures++;
+		}
+		// With a fail callback (eqeq_cli) only that structure is left out
+		size_t emitted = 0; vector<size_t> failed;
+		Defaults(); SelectMethod(method);
+		QeqBatch(paths, 8, [&](size_t, double) { emitted++; }, [&](size_t p, const EqeqError &) { failed.push_back(p); });
+		if ((failed != vector<size_t>{2}) || (emitted != paths.size() - 1)) {
+			printf("FAILED: batch with a fail callback (%s): %zu failed, %zu solved\n", method, failed.size(), emitted);
+			failures++;
+		}
+	}
+	for (const string &path : paths) remove(path.c_str());
+
+	// Converged lattice sums: the reference of the solvers built on converged Ewald
+	auto converged = []() { useSymmetry = false; useSpatialOrder = false; mR = -1; mK = -1; realRadius = 20; kCutoff = 3; eta = 2.5; };
+	vector<double> ewald = Charges(cell, "Ewald", converged);
+	vector<double> spme = Charges(cell, "Ewald", []() { useSPME = true; });
+	Expect("SPME against converged dense Ewald", spme, ewald, 1e-5);
+	Expect("Wolf against converged dense Ewald", Charges(cell, "Wolf", none), ewald, 0.02);
+	Expect("screening, refined, against SPME", Charges(cell, "Ewald", []() { screenTol = 1e-12; }), spme, 1e-6);
+	Expect("screening, kept, against SPME", Charges(cell, "Ewald", []() { screenTol = 1; }), spme, 0.05);
+
+	// A family: the parent, then a sibling with one atom fewer, each against its own SPME solve
+	string sibling = cell.substr(0, cell.rfind('\n', cell.rfind("_end") - 2) + 1) + "_end\n"; // Without the last atom
+	Expect("family parent against SPME", Charges(cell, "Ewald", []() { useFamily = true; }), spme, 1e-6);
+	Family parent = family;
+	vector<double> siblingSPME = Charges(sibling, "Ewald", []() { useSPME = true; });
+	Expect("family sibling against SPME", Charges(sibling, "Ewald", [&]() { useFamily = true; family = parent; }), siblingSPME, 1e-6);
+	if (familyMatched != 47) { printf("FAILED: the sibling matched %d of its 47 atoms to the parent\n", familyMatched); failures++; }
+
+	// A parent interrupted halfway through its blocks leaves no family: the next structure in
+	// the cell becomes the parent rather than a sibling of half a parent
+	progressCallback = [](const char *stage, double fraction) {
+		if ((solverName == "family") && (strcmp(stage, "assemble") == 0) && (fraction > 0)) throw QeqInterrupted(false);
+	};
+	bool interrupted = false;
+	try { Charges(cell, "Ewald", []() { useFamily = true; }); } catch (const QeqInterrupted &) { interrupted = true; }
+	progressCallback = nullptr;
+	Family left = family;
+	Expect("family after an interrupted parent", Charges(sibling, "Ewald", [&]() { useFamily = true; family = left; }), siblingSPME, 1e-6);
+	if (!interrupted || (left.numAtoms != 0) || (familyMatched != -1)) {
+		printf("FAILED: an interrupted parent left a family of %d atoms behind\n", left.numAtoms);
+		failures++;
+	}
+
+	// Another framework in the same cell shares too little with the parent, and replaces it
+	string other = SyntheticCIF(48, 7);
+	vector<double> otherSPME = Charges(other, "Ewald", []() { useSPME = true; });
+	Expect("family, another framework in the cell", Charges(other, "Ewald", [&]() { useFamily = true; family = parent; }), otherSPME, 1e-6);
+	int replaced = familyMatched;
+	Family newParent = family;
+	Charges(other, "Ewald", [&]() { useFamily = true; family = newParent; });
+	if ((replaced != -1) || (familyMatched != 48)) {
+		printf("FAILED: another framework in the cell did not become the parent (matched %d, then %d of 48)\n", replaced, familyMatched);
+		failures++;
+	}
+
+	// C API contexts keep their family parents apart, from each other and from the engine's
+	Charges(cell, "Ewald", dense);
+	vector<double> xyz; vector<int> numbers;
+	for (int i = 0; i < numAtoms; i++) {
+		xyz.insert(xyz.end(), {Pos[i].x, Pos[i].y, Pos[i].z});
+		for (int z = 0; z < TABLE_OF_ELEMENTS_SIZE; z++) {
+			if (IonizationData[z].Label == (Symbol[i] + " ").substr(0, 2)) { numbers.push_back(z + 1); break; }
+		}
+	}
+	double rows[9] = {aLength, 0, 0, 0, bLength, 0, 0, 0, cLength};
+	Defaults();
+	useHugePages = true; // Of an earlier eqeq.run
+	eqeq_context *first = eqeq_create(), *second = eqeq_create();
+	vector<double> charges(numbers.size());
+	vector<int> matched;
+	for (eqeq_context *ctx : {first, first, second}) {
+		eqeq_set_cell(ctx, rows);
+		eqeq_set_atoms(ctx, numbers.size(), xyz.data(), numbers.data());
+		eqeq_set_parameter(ctx, "family", 1);
+		matched.push_back((eqeq_compute(ctx, charges.data()) == EQEQ_OK) ? familyMatched : -2);
+	}
+	eqeq_destroy(first); eqeq_destroy(second);
+	if ((matched != vector<int>{-1, 48, -1}) || (family.numAtoms != 0) || useHugePages) {
+		printf("FAILED: contexts share state (atoms matched to a parent: %d, %d, %d)\n", matched[0], matched[1], matched[2]);
+		failures++;
+	}
+
+	// Symmetry and supercells: exact at converged lattice sums (at finite mR, mK the truncated
+	// image box is not invariant under the operations, and the charges differ by ~0.01 e)
+	string symmetric = SymmetricCIF(24, 2);
+	Expect("symmetry-adapted (P2_1)", Charges(symmetric, "Ewald", []() { mR = -1; mK = -1; realRadius = 20; kCutoff = 3; eta = 2.5; }),
+		Charges(symmetric, "Ewald", converged), 1e-10);
+
+	runWarnings.clear();
+	Charges(symmetric, "Ewald", []() { useMixedPrecision = true; });
+	if (runWarnings.find("mixed_precision not used: the symmetry-adapted solver") == string::npos) {
+		printf("FAILED: no warning that the symmetry-adapted solver took precedence over mixed_precision\n");
+		failures++;
+	}
+	string supercell = SyntheticCIF(12, 4, 0, 2);
+	Expect("block-circulant (2 x 1 x 1 supercell)", Charges(supercell, "Ewald", []() { useSupercell = true; mR = -1; mK = -1; realRadius = 20; kCutoff = 3; eta = 2.5; }),
+		Charges(supercell, "Ewald", converged), 1e-10);
+
+	if (failures == 0) printf("All solver checks passed\n");
+	return (failures == 0) ? 0 : 1;
+}